@@ -0,0 +1,156 @@
+// ===================================================================================  //
+//    This program is free software: you can redistribute it and/or modify              //
+//    it under the terms of the GNU General Public License as published by              //
+//    the Free Software Foundation, either version 3 of the License, or                 //
+//    (at your option) any later version.                                               //
+//                                                                                      //
+//    This program is distributed in the hope that it will be useful,                   //
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of                    //
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                     //
+//    GNU General Public License for more details.                                      //
+//                                                                                      //
+//    You should have received a copy of the GNU General Public License                 //
+//    along with this program.  If not, see <https://www.gnu.org/licenses/>.            //
+//                                                                                      //
+//    Copyright: Luiz Gustavo Pfitscher e Feldmann, 2020                                //
+// ===================================================================================  //
+
+#include "arena.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define ALIGN_UP(n) (((n) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1))
+
+static arena_block_t* new_block(size_t size)
+{
+    arena_block_t* block = (arena_block_t*)malloc(sizeof(arena_block_t) + size);
+    if (block == NULL)
+        return NULL;
+
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+arena_t* arena_create(size_t block_size)
+{
+    arena_t* arena = (arena_t*)malloc(sizeof(arena_t));
+    if (arena == NULL)
+        return NULL;
+
+    *arena = (arena_t){
+        .block_size = ALIGN_UP(block_size ? block_size : ARENA_DEFAULT_BLOCK_SIZE),
+    };
+
+    if ((arena->first = arena->current = new_block(arena->block_size)) == NULL)
+    {
+        free(arena);
+        return NULL;
+    }
+
+    return arena;
+}
+
+void arena_free(arena_t* arena)
+{
+    if (arena == NULL)
+        return;
+
+    for (arena_block_t* block = arena->first; block != NULL; )
+    {
+        arena_block_t* next = block->next;
+        free(block);
+        block = next;
+    }
+
+    free(arena);
+}
+
+// releases everything allocated so far - the blocks are kept for the next packet
+void arena_reset(arena_t* arena)
+{
+    if (arena == NULL)
+        return;
+
+    for (arena_block_t* block = arena->first; block != NULL; block = block->next)
+        block->used = 0;
+
+    arena->current = arena->first;
+    arena->allocated = 0;
+}
+
+void* arena_alloc(arena_t* arena, size_t size)
+{
+    size = ALIGN_UP(size ? size : 1);
+
+    arena_block_t* block = arena->current;
+
+    // move on to the next empty block that fits - or put a new one right after the current
+    while (block->used + size > block->size)
+    {
+        if (block->next == NULL || block->next->size < size)
+        {
+            arena_block_t* added = new_block(size > arena->block_size ? size : arena->block_size);
+            if (added == NULL)
+                return NULL;
+
+            added->next = block->next;
+            block->next = added;
+        }
+
+        block = block->next;
+    }
+
+    void* ptr = block->data + block->used;
+    block->used += size;
+    arena->current = block;
+
+    arena->allocated += size;
+    if (arena->allocated > arena->peak)
+        arena->peak = arena->allocated;
+
+    return ptr;
+}
+
+void* arena_calloc(arena_t* arena, size_t count, size_t size)
+{
+    if (size != 0 && count > (size_t)-1 / size)
+        return NULL;
+
+    void* ptr = arena_alloc(arena, count * size);
+    if (ptr != NULL)
+        memset(ptr, 0, count * size);
+
+    return ptr;
+}
+
+// resizes an allocation - in place when it is the last one taken from the current block
+void* arena_grow(arena_t* arena, void* ptr, size_t old_size, size_t new_size)
+{
+    if (ptr == NULL)
+        return arena_alloc(arena, new_size);
+
+    if (new_size <= old_size)
+        return ptr;
+
+    arena_block_t* block = arena->current;
+    old_size = ALIGN_UP(old_size);
+    new_size = ALIGN_UP(new_size);
+
+    if ((char*)ptr + old_size == block->data + block->used && block->used - old_size + new_size <= block->size)
+    {
+        block->used += new_size - old_size;
+        arena->allocated += new_size - old_size;
+        if (arena->allocated > arena->peak)
+            arena->peak = arena->allocated;
+
+        return ptr;
+    }
+
+    void* grown = arena_alloc(arena, new_size);
+    if (grown != NULL)
+        memcpy(grown, ptr, old_size);
+
+    return grown;
+}
@@ -0,0 +1,52 @@
+// ===================================================================================  //
+//    This program is free software: you can redistribute it and/or modify              //
+//    it under the terms of the GNU General Public License as published by              //
+//    the Free Software Foundation, either version 3 of the License, or                 //
+//    (at your option) any later version.                                               //
+//                                                                                      //
+//    This program is distributed in the hope that it will be useful,                   //
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of                    //
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                     //
+//    GNU General Public License for more details.                                      //
+//                                                                                      //
+//    You should have received a copy of the GNU General Public License                 //
+//    along with this program.  If not, see <https://www.gnu.org/licenses/>.            //
+//                                                                                      //
+//    Copyright: Luiz Gustavo Pfitscher e Feldmann, 2020                                //
+// ===================================================================================  //
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+// Bump allocator for memory that lives exactly as long as one packet is being handled.
+// Allocating is a pointer increment and releasing is a reset of every block at once, so the
+// request path never goes to the system allocator once the blocks have grown to the working size.
+
+#define ARENA_ALIGNMENT 16
+#define ARENA_DEFAULT_BLOCK_SIZE (64 * 1024)
+
+typedef struct arena_block {
+    struct arena_block* next;
+    size_t size;        // usable bytes in data
+    size_t used;
+    _Alignas(ARENA_ALIGNMENT) char data[];
+} arena_block_t;
+
+typedef struct arena {
+    arena_block_t* first;
+    arena_block_t* current;     // block allocations are taken from - the ones after it are empty
+    size_t block_size;
+    size_t allocated;           // bytes handed out since the last reset
+    size_t peak;                // most bytes ever handed out between two resets
+} arena_t;
+
+arena_t* arena_create(size_t block_size);
+void arena_free(arena_t* arena);
+void arena_reset(arena_t* arena);
+void* arena_alloc(arena_t* arena, size_t size);
+void* arena_calloc(arena_t* arena, size_t count, size_t size);
+void* arena_grow(arena_t* arena, void* ptr, size_t old_size, size_t new_size);
+
+#endif // _ARENA_H_
@@ -0,0 +1,939 @@
+// ===================================================================================  //
+//    This program is free software: you can redistribute it and/or modify              //
+//    it under the terms of the GNU General Public License as published by              //
+//    the Free Software Foundation, either version 3 of the License, or                 //
+//    (at your option) any later version.                                               //
+//                                                                                      //
+//    This program is distributed in the hope that it will be useful,                   //
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of                    //
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                     //
+//    GNU General Public License for more details.                                      //
+//                                                                                      //
+//    You should have received a copy of the GNU General Public License                 //
+//    along with this program.  If not, see <https://www.gnu.org/licenses/>.            //
+//                                                                                      //
+//    Copyright: Luiz Gustavo Pfitscher e Feldmann, 2020                                //
+// ===================================================================================  //
+
+#ifndef _WIN32
+    #define _GNU_SOURCE
+#endif
+
+#include "dns_protocol.h"
+#include "socket_compat.h"
+#include "zone_file.h"
+#include "zone_image.h"
+#include "blocklist.h"
+#include "rate_limit.h"
+#include "arena.h"
+#include "clock_compat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+    #include <sys/select.h>
+#endif
+
+// Benchmarks of the server, in three modes:
+//  micro     times the parsing, reply building, serialization, zone loading, blocklist and rate limit functions over synthetic zones
+//  load      closed-loop load generator: keeps a fixed number of queries in flight against a running server
+//            and reports the throughput and latency percentiles - like dnsperf
+//  upstream  fake upstream server answering every query, so the load generator's misses have somewhere to go
+
+#define BUFFLEN 1024
+#define MIN_BENCH_NS 500000000ull   // each micro-benchmark runs for at least this long
+#define BENCH_QUERIES 1024          // distinct queries each micro-benchmark cycles through
+#define MAX_ZONE_SIZES 8
+
+#ifdef _WIN32
+    #define NULL_DEVICE "NUL"
+#else
+    #define NULL_DEVICE "/dev/null"
+#endif
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ull;
+
+static uint32_t NextRandom(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (uint32_t)((rng_state * 2685821657736338717ull) >> 32);
+}
+
+// writes a standard query for the name to the buffer - returns its length
+static int WriteQuery(char* buffer, int size, const char* name, uint16_t qtype, uint16_t id)
+{
+    dns_question_t question = { .qtype = qtype, .qclass = DNS_CLASS_IN };
+    snprintf(question.qname, sizeof(question.qname), "%s", name);
+
+    dns_transaction_t query = {
+        .header = { .id = id, .flags = FLAG_RD, .QDCount = 1 },
+        .questions = &question,
+    };
+
+    return write_dns_transaction(buffer, size, &query);
+}
+
+// collects the owner names of the zone - returns their count
+static unsigned int ZoneNames(const dns_zone_t* zone, const char*** names)
+{
+    unsigned int count = 0;
+    *names = (const char**)malloc(sizeof(char*) * (zone->index_size + 1));
+
+    for (unsigned int b = 0; *names && b < zone->index_size; b++)
+        if (zone->index[b].count > 0)
+            (*names)[count++] = zone->names + zone->index[b].name;
+
+    return count;
+}
+
+// SYNTHETIC ZONES
+// ================================================================
+// writes a zone of the given number of records: mostly A records with one CNAME in ten
+static int WriteSyntheticZone(const char* filename, unsigned int records)
+{
+    FILE* fp = fopen(filename, "wb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "\nError creating %s", filename);
+        return -1;
+    }
+
+    fprintf(fp, "$ORIGIN bench.example.\n$TTL 1h\n");
+    fprintf(fp, "@ IN NS ns\n");
+    fprintf(fp, "ns IN A 10.255.255.254\n");
+
+    for (unsigned int i = 2; i < records; i++)
+    {
+        if (i % 10 == 9)
+            fprintf(fp, "c%u IN CNAME h%u\n", i, i - 1);
+        else
+            fprintf(fp, "h%u IN A 10.%u.%u.%u\n", i, (i >> 16) & 0xFF, (i >> 8) & 0xFF, i & 0xFF);
+    }
+
+    fclose(fp);
+    return 0;
+}
+
+// writes a blocklist in hosts format with the given number of names, none of them in the synthetic zones
+static int WriteSyntheticBlocklist(const char* filename, unsigned int names)
+{
+    FILE* fp = fopen(filename, "wb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "\nError creating %s", filename);
+        return -1;
+    }
+
+    fprintf(fp, "# synthetic blocklist\n");
+
+    for (unsigned int i = 0; i < names; i++)
+        fprintf(fp, "0.0.0.0 t%u.ads.example\n", i);
+
+    fclose(fp);
+    return 0;
+}
+
+// MICRO-BENCHMARKS
+// ================================================================
+typedef struct bench_timer {
+    uint64_t start;
+    uint64_t iterations;
+} bench_timer_t;
+
+// tells if the benchmark ran long enough - checked every 64 iterations so the clock stays out of the measurement
+static int KeepRunning(bench_timer_t* timer)
+{
+    if (timer->iterations == 0)
+        timer->start = monotonic_ns();
+
+    return (++timer->iterations & 63) != 0 || monotonic_ns() - timer->start < MIN_BENCH_NS;
+}
+
+static void PrintResult(const char* name, unsigned int records, const bench_timer_t* timer)
+{
+    double ns = (double)(monotonic_ns() - timer->start) / (double)timer->iterations;
+    fprintf(stderr, "\n%-28s %8u records %14.1f ns/op %14.1f ops/s", name, records, ns, 1e9 / ns);
+}
+
+// the OPT record added for an EDNS query keeps the RCODE of the reply - an NXDOMAIN sinkhole answer here - unless it carries BADVERS
+static int CheckEdnsRcode(const dns_view_t* blocked, dns_blocklist_t* list)
+{
+    char reply[BUFFLEN];
+    int nxdomain = list->nxdomain;
+    list->nxdomain = 1;
+
+    int length = write_blocked_reply(blocked, list, reply, sizeof(reply));
+    int kept = length > 0 && dns_append_opt(reply, length, sizeof(reply), EDNS_MIN_PAYLOAD, 0) > 0 && (reply[3] & RC_MASK) == RC_NAMEERROR;
+
+    length = write_blocked_reply(blocked, list, reply, sizeof(reply));
+    int badvers = length > 0 && dns_append_opt(reply, length, sizeof(reply), EDNS_MIN_PAYLOAD, EDNS_BADVERS) > 0 &&
+                  (reply[3] & RC_MASK) == (EDNS_BADVERS & RC_MASK) && reply[length + 5] == (EDNS_BADVERS >> 4);
+
+    list->nxdomain = nxdomain;
+
+    if (!kept || !badvers)
+    {
+        fprintf(stderr, "\nWrong RCODE in the replies with an OPT record:%s%s", kept ? "" : " NXDOMAIN lost", badvers ? "" : " BADVERS not set");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int RunMicroBenchmarks(const unsigned int* sizes, unsigned int size_count)
+{
+    // the library reports every query on the console - keep that out of the measurement
+    fflush(stdout);
+    if (freopen(NULL_DEVICE, "w", stdout) == NULL)
+        fprintf(stderr, "\nCould not discard the console output - the results will include it");
+
+    fprintf(stderr, "\n%-28s %16s %20s %20s", "benchmark", "zone", "time", "throughput");
+
+    for (unsigned int s = 0; s < size_count; s++)
+    {
+        char filename[64];
+        snprintf(filename, sizeof(filename), "bench_zone_%u.txt", sizes[s]);
+
+        if (WriteSyntheticZone(filename, sizes[s]) != 0)
+            return -1;
+
+        // loading - repeated while it takes less than the minimum time, keeping the last zone loaded
+        dns_zone_t zone;
+        bench_timer_t timer = { .start = monotonic_ns() };
+
+        for (;;)
+        {
+            if (read_zone_file(filename, &zone) <= 0)
+            {
+                fprintf(stderr, "\nFailed to load the synthetic zone %s", filename);
+                remove(filename);
+                return -1;
+            }
+
+            if (++timer.iterations >= 1000 || monotonic_ns() - timer.start >= MIN_BENCH_NS)
+                break;
+
+            free_zone(&zone);
+        }
+
+        PrintResult("read_zone_file", zone.record_count, &timer);
+
+        // the same zone from its compiled image
+        char image[80];
+        snprintf(image, sizeof(image), "%s%s", filename, ZONE_IMAGE_SUFFIX);
+
+        if (write_zone_image(&zone, filename, image) == 0)
+        {
+            dns_zone_t mapped;
+            timer = (bench_timer_t){ .start = monotonic_ns() };
+
+            do
+            {
+                read_zone_file(filename, &mapped);
+                free_zone(&mapped);
+            }
+            while (++timer.iterations < 1000 && monotonic_ns() - timer.start < MIN_BENCH_NS);
+
+            PrintResult("read_zone_file (image)", zone.record_count, &timer);
+            remove(image);
+        }
+
+        remove(filename);
+
+        // the queries cycled through - names picked at random from the zone
+        const char** names = NULL;
+        unsigned int name_count = ZoneNames(&zone, &names);
+        if (name_count == 0)
+        {
+            free(names);
+            free_zone(&zone);
+            return -1;
+        }
+
+        static char datagrams[BENCH_QUERIES][BUFFLEN];
+        static int lengths[BENCH_QUERIES];
+        static dns_transaction_t* queries[BENCH_QUERIES];
+        static dns_transaction_t* replies[BENCH_QUERIES];
+
+        for (unsigned int q = 0; q < BENCH_QUERIES; q++)
+        {
+            lengths[q] = WriteQuery(datagrams[q], BUFFLEN, names[NextRandom() % name_count], DNS_TYPE_A, (uint16_t)q);
+            queries[q] = read_dns_transaction(datagrams[q], lengths[q], NULL);
+            replies[q] = build_dns_reply_from_query(queries[q], &zone, NULL);
+        }
+
+        arena_t* arena = arena_create(ARENA_DEFAULT_BLOCK_SIZE);
+
+        timer = (bench_timer_t){ 0 };
+        while (KeepRunning(&timer))
+        {
+            unsigned int q = timer.iterations % BENCH_QUERIES;
+            free_dns_transaction(read_dns_transaction(datagrams[q], lengths[q], arena));
+        }
+        PrintResult("read_dns_transaction", zone.record_count, &timer);
+
+        timer = (bench_timer_t){ 0 };
+        while (KeepRunning(&timer))
+        {
+            unsigned int q = timer.iterations % BENCH_QUERIES;
+            free_dns_transaction(build_dns_reply_from_query(queries[q], &zone, arena));
+        }
+        PrintResult("build_dns_reply_from_query", zone.record_count, &timer);
+
+        char out[BUFFLEN];
+        timer = (bench_timer_t){ 0 };
+        while (KeepRunning(&timer))
+        {
+            unsigned int q = timer.iterations % BENCH_QUERIES;
+            if (replies[q])
+                write_dns_transaction(out, sizeof(out), replies[q]);
+        }
+        PrintResult("write_dns_transaction", zone.record_count, &timer);
+
+        // the blocklist, as large as the zone - kept from the last load like the zone
+        snprintf(filename, sizeof(filename), "bench_blocklist_%u.txt", sizes[s]);
+        dns_blocklist_t blocklist = { 0 };
+
+        if (WriteSyntheticBlocklist(filename, sizes[s]) == 0)
+        {
+            timer = (bench_timer_t){ .start = monotonic_ns() };
+
+            for (;;)
+            {
+                read_blocklist_file(filename, &blocklist);
+
+                if (++timer.iterations >= 1000 || monotonic_ns() - timer.start >= MIN_BENCH_NS)
+                    break;
+
+                free_blocklist(&blocklist);
+            }
+
+            PrintResult("read_blocklist_file", blocklist.count, &timer);
+            remove(filename);
+
+            // the zone names are not blocked - the common case - and the names below the blocked ones are
+            static dns_view_t views[BENCH_QUERIES];
+            for (unsigned int q = 0; q < BENCH_QUERIES; q++)
+                dns_view_parse(&views[q], datagrams[q], lengths[q]);
+
+            timer = (bench_timer_t){ 0 };
+            while (KeepRunning(&timer))
+                write_blocked_reply(&views[timer.iterations % BENCH_QUERIES], &blocklist, out, sizeof(out));
+            PrintResult("write_blocked_reply (miss)", blocklist.count, &timer);
+
+            static char blocked[BENCH_QUERIES][BUFFLEN];
+            for (unsigned int q = 0; q < BENCH_QUERIES; q++)
+            {
+                char name[QNAME_SIZE];
+                snprintf(name, sizeof(name), "www.t%u.ads.example.", NextRandom() % sizes[s]);
+                dns_view_parse(&views[q], blocked[q], WriteQuery(blocked[q], BUFFLEN, name, DNS_TYPE_A, (uint16_t)q));
+            }
+
+            timer = (bench_timer_t){ 0 };
+            while (KeepRunning(&timer))
+                write_blocked_reply(&views[timer.iterations % BENCH_QUERIES], &blocklist, out, sizeof(out));
+            PrintResult("write_blocked_reply (hit)", blocklist.count, &timer);
+
+            int checked = CheckEdnsRcode(&views[0], &blocklist);
+            free_blocklist(&blocklist);
+
+            if (checked != 0)
+                return -1;
+        }
+
+        // as many clients as records, each in its own /24 - past the size of the table they keep evicting each other
+        rate_limiter_t* limiter = rate_limit_create(100, 24, 2, NextRandom());
+        if (limiter)
+        {
+            static struct sockaddr_in clients[BENCH_QUERIES];
+            for (unsigned int q = 0; q < BENCH_QUERIES; q++)
+                clients[q] = (struct sockaddr_in){ .sin_family = AF_INET, .sin_addr.s_addr = htonl((NextRandom() % sizes[s]) << 8) };
+
+            timer = (bench_timer_t){ 0 };
+            while (KeepRunning(&timer))
+                rate_limit_check(limiter, &clients[timer.iterations % BENCH_QUERIES], timer.iterations >> 12);
+            PrintResult("rate_limit_check", sizes[s], &timer);
+
+            rate_limit_free(limiter);
+        }
+
+        for (unsigned int q = 0; q < BENCH_QUERIES; q++)
+        {
+            free_dns_transaction(queries[q]);
+            free_dns_transaction(replies[q]);
+        }
+
+        arena_free(arena);
+        free(names);
+        free_zone(&zone);
+    }
+
+    fprintf(stderr, "\n");
+    return 0;
+}
+
+// FAKE UPSTREAM
+// ================================================================
+// answers every A query with an address derived from the name and every other type with an empty answer,
+// after a random delay in [delay_min_ms, delay_max_ms] - and not at all for loss_percent of the queries
+#define MAX_DELAYED_ANSWERS 16384
+
+typedef struct upstream_options {
+    const char* address;
+    uint16_t port;
+    unsigned int delay_min_ms;
+    unsigned int delay_max_ms;
+    unsigned int loss_percent;
+} upstream_options_t;
+
+typedef struct delayed_answer {
+    uint64_t due_ns;
+    struct sockaddr_in client;
+    int length;
+    char dgram[BUFFLEN];
+} delayed_answer_t;
+
+// turns the query into its answer in place - returns the answer length, or -1 if it is not a query
+static int WriteFakeAnswer(char* dgram, int length)
+{
+    dns_view_t query;
+    if (dns_view_parse(&query, dgram, length) != 0 || query.header.QDCount != 1 || (query.header.flags & QR_RESPONSE))
+        return -1;
+
+    // the reply is the query itself up to the question, flagged as a response, plus the answer
+    int reply_length = query.question_end;
+    uint16_t ancount = (query.qtype == DNS_TYPE_A) ? 1 : 0;
+    uint32_t hash = 2166136261u;
+
+    for (uint16_t i = query.question; i < query.question_end; i++)
+        hash = (hash ^ (uint8_t)dgram[i]) * 16777619u;
+
+    dgram[2] = (char)((dgram[2] | 0x80) & ~0x02);   // QR set, TC clear
+    dgram[3] = (char)0x80;                          // RA set, NOERROR
+    memset(dgram + 6, 0, 6);
+    dgram[7] = (char)ancount;
+
+    if (ancount)
+    {
+        const uint8_t record[16] = {
+            0xC0, 0x0C,                 // pointer to the question name
+            0x00, DNS_TYPE_A, 0x00, DNS_CLASS_IN,
+            0x00, 0x00, 0x00, 60,       // TTL
+            0x00, 4,                    // RDLENGTH
+            10, (uint8_t)(hash >> 16), (uint8_t)(hash >> 8), (uint8_t)hash,
+        };
+
+        memcpy(dgram + reply_length, record, sizeof(record));
+        reply_length += sizeof(record);
+    }
+
+    return reply_length;
+}
+
+// min-heap of the delayed answers by due time - the answers stay in their slots, only the indexes move
+typedef struct answer_heap {
+    delayed_answer_t* answers;
+    uint16_t* order;            // heap of slot indexes
+    uint16_t* free_slots;
+    unsigned int count;
+} answer_heap_t;
+
+static void HeapSwap(answer_heap_t* heap, unsigned int a, unsigned int b)
+{
+    uint16_t slot = heap->order[a];
+    heap->order[a] = heap->order[b];
+    heap->order[b] = slot;
+}
+
+static uint64_t HeapDue(const answer_heap_t* heap, unsigned int position)
+{
+    return heap->answers[heap->order[position]].due_ns;
+}
+
+static delayed_answer_t* HeapPush(answer_heap_t* heap, uint64_t due_ns)
+{
+    if (heap->count == MAX_DELAYED_ANSWERS)
+        return NULL;
+
+    // the slots after count in free_slots are the free ones
+    unsigned int position = heap->count++;
+    uint16_t slot = heap->free_slots[position];
+    heap->order[position] = slot;
+    heap->answers[slot].due_ns = due_ns;
+
+    while (position > 0 && HeapDue(heap, (position - 1) / 2) > due_ns)
+    {
+        HeapSwap(heap, position, (position - 1) / 2);
+        position = (position - 1) / 2;
+    }
+
+    return &heap->answers[slot];
+}
+
+static void HeapPop(answer_heap_t* heap)
+{
+    heap->free_slots[--heap->count] = heap->order[0];
+    heap->order[0] = heap->order[heap->count];
+
+    for (unsigned int position = 0;;)
+    {
+        unsigned int smallest = position;
+        unsigned int left = 2 * position + 1, right = left + 1;
+
+        if (left < heap->count && HeapDue(heap, left) < HeapDue(heap, smallest))
+            smallest = left;
+        if (right < heap->count && HeapDue(heap, right) < HeapDue(heap, smallest))
+            smallest = right;
+        if (smallest == position)
+            break;
+
+        HeapSwap(heap, position, smallest);
+        position = smallest;
+    }
+}
+
+static int RunFakeUpstream(const upstream_options_t* options)
+{
+    SOCKET sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(options->port) };
+    addr.sin_addr.s_addr = inet_addr(options->address);
+
+    // the server binds the wildcard address on the same port - both must allow the overlap
+    if (sock == INVALID_SOCKET || set_socket_flag(sock, SOL_SOCKET, SO_REUSEADDR, 1) < 0 || bind(sock, (SOCKADDR*)&addr, sizeof(addr)) == SOCKET_ERROR)
+    {
+        fprintf(stderr, "\nCould not bind the fake upstream to %s:%u: %d", options->address, options->port, WSAGetLastError());
+        if (sock != INVALID_SOCKET)
+            closesocket(sock);
+        return -1;
+    }
+
+    answer_heap_t heap = {
+        .answers = (delayed_answer_t*)malloc(MAX_DELAYED_ANSWERS * sizeof(delayed_answer_t)),
+        .order = (uint16_t*)malloc(MAX_DELAYED_ANSWERS * sizeof(uint16_t)),
+        .free_slots = (uint16_t*)malloc(MAX_DELAYED_ANSWERS * sizeof(uint16_t)),
+    };
+
+    if (!heap.answers || !heap.order || !heap.free_slots)
+    {
+        fprintf(stderr, "\nFailed to allocate the delayed answers");
+        free(heap.answers);
+        free(heap.order);
+        free(heap.free_slots);
+        closesocket(sock);
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < MAX_DELAYED_ANSWERS; i++)
+        heap.free_slots[i] = (uint16_t)i;
+
+    fprintf(stderr, "\nFake upstream answering on %s:%u after %u-%u ms, losing %u%% of the queries",
+            options->address, options->port, options->delay_min_ms, options->delay_max_ms, options->loss_percent);
+
+    uint64_t answered = 0;
+    uint64_t lost = 0;
+    for (;;)
+    {
+        // the answers that are due go out first
+        uint64_t now = monotonic_ns();
+        while (heap.count && HeapDue(&heap, 0) <= now)
+        {
+            const delayed_answer_t* answer = &heap.answers[heap.order[0]];
+            sendto(sock, answer->dgram, answer->length, 0, (SOCKADDR*)&answer->client, sizeof(answer->client));
+            HeapPop(&heap);
+        }
+
+        uint64_t wait_us = heap.count ? (HeapDue(&heap, 0) - now + 999) / 1000 : 1000000;
+        struct timeval timeout = { (long)(wait_us / 1000000), (long)(wait_us % 1000000) };
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(sock, &readable);
+
+        if (select((int)sock + 1, &readable, NULL, NULL, &timeout) <= 0)
+            continue;
+
+        char dgram[BUFFLEN];
+        struct sockaddr_in client;
+        socklen_t client_size = sizeof(client);
+
+        int length = recvfrom(sock, dgram, sizeof(dgram) - 16, 0, (SOCKADDR*)&client, &client_size);
+        if (length == SOCKET_ERROR || (length = WriteFakeAnswer(dgram, length)) < 0)
+            continue;
+
+        if (options->loss_percent && NextRandom() % 100 < options->loss_percent)
+        {
+            lost++;
+            continue;
+        }
+
+        unsigned int delay_ms = options->delay_min_ms + (options->delay_max_ms > options->delay_min_ms ? NextRandom() % (options->delay_max_ms - options->delay_min_ms + 1) : 0);
+        delayed_answer_t* answer = delay_ms ? HeapPush(&heap, monotonic_ns() + delay_ms * 1000000ull) : NULL;
+
+        // without a delay (or with too many answers waiting) the answer goes out right away
+        if (answer == NULL)
+            sendto(sock, dgram, length, 0, (SOCKADDR*)&client, sizeof(client));
+        else
+        {
+            answer->client = client;
+            answer->length = length;
+            memcpy(answer->dgram, dgram, length);
+        }
+
+        if (++answered % 100000 == 0)
+            fprintf(stderr, "\nFake upstream answered %llu queries (%llu lost on purpose)", (unsigned long long)answered, (unsigned long long)lost);
+    }
+
+    free(heap.answers);
+    free(heap.order);
+    free(heap.free_slots);
+    closesocket(sock);
+    return 0;
+}
+
+// LOAD GENERATOR
+// ================================================================
+typedef struct load_options {
+    const char* server;
+    uint16_t port;
+    unsigned int concurrency;   // queries kept in flight
+    unsigned int seconds;
+    unsigned int miss_percent;  // share of queries for names outside the zone - relayed upstream by the server
+    unsigned int timeout_ms;    // a query not answered by then is counted as lost and replaced
+    const char* zone_file;      // the zone the server answers from - source of the names that hit
+} load_options_t;
+
+typedef struct latency_samples {
+    uint32_t* us;
+    size_t count;
+    size_t capacity;
+} latency_samples_t;
+
+static void AddSample(latency_samples_t* samples, uint64_t ns)
+{
+    if (samples->count == samples->capacity)
+    {
+        size_t capacity = samples->capacity ? samples->capacity * 2 : 65536;
+        uint32_t* grown = (uint32_t*)realloc(samples->us, capacity * sizeof(uint32_t));
+        if (grown == NULL)
+            return;
+
+        samples->us = grown;
+        samples->capacity = capacity;
+    }
+
+    samples->us[samples->count++] = (uint32_t)min(ns / 1000, UINT32_MAX);
+}
+
+static int CompareSamples(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void PrintLatencies(const char* label, latency_samples_t* samples)
+{
+    if (samples->count == 0)
+    {
+        fprintf(stderr, "\n%-6s no answers", label);
+        return;
+    }
+
+    qsort(samples->us, samples->count, sizeof(uint32_t), CompareSamples);
+
+    #define PERCENTILE(p) samples->us[min((size_t)((p) * samples->count), samples->count - 1)]
+    fprintf(stderr, "\n%-6s %10lu answers   p50 %8u us   p99 %8u us   p999 %8u us   max %8u us", label, (unsigned long)samples->count,
+            PERCENTILE(0.50), PERCENTILE(0.99), PERCENTILE(0.999), samples->us[samples->count - 1]);
+    #undef PERCENTILE
+}
+
+static int RunLoadGenerator(const load_options_t* options)
+{
+    dns_zone_t zone;
+    const char** names = NULL;
+    unsigned int name_count = 0;
+
+    if (options->miss_percent < 100)
+    {
+        fflush(stdout);
+        if (read_zone_file(options->zone_file, &zone) <= 0 || (name_count = ZoneNames(&zone, &names)) == 0)
+        {
+            fprintf(stderr, "\nNo names to query in the zone %s", options->zone_file);
+            return -1;
+        }
+    }
+
+    SOCKET sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(options->port) };
+    addr.sin_addr.s_addr = inet_addr(options->server);
+
+    if (sock == INVALID_SOCKET || connect(sock, (SOCKADDR*)&addr, sizeof(addr)) == SOCKET_ERROR || set_socket_nonblocking(sock) != NO_ERROR)
+    {
+        fprintf(stderr, "\nCould not open the socket to %s:%u: %d", options->server, options->port, WSAGetLastError());
+        return -1;
+    }
+
+    // a query's ID is its slot - sent_ns is 0 for the IDs not in flight
+    static uint64_t sent_ns[65536];
+    static uint8_t is_miss[65536];
+    uint16_t next_id = (uint16_t)NextRandom();
+    unsigned int in_flight = 0;
+
+    uint64_t sent = 0, lost = 0, stray = 0, errors = 0, miss_serial = 0;
+    latency_samples_t hits = { 0 }, misses = { 0 };
+
+    fprintf(stderr, "\nSending to %s:%u for %u s with %u queries in flight, %u%% misses",
+            options->server, options->port, options->seconds, options->concurrency, options->miss_percent);
+
+    uint64_t start = monotonic_ns();
+    uint64_t end = start + (uint64_t)options->seconds * 1000000000ull;
+    uint64_t timeout_ns = (uint64_t)options->timeout_ms * 1000000ull;
+    uint64_t next_scan = start;
+
+    for (uint64_t now = start; now < end; now = monotonic_ns())
+    {
+        // keep the window full
+        while (in_flight < options->concurrency)
+        {
+            while (sent_ns[next_id] != 0)
+                next_id++;
+
+            char name[QNAME_SIZE];
+            uint8_t miss = (NextRandom() % 100) < options->miss_percent;
+
+            if (miss) // never asked before, so neither the zone nor the cache have it
+                snprintf(name, sizeof(name), "m%llu-%08x.bench.invalid.", (unsigned long long)++miss_serial, NextRandom());
+            else
+                snprintf(name, sizeof(name), "%s", names[NextRandom() % name_count]);
+
+            char query[BUFFLEN];
+            int length = WriteQuery(query, sizeof(query), name, DNS_TYPE_A, next_id);
+
+            if (send(sock, query, length, 0) != length)
+            {
+                errors++;
+                break; // socket buffer full - wait for answers
+            }
+
+            sent_ns[next_id] = monotonic_ns();
+            is_miss[next_id] = miss;
+            next_id++;
+            in_flight++;
+            sent++;
+        }
+
+        // wait for answers
+        fd_set read_flags;
+        FD_ZERO(&read_flags);
+        FD_SET(sock, &read_flags);
+        struct timeval wait = { .tv_sec = 0, .tv_usec = 10000 };
+
+        if (select(sock + 1, &read_flags, NULL, NULL, &wait) > 0)
+        {
+            char answer[BUFFLEN];
+            int length;
+
+            while ((length = recv(sock, answer, sizeof(answer), 0)) > 0)
+            {
+                uint64_t received = monotonic_ns();
+
+                if (length < 12)
+                {
+                    stray++;
+                    continue;
+                }
+
+                uint16_t id = ((uint8_t)answer[0] << 8) | (uint8_t)answer[1];
+                if (sent_ns[id] == 0)
+                {
+                    stray++; // late answer of a query already counted as lost
+                    continue;
+                }
+
+                AddSample(is_miss[id] ? &misses : &hits, received - sent_ns[id]);
+                sent_ns[id] = 0;
+                in_flight--;
+            }
+        }
+
+        // queries not answered in time are written off so the window does not shrink
+        if (now >= next_scan)
+        {
+            for (uint32_t id = 0; id < 65536; id++)
+            {
+                if (sent_ns[id] != 0 && sent_ns[id] + timeout_ns < now)
+                {
+                    sent_ns[id] = 0;
+                    in_flight--;
+                    lost++;
+                }
+            }
+
+            next_scan = now + 100000000ull;
+        }
+    }
+
+    double elapsed = (double)(monotonic_ns() - start) / 1e9;
+    uint64_t answered = hits.count + misses.count;
+
+    fprintf(stderr, "\n\nSent %llu, answered %llu, lost %llu (%llu still in flight), stray %llu, send errors %llu",
+            (unsigned long long)sent, (unsigned long long)answered, (unsigned long long)lost, (unsigned long long)in_flight,
+            (unsigned long long)stray, (unsigned long long)errors);
+    fprintf(stderr, "\nThroughput: %.0f answers/s", answered / elapsed);
+
+    PrintLatencies("hits", &hits);
+    PrintLatencies("misses", &misses);
+
+    // both sets merged for the overall figures
+    latency_samples_t all = { 0 };
+    for (size_t i = 0; i < hits.count; i++)
+        AddSample(&all, (uint64_t)hits.us[i] * 1000);
+    for (size_t i = 0; i < misses.count; i++)
+        AddSample(&all, (uint64_t)misses.us[i] * 1000);
+    PrintLatencies("all", &all);
+    fprintf(stderr, "\n");
+
+    free(all.us);
+    free(hits.us);
+    free(misses.us);
+    closesocket(sock);
+
+    if (name_count)
+    {
+        free(names);
+        free_zone(&zone);
+    }
+
+    return 0;
+}
+
+// MAIN
+// ================================================================
+void PrintUsage(const char* program)
+{
+    fprintf(stderr, "\nUsage: %s micro [-n records,records,...]"
+                    "\n       %s load [-s server] [-p port] [-c in_flight] [-d seconds] [-m miss_percent] [-t timeout_ms] [-z zone_file]"
+                    "\n       %s upstream [-a address] [-p port] [-D delay_ms[-max_delay_ms]] [-L loss_percent]"
+                    "\n"
+                    "\n  micro     times read_dns_transaction, build_dns_reply_from_query, write_dns_transaction, read_zone_file,"
+                    "\n            the blocklist and the rate limiter over synthetic zones, blocklists and clients of the given sizes"
+                    "\n            (default 10,10000,1000000)"
+                    "\n  load      keeps queries in flight against a running server and reports the answers/s and latency percentiles"
+                    "\n            (defaults 127.0.0.1 port 53, 64 in flight, 10 s, 10%% misses, 1000 ms, config.txt)"
+                    "\n  upstream  fake upstream answering the relayed misses (default 192.168.99.1 port 53 - the server's upstream,"
+                    "\n            which must be an address of this machine, e.g. added to the loopback interface), answering after"
+                    "\n            the delay (random between the two values if a range is given) and dropping loss_percent of the queries"
+                    "\n", program, program, program);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+
+    const char* mode = argv[1];
+    unsigned int sizes[MAX_ZONE_SIZES] = { 10, 10000, 1000000 };
+    unsigned int size_count = 3;
+
+    load_options_t load = {
+        .server = "127.0.0.1",
+        .port = 53,
+        .concurrency = 64,
+        .seconds = 10,
+        .miss_percent = 10,
+        .timeout_ms = 1000,
+        .zone_file = "config.txt",
+    };
+
+    upstream_options_t upstream = {
+        .address = "192.168.99.1",
+        .port = 53,
+    };
+
+    for (int i = 2; i < argc; i++)
+    {
+        const char* value = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+        if (value == NULL)
+        {
+            PrintUsage(argv[0]);
+            return 1;
+        }
+        else if (strcmp(argv[i], "-n") == 0)
+        {
+            char list[256];
+            snprintf(list, sizeof(list), "%s", value);
+            size_count = 0;
+
+            for (char* item = strtok(list, ","); item && size_count < MAX_ZONE_SIZES; item = strtok(NULL, ","))
+                if (atoi(item) > 0)
+                    sizes[size_count++] = (unsigned int)atoi(item);
+        }
+        else if (strcmp(argv[i], "-s") == 0)
+            load.server = value;
+        else if (strcmp(argv[i], "-a") == 0)
+            upstream.address = value;
+        else if (strcmp(argv[i], "-p") == 0)
+            load.port = upstream.port = (uint16_t)atoi(value);
+        else if (strcmp(argv[i], "-D") == 0)
+        {
+            const char* range = strchr(value, '-');
+            upstream.delay_min_ms = (unsigned int)max(0, atoi(value));
+            upstream.delay_max_ms = range ? (unsigned int)max((int)upstream.delay_min_ms, atoi(range + 1)) : upstream.delay_min_ms;
+        }
+        else if (strcmp(argv[i], "-L") == 0)
+            upstream.loss_percent = (unsigned int)max(0, min(atoi(value), 100));
+        else if (strcmp(argv[i], "-c") == 0)
+            load.concurrency = (unsigned int)max(1, min(atoi(value), 60000));
+        else if (strcmp(argv[i], "-d") == 0)
+            load.seconds = (unsigned int)max(1, atoi(value));
+        else if (strcmp(argv[i], "-m") == 0)
+            load.miss_percent = (unsigned int)max(0, min(atoi(value), 100));
+        else if (strcmp(argv[i], "-t") == 0)
+            load.timeout_ms = (unsigned int)max(1, atoi(value));
+        else if (strcmp(argv[i], "-z") == 0)
+            load.zone_file = value;
+        else
+        {
+            PrintUsage(argv[0]);
+            return 1;
+        }
+
+        i++;
+    }
+
+    #ifdef _WIN32
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2,2), &wsaData) != 0)
+    {
+        fprintf(stderr, "\nWSAStartup failed: %d\n", WSAGetLastError());
+        return 1;
+    }
+    #endif
+
+    rng_state ^= monotonic_ns();
+
+    int result;
+    if (strcmp(mode, "micro") == 0)
+        result = RunMicroBenchmarks(sizes, size_count);
+    else if (strcmp(mode, "load") == 0)
+        result = RunLoadGenerator(&load);
+    else if (strcmp(mode, "upstream") == 0)
+        result = RunFakeUpstream(&upstream);
+    else
+    {
+        PrintUsage(argv[0]);
+        result = -1;
+    }
+
+    #ifdef _WIN32
+    WSACleanup();
+    #endif
+
+    return result == 0 ? 0 : 1;
+}
@@ -0,0 +1,438 @@
+// ===================================================================================  //
+//    This program is free software: you can redistribute it and/or modify              //
+//    it under the terms of the GNU General Public License as published by              //
+//    the Free Software Foundation, either version 3 of the License, or                 //
+//    (at your option) any later version.                                               //
+//                                                                                      //
+//    This program is distributed in the hope that it will be useful,                   //
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of                    //
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                     //
+//    GNU General Public License for more details.                                      //
+//                                                                                      //
+//    You should have received a copy of the GNU General Public License                 //
+//    along with this program.  If not, see <https://www.gnu.org/licenses/>.            //
+//                                                                                      //
+//    Copyright: Luiz Gustavo Pfitscher e Feldmann, 2020                                //
+// ===================================================================================  //
+
+#include "blocklist.h"
+#include "zone_file.h"
+#include "logger.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#define FNV_OFFSET 14695981039346656037ull
+#define FNV_PRIME 1099511628211ull
+#define NAMES_PER_DIRECTORY_ENTRY 4     // average run of hashes scanned by a lookup
+#define FILTER_BITS_PER_NAME 16         // with 8 bits set per name: about 0.2% of the names not blocked get past the filter
+#define MAX_LABELS 128                  // a name of 255 octets has at most 127 labels
+
+// HASHING
+// ================================================================
+// the names are hashed from the root down, a label at a time, so a single pass over a name gives the
+// hashes of the name and of all its ancestors: the state after each label is the hash of the name ending there
+static uint64_t hash_label(uint64_t state, const uint8_t* label, uint8_t length)
+{
+    // FNV-1a 64 over the label length and the lowercase label
+    state ^= length;
+    state *= FNV_PRIME;
+
+    for (uint8_t i = 0; i < length; i++)
+    {
+        state ^= (uint8_t)tolower(label[i]);
+        state *= FNV_PRIME;
+    }
+
+    return state;
+}
+
+// spreads the state over all the bits - the directory uses the top ones and the filter the others
+static uint64_t finish_hash(uint64_t state)
+{
+    state ^= state >> 30;
+    state *= 0xBF58476D1CE4E5B9ull;
+    state ^= state >> 27;
+    state *= 0x94D049BB133111EBull;
+    state ^= state >> 31;
+    return state;
+}
+
+// hashes a name of the file, in plain text - returns -1 if it is not a domain name worth blocking
+static int hash_plain_name(const char* name, size_t length, uint64_t* hash)
+{
+    // "*.example.com" blocks the same names as "example.com"
+    if (length >= 2 && name[0] == '*' && name[1] == '.')
+    {
+        name += 2;
+        length -= 2;
+    }
+
+    if (length > 0 && name[length - 1] == '.')
+        length--;
+
+    // names without a dot are the "localhost" and "broadcasthost" of the hosts files - never blocked
+    if (length == 0 || length > QNAME_SIZE - 2 || memchr(name, '.', length) == NULL)
+        return -1;
+
+    uint64_t state = FNV_OFFSET;
+    size_t end = length;
+
+    for (;;)
+    {
+        size_t start = end;
+        while (start > 0 && name[start - 1] != '.')
+            start--;
+
+        if (end - start == 0 || end - start > 63)
+            return -1;
+
+        state = hash_label(state, (const uint8_t*)name + start, (uint8_t)(end - start));
+
+        if (start == 0)
+            break;
+
+        end = start - 1;
+    }
+
+    *hash = finish_hash(state);
+    return 0;
+}
+
+// LOOKUP
+// ================================================================
+static int filter_may_contain(const dns_blocklist_t* list, uint64_t hash)
+{
+    const uint64_t* block = list->filter + (size_t)(hash & (list->filter_blocks - 1)) * 8;
+    uint64_t bits = hash * 0x9E3779B97F4A7C15ull;
+
+    for (int word = 0; word < 8; word++)
+        if ((block[word] & (1ull << ((bits >> (16 + 6 * word)) & 63))) == 0)
+            return 0;
+
+    return 1;
+}
+
+static int set_contains(const dns_blocklist_t* list, uint64_t hash)
+{
+    uint64_t d = hash >> (64 - list->directory_bits);
+
+    for (uint32_t i = list->directory[d]; i < list->directory[d + 1]; i++)
+        if (list->hashes[i] == hash)
+            return 1;
+
+    return 0;
+}
+
+// tells if the name given by its labels, or any of its ancestors, is on the list
+static int contains_labels(const dns_blocklist_t* list, const uint8_t* const* labels, const uint8_t* lengths, int count)
+{
+    uint64_t state = FNV_OFFSET;
+
+    for (int l = count - 1; l >= 0; l--)
+    {
+        state = hash_label(state, labels[l], lengths[l]);
+        uint64_t hash = finish_hash(state);
+
+        if (filter_may_contain(list, hash) && set_contains(list, hash))
+            return 1;
+    }
+
+    return 0;
+}
+
+static void put_u16(char* position, uint16_t value)
+{
+    position[0] = (char)(value >> 8);
+    position[1] = (char)(value & 0xFF);
+}
+
+// writes the sinkhole reply when the question asks for a blocked name - returns its length, or 0 if the name
+// is not blocked (or the reply would not fit) so the query goes on to the cache and the upstream server
+int write_blocked_reply(const dns_view_t* query, const dns_blocklist_t* list, char* out, int out_size)
+{
+    if (list == NULL || list->count == 0 || query->header.QDCount != 1)
+        return 0;
+
+    const uint8_t* labels[MAX_LABELS];
+    uint8_t lengths[MAX_LABELS];
+    int count = 0;
+    int ret = 0;
+
+    dns_name_iter_t iter;
+    dns_name_iter_init(&iter, query, query->question);
+
+    while (count < MAX_LABELS && (ret = dns_name_iter_next(&iter, &labels[count], &lengths[count])) == 1)
+        count++;
+
+    if (count == MAX_LABELS || ret < 0 || !contains_labels(list, labels, lengths, count))
+        return 0;
+
+    // A and AAAA get the sinkhole address, the other types an empty answer
+    uint16_t rdlength = 0;
+    const uint8_t* rdata = NULL;
+
+    if (!list->nxdomain && query->qclass == DNS_CLASS_IN && query->qtype == DNS_TYPE_A)
+    {
+        rdlength = sizeof(list->ipv4);
+        rdata = list->ipv4;
+    }
+    else if (!list->nxdomain && query->qclass == DNS_CLASS_IN && query->qtype == DNS_TYPE_AAAA)
+    {
+        rdlength = sizeof(list->ipv6);
+        rdata = list->ipv6;
+    }
+
+    int question_length = query->question_end - query->question;
+    int total = 12 + question_length + (rdata ? 12 + rdlength : 0);
+    if (total > out_size)
+        return 0;
+
+    put_u16(out, query->header.id);
+    put_u16(out + 2, (query->header.flags & ~RC_MASK) | QR_RESPONSE | (list->nxdomain ? RC_NAMEERROR : RC_NOERROR));
+    put_u16(out + 4, 1);
+    put_u16(out + 6, rdata ? 1 : 0);
+    put_u16(out + 8, 0);
+    put_u16(out + 10, 0);
+
+    // the question goes back as it was asked, and the answer points to its name
+    memcpy(out + 12, query->dgram + query->question, question_length);
+
+    if (rdata)
+    {
+        char* answer = out + 12 + question_length;
+        put_u16(answer, 0xC000 | 12);
+        put_u16(answer + 2, query->qtype);
+        put_u16(answer + 4, DNS_CLASS_IN);
+        put_u16(answer + 6, (uint16_t)(BLOCKLIST_TTL >> 16));
+        put_u16(answer + 8, (uint16_t)(BLOCKLIST_TTL & 0xFFFF));
+        put_u16(answer + 10, rdlength);
+        memcpy(answer + 12, rdata, rdlength);
+    }
+
+    return total;
+}
+
+// LOADING
+// ================================================================
+// the first token of a hosts file line is an address: only digits and dots, or a colon somewhere
+static int is_address(const char* token, size_t length)
+{
+    int dotted = 1;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        if (token[i] == ':')
+            return 1;
+        else if (!isdigit((unsigned char)token[i]) && token[i] != '.')
+            dotted = 0;
+    }
+
+    return dotted;
+}
+
+// sorts the hashes by their top bits into the directory ranges, then each (short) range on its own, dropping the duplicates
+static int build_set(dns_blocklist_t* list, const uint64_t* hashes, unsigned int count)
+{
+    unsigned int bits = 1;
+    while ((1u << bits) < count / NAMES_PER_DIRECTORY_ENTRY && bits < 31)
+        bits++;
+
+    size_t entries = (size_t)1 << bits;
+    list->directory_bits = bits;
+    list->directory = (uint32_t*)calloc(entries + 1, sizeof(uint32_t));
+    list->hashes = (uint64_t*)malloc((count ? count : 1) * sizeof(uint64_t));
+
+    if (list->directory == NULL || list->hashes == NULL)
+        return -1;
+
+    // counting sort on the top bits: count, turn the counts into starts, scatter
+    for (unsigned int i = 0; i < count; i++)
+        list->directory[(hashes[i] >> (64 - bits)) + 1]++;
+
+    for (size_t d = 0; d < entries; d++)
+        list->directory[d + 1] += list->directory[d];
+
+    for (unsigned int i = 0; i < count; i++)
+        list->hashes[list->directory[hashes[i] >> (64 - bits)]++] = hashes[i];
+
+    // the scatter moved every start to the end of its range: shift them back
+    memmove(list->directory + 1, list->directory, entries * sizeof(uint32_t));
+    list->directory[0] = 0;
+
+    // insertion sort inside each range, compacting the unique hashes towards the front
+    uint32_t unique = 0;
+    uint32_t start = 0;
+
+    for (size_t d = 0; d < entries; d++)
+    {
+        uint32_t end = list->directory[d + 1];
+        uint32_t first = unique;
+
+        for (uint32_t i = start; i < end; i++)
+        {
+            uint64_t hash = list->hashes[i];
+            uint32_t j = unique;
+
+            while (j > first && list->hashes[j - 1] > hash)
+                j--;
+
+            if (j > first && list->hashes[j - 1] == hash)
+                continue;
+
+            memmove(list->hashes + j + 1, list->hashes + j, (unique - j) * sizeof(uint64_t));
+            list->hashes[j] = hash;
+            unique++;
+        }
+
+        list->directory[d] = first;
+        start = end;
+    }
+
+    list->directory[entries] = unique;
+    list->count = unique;
+
+    uint64_t* shrunk = (uint64_t*)realloc(list->hashes, (unique ? unique : 1) * sizeof(uint64_t));
+    if (shrunk != NULL)
+        list->hashes = shrunk;
+
+    return 0;
+}
+
+static int build_filter(dns_blocklist_t* list)
+{
+    unsigned int blocks = 1;
+    while (blocks < (uint64_t)list->count * FILTER_BITS_PER_NAME / 512 && blocks < (1u << 31))
+        blocks *= 2;
+
+    list->filter_blocks = blocks;
+    list->filter = (uint64_t*)calloc((size_t)blocks * 8, sizeof(uint64_t));
+
+    if (list->filter == NULL)
+        return -1;
+
+    for (unsigned int i = 0; i < list->count; i++)
+    {
+        uint64_t hash = list->hashes[i];
+        uint64_t* block = list->filter + (size_t)(hash & (blocks - 1)) * 8;
+        uint64_t bits = hash * 0x9E3779B97F4A7C15ull;
+
+        for (int word = 0; word < 8; word++)
+            block[word] |= 1ull << ((bits >> (16 + 6 * word)) & 63);
+    }
+
+    return 0;
+}
+
+// reads the names of the file - one per line, or after the address on hosts format lines - and returns how many
+// different names are blocked. The sinkhole answers start as 0.0.0.0 and :: and may be changed afterwards
+unsigned read_blocklist_file(const char* filename, dns_blocklist_t* list)
+{
+    *list = (dns_blocklist_t){ 0 };
+
+    size_t size;
+    const char* text = map_zone_file(filename, &size);
+    if (text == NULL)
+        return 0;
+
+    unsigned int count = 0;
+    unsigned int capacity = (unsigned int)(size / 16) + 16;
+    unsigned int ignored = 0;
+    uint64_t* hashes = (uint64_t*)malloc(capacity * sizeof(uint64_t));
+
+    const char* end = text + size;
+    const char* line = text;
+
+    while (hashes != NULL && line < end)
+    {
+        const char* eol = (const char*)memchr(line, '\n', end - line);
+        if (eol == NULL)
+            eol = end;
+
+        const char* comment = (const char*)memchr(line, '#', eol - line);
+        const char* stop = comment ? comment : eol;
+        const char* p = line;
+        int first = 1;
+        int hosts = 0;
+
+        for (;;)
+        {
+            while (p < stop && isspace((unsigned char)*p))
+                p++;
+
+            if (p == stop)
+                break;
+
+            const char* token = p;
+            while (p < stop && !isspace((unsigned char)*p))
+                p++;
+
+            if (first && is_address(token, p - token))
+            {
+                first = 0;
+                hosts = 1;
+                continue;
+            }
+
+            first = 0;
+
+            uint64_t hash;
+            if (hash_plain_name(token, p - token, &hash) != 0)
+                ignored++;
+            else
+            {
+                if (count == capacity)
+                {
+                    uint64_t* grown = (uint64_t*)realloc(hashes, (size_t)capacity * 2 * sizeof(uint64_t));
+                    if (grown == NULL)
+                    {
+                        free(hashes);
+                        hashes = NULL;
+                        break;
+                    }
+
+                    hashes = grown;
+                    capacity *= 2;
+                }
+
+                hashes[count++] = hash;
+            }
+
+            // a plain list has one name per line - anything after it is ignored
+            if (!hosts)
+                break;
+        }
+
+        line = eol + 1;
+    }
+
+    unmap_zone_file(text, size);
+
+    if (hashes == NULL || build_set(list, hashes, count) != 0 || build_filter(list) != 0)
+    {
+        LOG_ERROR(LOG_ZONE, "Failed to allocate the blocklist %s", filename);
+        free(hashes);
+        free_blocklist(list);
+        return 0;
+    }
+
+    free(hashes);
+
+    if (ignored > 0)
+        LOG_WARNING(LOG_ZONE, "Blocklist %s: ignored %u entries that are not domain names or have no dot (like localhost)", filename, ignored);
+
+    return list->count;
+}
+
+void free_blocklist(dns_blocklist_t* list)
+{
+    free(list->hashes);
+    free(list->directory);
+    free(list->filter);
+
+    list->hashes = NULL;
+    list->directory = NULL;
+    list->filter = NULL;
+    list->count = 0;
+}
@@ -0,0 +1,47 @@
+// ===================================================================================  //
+//    This program is free software: you can redistribute it and/or modify              //
+//    it under the terms of the GNU General Public License as published by              //
+//    the Free Software Foundation, either version 3 of the License, or                 //
+//    (at your option) any later version.                                               //
+//                                                                                      //
+//    This program is distributed in the hope that it will be useful,                   //
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of                    //
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                     //
+//    GNU General Public License for more details.                                      //
+//                                                                                      //
+//    You should have received a copy of the GNU General Public License                 //
+//    along with this program.  If not, see <https://www.gnu.org/licenses/>.            //
+//                                                                                      //
+//    Copyright: Luiz Gustavo Pfitscher e Feldmann, 2020                                //
+// ===================================================================================  //
+
+#ifndef _BLOCKLIST_H_
+#define _BLOCKLIST_H_
+
+#include "dns_protocol.h"
+
+// Names sinkholed instead of relayed: a name on the list blocks itself and every name below it.
+// The list is read from a file with one domain per line or in hosts format ("0.0.0.0 domain ...").
+// Only a 64-bit hash of each name is kept, sorted, with a directory on the top bits of the hashes so
+// a lookup scans a handful of neighbours. In front of it a split block Bloom filter (the bits of a name
+// all fall in one cache line) turns away nearly every name that is not blocked with a single read.
+// About 11 bytes per name in all.
+#define BLOCKLIST_TTL 300   // TTL of the sinkhole answers
+
+typedef struct dns_blocklist {
+    uint64_t* hashes;           // hashes of the blocked names, sorted and unique
+    unsigned int count;
+    uint32_t* directory;        // directory[d] is the first hash whose top bits are d - one more entry closes the last range
+    unsigned int directory_bits;
+    uint64_t* filter;           // Bloom filter in blocks of 8 words - a name sets one bit in each word of its block
+    unsigned int filter_blocks; // always a power of two
+    int nxdomain;               // blocked names do not exist - otherwise they get the addresses below
+    uint8_t ipv4[4];            // answer to the A queries for blocked names
+    uint8_t ipv6[16];           // answer to the AAAA queries for blocked names
+} dns_blocklist_t;
+
+unsigned read_blocklist_file(const char* filename, dns_blocklist_t* list);
+void free_blocklist(dns_blocklist_t* list);
+int write_blocked_reply(const dns_view_t* query, const dns_blocklist_t* list, char* out, int out_size);
+
+#endif // _BLOCKLIST_H_
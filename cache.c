@@ -0,0 +1,501 @@
+// ===================================================================================  //
+//    This program is free software: you can redistribute it and/or modify              //
+//    it under the terms of the GNU General Public License as published by              //
+//    the Free Software Foundation, either version 3 of the License, or                 //
+//    (at your option) any later version.                                               //
+//                                                                                      //
+//    This program is distributed in the hope that it will be useful,                   //
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of                    //
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                     //
+//    GNU General Public License for more details.                                      //
+//                                                                                      //
+//    You should have received a copy of the GNU General Public License                 //
+//    along with this program.  If not, see <https://www.gnu.org/licenses/>.            //
+//                                                                                      //
+//    Copyright: Luiz Gustavo Pfitscher e Feldmann, 2020                                //
+// ===================================================================================  //
+
+#include "cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#define CACHE_MAX_TTL 86400             // never keep an answer longer than a day
+#define CACHE_MAX_RECORDS 64            // answers with more records are not cached
+#define CACHE_PROTECTED_SHARE 80        // percent of the memory the protected segment may use
+#define CACHE_AVERAGE_ENTRY 256         // used to size the hash table
+#define CACHE_ANY_TYPE 0                // qtype of the NXDOMAIN entries - they answer for every type of the name
+
+enum cache_segment {
+    SEGMENT_PROBATION,
+    SEGMENT_PROTECTED,
+};
+
+typedef struct cache_entry {
+    struct cache_entry* chain;  // next entry in the same hash bucket
+    struct cache_entry* newer;  // neighbours in the LRU list of the segment
+    struct cache_entry* older;
+    uint64_t hash;
+    uint64_t stored_ms;
+    uint64_t expires_ms;
+    uint32_t size;              // bytes accounted against the limit
+    uint16_t qtype;
+    uint16_t qclass;
+    uint16_t reply_length;
+    uint16_t question_length;   // wire length of the question - a query must match it to reuse the reply
+    uint16_t ttl_count;
+    uint8_t key_length;
+    uint8_t segment;
+    uint8_t negative;           // NXDOMAIN or NODATA
+    _Alignas(uint16_t) uint8_t data[]; // key (lowercase wire name), TTL offsets (uint16_t each), reply
+} cache_entry_t;
+
+typedef struct cache_list {
+    cache_entry_t* newest;
+    cache_entry_t* oldest;
+    size_t bytes;
+} cache_list_t;
+
+struct dns_cache {
+    cache_entry_t** buckets;
+    size_t bucket_mask;
+    size_t memory_limit;
+    size_t protected_limit;
+    uint32_t negative_ttl;      // cap on the life of the negative answers - 0 does not keep them
+    cache_list_t segments[2];
+    dns_cache_stats_t stats;
+};
+
+static inline uint16_t* entry_ttl_offsets(cache_entry_t* entry)
+{
+    return (uint16_t*)(entry->data + ((entry->key_length + 1) & ~1u)); // data is 2-byte aligned, so the offsets are too
+}
+
+static inline uint8_t* entry_reply(cache_entry_t* entry)
+{
+    return (uint8_t*)(entry_ttl_offsets(entry) + entry->ttl_count);
+}
+
+// builds the key of the question at the offset: the name in wire format, lowercase
+static int make_key(const dns_view_t* view, uint16_t offset, uint8_t* key)
+{
+    dns_name_iter_t iter;
+    const uint8_t* label;
+    uint8_t label_len;
+    int length = 0;
+    int ret;
+
+    dns_name_iter_init(&iter, view, offset);
+    while ((ret = dns_name_iter_next(&iter, &label, &label_len)) == 1)
+    {
+        key[length++] = label_len;
+        for (uint8_t i = 0; i < label_len; i++)
+            key[length++] = (uint8_t)tolower(label[i]);
+    }
+
+    if (ret < 0)
+        return -1;
+
+    key[length++] = 0;
+    return length;
+}
+
+static inline uint32_t load_ttl(const uint8_t* field)
+{
+    return ((uint32_t)field[0] << 24) | ((uint32_t)field[1] << 16) | ((uint32_t)field[2] << 8) | field[3];
+}
+
+static inline void store_ttl(uint8_t* field, uint32_t ttl)
+{
+    field[0] = (uint8_t)(ttl >> 24);
+    field[1] = (uint8_t)(ttl >> 16);
+    field[2] = (uint8_t)(ttl >> 8);
+    field[3] = (uint8_t)ttl;
+}
+
+static uint64_t hash_key(const uint8_t* key, int key_length, uint16_t qtype, uint16_t qclass)
+{
+    // FNV-1a 64
+    uint64_t hash = 14695981039346656037ull;
+
+    for (int i = 0; i < key_length; i++)
+    {
+        hash ^= key[i];
+        hash *= 1099511628211ull;
+    }
+
+    hash ^= ((uint64_t)qtype << 16) | qclass;
+    hash *= 1099511628211ull;
+
+    return hash;
+}
+
+static void list_unlink(cache_list_t* list, cache_entry_t* entry)
+{
+    if (entry->newer) entry->newer->older = entry->older; else list->newest = entry->older;
+    if (entry->older) entry->older->newer = entry->newer; else list->oldest = entry->newer;
+
+    entry->newer = entry->older = NULL;
+    list->bytes -= entry->size;
+}
+
+static void list_push_newest(cache_list_t* list, cache_entry_t* entry)
+{
+    entry->newer = NULL;
+    entry->older = list->newest;
+
+    if (list->newest) list->newest->newer = entry; else list->oldest = entry;
+
+    list->newest = entry;
+    list->bytes += entry->size;
+}
+
+dns_cache_t* cache_create(size_t memory_limit, uint32_t negative_ttl)
+{
+    dns_cache_t* cache = (dns_cache_t*)calloc(1, sizeof(dns_cache_t));
+    if (cache == NULL)
+        return NULL;
+
+    size_t bucket_count = 64;
+    while (bucket_count < memory_limit / CACHE_AVERAGE_ENTRY)
+        bucket_count <<= 1;
+
+    cache->buckets = (cache_entry_t**)calloc(bucket_count, sizeof(cache_entry_t*));
+    if (cache->buckets == NULL)
+    {
+        free(cache);
+        return NULL;
+    }
+
+    cache->bucket_mask = bucket_count - 1;
+    cache->memory_limit = memory_limit;
+    cache->protected_limit = memory_limit / 100 * CACHE_PROTECTED_SHARE;
+    cache->negative_ttl = (negative_ttl < CACHE_MAX_TTL) ? negative_ttl : CACHE_MAX_TTL;
+
+    return cache;
+}
+
+void cache_free(dns_cache_t* cache)
+{
+    if (cache == NULL)
+        return;
+
+    for (int s = 0; s < 2; s++)
+    {
+        cache_entry_t* entry = cache->segments[s].newest;
+        while (entry)
+        {
+            cache_entry_t* older = entry->older;
+            free(entry);
+            entry = older;
+        }
+    }
+
+    free(cache->buckets);
+    free(cache);
+}
+
+// unlinks the entry from its bucket and its segment and frees it
+static void remove_entry(dns_cache_t* cache, cache_entry_t* entry)
+{
+    cache_entry_t** link = &cache->buckets[entry->hash & cache->bucket_mask];
+    while (*link != entry)
+        link = &(*link)->chain;
+    *link = entry->chain;
+
+    list_unlink(&cache->segments[entry->segment], entry);
+
+    cache->stats.entries--;
+    cache->stats.bytes -= entry->size;
+    free(entry);
+}
+
+static cache_entry_t* find_entry(dns_cache_t* cache, uint64_t hash, const uint8_t* key, int key_length, uint16_t qtype, uint16_t qclass)
+{
+    for (cache_entry_t* entry = cache->buckets[hash & cache->bucket_mask]; entry; entry = entry->chain)
+    {
+        if (entry->hash == hash && entry->qtype == qtype && entry->qclass == qclass &&
+            entry->key_length == key_length && memcmp(entry->data, key, key_length) == 0)
+            return entry;
+    }
+
+    return NULL;
+}
+
+// evicts from the oldest end of the probation segment (then of the protected one) until the new entry fits
+static void make_room(dns_cache_t* cache, size_t needed)
+{
+    while (cache->stats.bytes + needed > cache->memory_limit)
+    {
+        cache_entry_t* victim = cache->segments[SEGMENT_PROBATION].oldest;
+        if (victim == NULL)
+            victim = cache->segments[SEGMENT_PROTECTED].oldest;
+        if (victim == NULL)
+            return;
+
+        remove_entry(cache, victim);
+        cache->stats.evictions++;
+    }
+}
+
+// a hit in probation earns the entry a place in the protected segment - whatever falls out of it goes back to probation
+static void touch_entry(dns_cache_t* cache, cache_entry_t* entry)
+{
+    list_unlink(&cache->segments[entry->segment], entry);
+
+    if (entry->segment == SEGMENT_PROBATION)
+    {
+        entry->segment = SEGMENT_PROTECTED;
+
+        while (cache->segments[SEGMENT_PROTECTED].bytes + entry->size > cache->protected_limit && cache->segments[SEGMENT_PROTECTED].oldest)
+        {
+            cache_entry_t* demoted = cache->segments[SEGMENT_PROTECTED].oldest;
+            list_unlink(&cache->segments[SEGMENT_PROTECTED], demoted);
+            demoted->segment = SEGMENT_PROBATION;
+            list_push_newest(&cache->segments[SEGMENT_PROBATION], demoted);
+        }
+    }
+
+    list_push_newest(&cache->segments[entry->segment], entry);
+}
+
+// the live entry of the key, or NULL - an expired one is dropped on the way
+static cache_entry_t* find_live_entry(dns_cache_t* cache, const uint8_t* key, int key_length, uint16_t qtype, uint16_t qclass, uint64_t now_ms)
+{
+    uint64_t hash = hash_key(key, key_length, qtype, qclass);
+    cache_entry_t* entry = find_entry(cache, hash, key, key_length, qtype, qclass);
+
+    if (entry && now_ms >= entry->expires_ms)
+    {
+        remove_entry(cache, entry);
+        cache->stats.expirations++;
+        return NULL;
+    }
+
+    return entry;
+}
+
+// writes the cached reply to the query in out - returns its length or 0 on a miss, and tells whether it is negative
+int cache_lookup(dns_cache_t* cache, const dns_view_t* query, uint64_t now_ms, char* out, int out_size, int* negative)
+{
+    if (cache == NULL || query->header.QDCount != 1)
+        return 0;
+
+    uint8_t key[256];
+    int key_length = make_key(query, query->question, key);
+    if (key_length < 0)
+        return 0;
+
+    // the answer to the type, else the name does not exist at all
+    cache_entry_t* entry = find_live_entry(cache, key, key_length, query->qtype, query->qclass, now_ms);
+    if (entry == NULL && cache->negative_ttl)
+        entry = find_live_entry(cache, key, key_length, CACHE_ANY_TYPE, query->qclass, now_ms);
+
+    uint16_t question_length = query->question_end - query->question;
+    if (entry == NULL || entry->reply_length > out_size || entry->question_length != question_length)
+    {
+        cache->stats.misses++;
+        return 0;
+    }
+
+    touch_entry(cache, entry);
+    cache->stats.hits++;
+    if (entry->negative)
+        cache->stats.negative_hits++;
+    if (negative)
+        *negative = entry->negative;
+
+    // copy the reply, give it the ID of this query and echo the question exactly as it was asked
+    uint8_t* reply = (uint8_t*)out;
+    memcpy(reply, entry_reply(entry), entry->reply_length);
+    memcpy(reply + 12, query->dgram + query->question, question_length);
+
+    reply[0] = (uint8_t)(query->header.id >> 8);
+    reply[1] = (uint8_t)(query->header.id & 0xFF);
+    reply[2] = (reply[2] & ~(FLAG_RD >> 8)) | ((query->header.flags & FLAG_RD) >> 8);
+
+    // the records have been aging since they were stored
+    uint32_t elapsed = (uint32_t)((now_ms - entry->stored_ms) / 1000);
+    const uint16_t* ttl_offsets = entry_ttl_offsets(entry);
+
+    for (uint16_t i = 0; i < entry->ttl_count; i++)
+    {
+        uint32_t ttl = load_ttl(reply + ttl_offsets[i]);
+        store_ttl(reply + ttl_offsets[i], (ttl > elapsed) ? ttl - elapsed : 0);
+    }
+
+    return entry->reply_length;
+}
+
+// keeps an answer from the upstream server - returns 0 if stored
+int cache_store(dns_cache_t* cache, const dns_view_t* answer, uint64_t now_ms)
+{
+    if (cache == NULL)
+        return -1;
+
+    // only complete answers to a single question: positive ones, or negative ones (RFC 2308) if those are kept
+    uint16_t rcode = answer->header.flags & RC_MASK;
+    if (answer->header.QDCount != 1 || (answer->header.flags & FLAG_TC) || (rcode != RC_NOERROR && rcode != RC_NAMEERROR))
+        return -1;
+
+    int negative = (rcode == RC_NAMEERROR || answer->header.ANCount == 0);
+    if (negative && cache->negative_ttl == 0)
+        return -1;
+
+    unsigned int record_count = answer->header.ANCount + answer->header.NSCount + answer->header.ARCount;
+    if (record_count > CACHE_MAX_RECORDS)
+        return -1;
+
+    // the entry lives as long as the shortest TTL - a negative one no longer than the SOA allows
+    uint16_t ttl_offsets[CACHE_MAX_RECORDS];
+    uint16_t ttl_count = 0;
+    uint32_t ttl_limit = negative ? cache->negative_ttl : CACHE_MAX_TTL;
+    uint32_t min_ttl = ttl_limit;
+    uint16_t offset = answer->answers;
+    uint16_t soa_ttl_offset = 0;
+    uint32_t soa_ttl = 0;
+
+    // the OPT record of the upstream is not kept - each reply gets the one of its own query. It is the last record
+    // of about every answer, so the reply is stored up to it; an answer with records after it is not cached.
+    uint16_t reply_length = answer->opt ? answer->opt : answer->length;
+
+    for (unsigned int i = 0; i < record_count; i++)
+    {
+        dns_rr_view_t rr;
+        if (dns_view_read_rr(answer, &offset, &rr) != 0)
+            return -1;
+
+        if (rr.type == DNS_TYPE_OPT)
+        {
+            if (rr.name != answer->opt || offset != answer->end || (rr.ttl >> 24) != 0)
+                return -1; // a second OPT, records after it or an extended error
+            continue;
+        }
+
+        // the negative answer lasts as long as the smaller of the TTL and the MINIMUM field of the SOA in the authority section
+        uint32_t ttl = rr.ttl;
+        int authority = (i >= answer->header.ANCount && i < answer->header.ANCount + answer->header.NSCount);
+        if (negative && authority && rr.type == DNS_TYPE_SOA && soa_ttl_offset == 0 && rr.rdlength >= 22)
+        {
+            uint32_t minimum = load_ttl(answer->dgram + rr.rdata + rr.rdlength - 4);
+            if (minimum < ttl)
+                ttl = minimum;
+            soa_ttl_offset = rr.ttl_offset;
+            soa_ttl = ttl;
+        }
+
+        ttl_offsets[ttl_count++] = rr.ttl_offset;
+        if (ttl < min_ttl)
+            min_ttl = ttl;
+    }
+
+    // without a SOA there is no telling how long the name stays missing
+    if (min_ttl == 0 || (negative && soa_ttl_offset == 0))
+        return -1;
+
+    // a name that does not exist has no records of any type - unless it is an alias of one that does not
+    uint16_t qtype = (rcode == RC_NAMEERROR && answer->header.ANCount == 0) ? CACHE_ANY_TYPE : answer->qtype;
+
+    uint8_t key[256];
+    int key_length = make_key(answer, answer->question, key);
+    if (key_length < 0)
+        return -1;
+
+    size_t data_length = ((key_length + 1) & ~1u) + ttl_count * sizeof(uint16_t) + reply_length;
+    size_t size = sizeof(cache_entry_t) + data_length;
+
+    if (size > cache->memory_limit / 8)
+        return -1; // one answer may not take a big share of the cache
+
+    // replace a previous answer to the same question - and forget the name did not exist if it does now
+    uint64_t hash = hash_key(key, key_length, qtype, answer->qclass);
+    cache_entry_t* previous = find_entry(cache, hash, key, key_length, qtype, answer->qclass);
+    if (previous)
+        remove_entry(cache, previous);
+
+    if (rcode == RC_NOERROR && cache->negative_ttl)
+    {
+        previous = find_entry(cache, hash_key(key, key_length, CACHE_ANY_TYPE, answer->qclass), key, key_length, CACHE_ANY_TYPE, answer->qclass);
+        if (previous)
+            remove_entry(cache, previous);
+    }
+
+    make_room(cache, size);
+
+    cache_entry_t* entry = (cache_entry_t*)malloc(size);
+    if (entry == NULL)
+        return -1;
+
+    *entry = (cache_entry_t){
+        .hash = hash,
+        .stored_ms = now_ms,
+        .expires_ms = now_ms + (uint64_t)min_ttl * 1000,
+        .size = (uint32_t)size,
+        .qtype = qtype,
+        .qclass = answer->qclass,
+        .reply_length = reply_length,
+        .question_length = answer->question_end - answer->question,
+        .ttl_count = ttl_count,
+        .key_length = (uint8_t)key_length,
+        .segment = SEGMENT_PROBATION,
+        .negative = (uint8_t)negative,
+    };
+
+    memcpy(entry->data, key, key_length);
+    memcpy(entry_ttl_offsets(entry), ttl_offsets, ttl_count * sizeof(uint16_t));
+    memcpy(entry_reply(entry), answer->dgram, reply_length);
+
+    // TTLs above the cap are stored capped so they never count down from more than a day (or the negative TTL cap),
+    // and the SOA of a negative answer gets the TTL the answer was cached for
+    uint8_t* reply = entry_reply(entry);
+
+    if (answer->opt)
+    {
+        uint16_t arcount = answer->header.ARCount - 1;
+        reply[10] = (uint8_t)(arcount >> 8);
+        reply[11] = (uint8_t)arcount;
+    }
+
+    for (uint16_t i = 0; i < ttl_count; i++)
+    {
+        if (load_ttl(reply + ttl_offsets[i]) > ttl_limit)
+            store_ttl(reply + ttl_offsets[i], ttl_limit);
+    }
+
+    if (soa_ttl_offset && soa_ttl < load_ttl(reply + soa_ttl_offset))
+        store_ttl(reply + soa_ttl_offset, soa_ttl);
+
+    cache_entry_t** bucket = &cache->buckets[hash & cache->bucket_mask];
+    entry->chain = *bucket;
+    *bucket = entry;
+
+    list_push_newest(&cache->segments[SEGMENT_PROBATION], entry);
+
+    cache->stats.insertions++;
+    if (negative)
+        cache->stats.negative_insertions++;
+    cache->stats.entries++;
+    cache->stats.bytes += size;
+
+    return 0;
+}
+
+const dns_cache_stats_t* cache_stats(const dns_cache_t* cache)
+{
+    return &cache->stats;
+}
+
+void print_cache_stats(const dns_cache_stats_t* stats)
+{
+    printf("\nHits: %llu (negative %llu)\nMisses: %llu\nInsertions: %llu (negative %llu)\nEvictions: %llu\nExpirations: %llu\nEntries: %llu (%llu bytes)",
+           (unsigned long long)stats->hits,
+           (unsigned long long)stats->negative_hits,
+           (unsigned long long)stats->misses,
+           (unsigned long long)stats->insertions,
+           (unsigned long long)stats->negative_insertions,
+           (unsigned long long)stats->evictions,
+           (unsigned long long)stats->expirations,
+           (unsigned long long)stats->entries,
+           (unsigned long long)stats->bytes);
+}
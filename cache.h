@@ -0,0 +1,53 @@
+// ===================================================================================  //
+//    This program is free software: you can redistribute it and/or modify              //
+//    it under the terms of the GNU General Public License as published by              //
+//    the Free Software Foundation, either version 3 of the License, or                 //
+//    (at your option) any later version.                                               //
+//                                                                                      //
+//    This program is distributed in the hope that it will be useful,                   //
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of                    //
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                     //
+//    GNU General Public License for more details.                                      //
+//                                                                                      //
+//    You should have received a copy of the GNU General Public License                 //
+//    along with this program.  If not, see <https://www.gnu.org/licenses/>.            //
+//                                                                                      //
+//    Copyright: Luiz Gustavo Pfitscher e Feldmann, 2020                                //
+// ===================================================================================  //
+
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include "dns_protocol.h"
+#include <stddef.h>
+
+// Cache of the answers relayed from the upstream server, keyed by (qname, qtype, qclass).
+// Entries live for the smallest TTL of their records and are served with the TTLs decremented.
+// Memory is capped and eviction is a segmented LRU: new entries enter a probation segment and
+// only move to the protected one when hit again, so a scan of one-off names cannot flush the
+// names that are asked for all the time.
+// Negative answers are kept too (RFC 2308), for the MINIMUM of the SOA they carry: NODATA per (qname, qtype)
+// and NXDOMAIN per qname, answering for every type of the name.
+
+typedef struct dns_cache_stats {
+    uint64_t hits;
+    uint64_t negative_hits; // hits answered with NXDOMAIN or NODATA
+    uint64_t misses;
+    uint64_t insertions;
+    uint64_t negative_insertions;
+    uint64_t evictions;     // removed to make room
+    uint64_t expirations;   // removed because their TTL ran out
+    uint64_t entries;
+    uint64_t bytes;
+} dns_cache_stats_t;
+
+typedef struct dns_cache dns_cache_t;
+
+dns_cache_t* cache_create(size_t memory_limit, uint32_t negative_ttl);
+void cache_free(dns_cache_t* cache);
+int cache_lookup(dns_cache_t* cache, const dns_view_t* query, uint64_t now_ms, char* out, int out_size, int* negative);
+int cache_store(dns_cache_t* cache, const dns_view_t* answer, uint64_t now_ms);
+const dns_cache_stats_t* cache_stats(const dns_cache_t* cache);
+void print_cache_stats(const dns_cache_stats_t* stats);
+
+#endif // _CACHE_H_
@@ -16,9 +16,14 @@
 // ===================================================================================  //
 
 #include "dns_protocol.h"
-#include <winsock2.h>
+#include "socket_compat.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+
+#define TRANSACTION_ARENA_SIZE (16 * 1024)  // private arena of a transaction created without one
+#define INITIAL_ANSWER_CAPACITY 4           // answers allocated the first time a section is added to
 
 // UTILITY
 // ================================================================
@@ -47,14 +52,13 @@ char* read_dns_name(const char* dgram_start, const char* name_start, char* desti
                 break;
 
             // pointer
-            uint16_t pointer = *((uint8_t*)currPtr) + (label_len & 0b00111111)*255; // pointer is 14 bit long comprised of the "label-length" plus one more byte
+            uint16_t pointer = *((uint8_t*)currPtr) + (label_len & 0b00111111)*256; // pointer is 14 bit long comprised of the "label-length" plus one more byte
             currPtr++;
 
             char pointer_labels[QNAME_SIZE] = "";
             read_dns_name(dgram_start, (char*)(dgram_start + pointer), pointer_labels);
 
-            strcat(destination, pointer_labels);
-            strcat(destination, ".");
+            strcat(destination, pointer_labels); // already ends with the dot
 
             break;
         }
@@ -121,6 +125,80 @@ int domain_plain_to_label(const char* name, char *label_buff)
     return strlen(label_buff) + 1; // return the length of the label-formated data
 }
 
+// tells if the plain text name (from the first label up to the final dot) equals the wire name at the offset
+static int compressed_name_equals(const dns_compression_t* compression, const char* name, uint16_t offset)
+{
+    const uint8_t* message = (const uint8_t*)compression->message;
+    int hops = 0;
+
+    for (;;)
+    {
+        uint8_t label_len = message[offset];
+
+        if ((label_len & 0xC0) == 0xC0)
+        {
+            if (++hops > 16)
+                return 0;
+
+            offset = ((label_len & 0x3F) << 8) | message[offset + 1];
+            continue;
+        }
+
+        const char* dot = strchr(name, '.');
+
+        if (label_len == 0)
+            return dot == NULL; // both ended
+        else if (dot == NULL || dot - name != label_len)
+            return 0;
+
+        for (uint8_t i = 0; i < label_len; i++)
+            if (tolower((uint8_t)name[i]) != tolower(message[offset + 1 + i]))
+                return 0;
+
+        name = dot + 1;
+        offset += 1 + label_len;
+    }
+}
+
+// writes the plain text name in label format - pointing to a previous name whenever one ends with the same labels
+char* write_dns_name(char* position, const char* name, dns_compression_t* compression)
+{
+    if (compression == NULL)
+        return position + domain_plain_to_label(name, position);
+
+    // only the labels terminated by a dot are written - same as domain_plain_to_label
+    while (name && strchr(name, '.') && *name != '.')
+    {
+        for (uint16_t i = 0; i < compression->count; i++)
+        {
+            if (compressed_name_equals(compression, name, compression->offsets[i]))
+            {
+                uint16_t pointer = 0xC000 | compression->offsets[i];
+                position[0] = (char)(pointer >> 8);
+                position[1] = (char)(pointer & 0xFF);
+                return position + 2;
+            }
+        }
+
+        // pointers only reach the first 16k of the message
+        size_t offset = position - compression->message;
+        if (offset < 0x4000 && compression->count < DNS_COMPRESSION_ENTRIES)
+            compression->offsets[compression->count++] = (uint16_t)offset;
+
+        const char* dot = strchr(name, '.');
+        uint8_t label_len = (uint8_t)(dot - name);
+
+        *position++ = (char)label_len;
+        memcpy(position, name, label_len);
+        position += label_len;
+
+        name = dot + 1;
+    }
+
+    *position++ = 0;
+    return position;
+}
+
 char* getTypeString(uint16_t _type)
 {
     switch (_type)
@@ -266,7 +344,7 @@ char* read_dns_question(const char* dgram_start, const char* question_start, dns
     return curr;
 }
 
-char* write_dns_question(char* position, dns_question_t* question)
+char* write_dns_question(char* position, dns_question_t* question, dns_compression_t* compression)
 {
     if (question == NULL || position == NULL)
     {
@@ -274,7 +352,7 @@ char* write_dns_question(char* position, dns_question_t* question)
         return NULL;
     }
 
-    char *curr = position + domain_plain_to_label(question->qname, position);
+    char *curr = write_dns_name(position, question->qname, compression);
 
     *((uint16_t*)(curr)) = htons(question->qtype);
     curr += sizeof(question->qtype);
@@ -296,9 +374,18 @@ void print_dns_question(dns_question_t* question)
 // ANSWER
 // ================================================================
 
-char* read_dns_answer(const char* dgram_start, const char* answer_start, dns_answer_t* answer)
+// the name and the data are copied into the arena - returns NULL if it is out of memory
+char* read_dns_answer(const char* dgram_start, const char* answer_start, dns_answer_t* answer, arena_t* arena)
 {
-    char* curr = read_dns_name(dgram_start, (char*)answer_start, answer->aname);
+    char aname[QNAME_SIZE] = "";
+    char* curr = read_dns_name(dgram_start, (char*)answer_start, aname);
+
+    char* name_copy = (char*)arena_alloc(arena, strlen(aname) + 1);
+    if (name_copy == NULL)
+        return NULL;
+
+    strcpy(name_copy, aname);
+    answer->aname = name_copy;
 
     answer->atype = ntohs( *((uint16_t*)(curr)) );
     curr += sizeof(answer->atype);
@@ -313,15 +400,41 @@ char* read_dns_answer(const char* dgram_start, const char* answer_start, dns_ans
     curr += sizeof(answer->rdlength);
 
     // read the data
-    memcpy(answer->rdata, curr, min(answer->rdlength, RDATA_SIZE));
+    uint8_t* rdata = (uint8_t*)arena_alloc(arena, min(answer->rdlength, RDATA_SIZE) + 1);
+    if (rdata == NULL)
+        return NULL;
+
+    memcpy(rdata, curr, min(answer->rdlength, RDATA_SIZE));
+    answer->rdata = rdata;
     curr += answer->rdlength;
 
     return curr;
 }
 
-char* write_dns_answer(char* position, dns_answer_t* answer)
+// tells if the rdata is a single uncompressed name filling it exactly
+static int rdata_is_plain_name(const dns_answer_t* answer)
+{
+    uint16_t length = min(answer->rdlength, RDATA_SIZE);
+    uint16_t offset = 0;
+
+    while (offset < length)
+    {
+        uint8_t label_len = answer->rdata[offset];
+
+        if (label_len == 0)
+            return offset + 1 == length;
+        else if (label_len & 0xC0)
+            return 0;
+
+        offset += 1 + label_len;
+    }
+
+    return 0;
+}
+
+char* write_dns_answer(char* position, const dns_answer_t* answer, dns_compression_t* compression)
 {
-    char *curr = position + domain_plain_to_label(answer->aname, position);
+    char *curr = write_dns_name(position, answer->aname, compression);
 
     *((uint16_t*)(curr)) = htons(answer->atype);
     curr += sizeof(answer->atype);
@@ -332,17 +445,29 @@ char* write_dns_answer(char* position, dns_answer_t* answer)
     *((uint32_t*)(curr)) = htonl(answer->ttl);
     curr += sizeof(answer->ttl);
 
-    *((uint16_t*)(curr)) = htons(answer->rdlength);
+    char* rdlength = curr;
     curr += sizeof(answer->rdlength);
 
-    // write the data
-    memcpy(curr, answer->rdata, min(answer->rdlength, RDATA_SIZE));
-    curr += answer->rdlength;
+    // the names in the data of CNAME and NS records may be compressed too (RFC 1035 4.1.4)
+    if (compression && (answer->atype == DNS_TYPE_CNAME || answer->atype == DNS_TYPE_NS) && rdata_is_plain_name(answer))
+    {
+        char target[QNAME_SIZE + 1];
+        read_dns_name(NULL, (const char*)answer->rdata, target);
+        curr = write_dns_name(curr, target, compression);
+    }
+    else
+    {
+        // write the data
+        memcpy(curr, answer->rdata, min(answer->rdlength, RDATA_SIZE));
+        curr += answer->rdlength;
+    }
+
+    *((uint16_t*)(rdlength)) = htons((uint16_t)(curr - rdlength - sizeof(answer->rdlength)));
 
     return curr;
 }
 
-void print_dns_answer(dns_answer_t* answer)
+void print_dns_answer(const dns_answer_t* answer)
 {
     printf("\nName: %s\nType: %s\nClass: %s\nTime: %u\nData length: %u",
            answer->aname,
@@ -352,13 +477,39 @@ void print_dns_answer(dns_answer_t* answer)
            answer->rdlength);
 
     if (answer->atype == DNS_TYPE_A && answer->aclass == DNS_CLASS_IN)
-        printf("\nIP: %s", inet_ntoa((struct in_addr) {.S_un.S_addr = *((uint32_t*)answer->rdata) }));
+    {
+        struct in_addr address;
+        memcpy(&address.s_addr, answer->rdata, sizeof(address.s_addr));
+        printf("\nIP: %s", inet_ntoa(address));
+    }
 }
 
 // TRANSACTION
 // ================================================================
 //#define TRANSACTION_PRINT 1
-dns_transaction_t* read_dns_transaction(const char* dgram, int length)
+// allocates an empty transaction from the arena - or from a new one owned by the transaction
+static dns_transaction_t* alloc_dns_transaction(arena_t* arena)
+{
+    uint8_t owns_arena = (arena == NULL);
+
+    if (owns_arena && (arena = arena_create(TRANSACTION_ARENA_SIZE)) == NULL)
+        return NULL;
+
+    dns_transaction_t* tra = (dns_transaction_t*)arena_calloc(arena, 1, sizeof(dns_transaction_t));
+    if (tra == NULL)
+    {
+        if (owns_arena)
+            arena_free(arena);
+
+        return NULL;
+    }
+
+    tra->arena = arena;
+    tra->owns_arena = owns_arena;
+    return tra;
+}
+
+dns_transaction_t* read_dns_transaction(const char* dgram, int length, arena_t* arena)
 {
     if (length < 12)
         return NULL;
@@ -372,13 +523,25 @@ dns_transaction_t* read_dns_transaction(const char* dgram, int length)
     currentPosition += 12;
 
     // alloc the transaction struct
-    dns_transaction_t* tra = (dns_transaction_t*)malloc(sizeof(dns_transaction_t));
+    dns_transaction_t* tra = alloc_dns_transaction(arena);
+    if (tra == NULL)
+        return NULL;
 
     tra->header = header;
-    tra->questions  = (tra->header.QDCount == 0) ? NULL : (dns_question_t*)calloc(tra->header.QDCount, sizeof(dns_question_t));
-    tra->answers_an = (tra->header.ANCount == 0) ? NULL :   (dns_answer_t*)calloc(tra->header.ANCount, sizeof(dns_answer_t));
-    tra->answers_ns = (tra->header.NSCount == 0) ? NULL :   (dns_answer_t*)calloc(tra->header.NSCount, sizeof(dns_answer_t));
-    tra->answers_ar = (tra->header.ARCount == 0) ? NULL :   (dns_answer_t*)calloc(tra->header.ARCount, sizeof(dns_answer_t));
+    tra->questions  = (tra->header.QDCount == 0) ? NULL : (dns_question_t*)arena_calloc(tra->arena, tra->header.QDCount, sizeof(dns_question_t));
+    tra->answers_an = (tra->header.ANCount == 0) ? NULL :   (dns_answer_t*)arena_calloc(tra->arena, tra->header.ANCount, sizeof(dns_answer_t));
+    tra->answers_ns = (tra->header.NSCount == 0) ? NULL :   (dns_answer_t*)arena_calloc(tra->arena, tra->header.NSCount, sizeof(dns_answer_t));
+    tra->answers_ar = (tra->header.ARCount == 0) ? NULL :   (dns_answer_t*)arena_calloc(tra->arena, tra->header.ARCount, sizeof(dns_answer_t));
+    tra->an_capacity = tra->header.ANCount;
+    tra->ns_capacity = tra->header.NSCount;
+    tra->ar_capacity = tra->header.ARCount;
+
+    if ((tra->header.QDCount && !tra->questions) || (tra->header.ANCount && !tra->answers_an) ||
+        (tra->header.NSCount && !tra->answers_ns) || (tra->header.ARCount && !tra->answers_ar))
+    {
+        free_dns_transaction(tra);
+        return NULL;
+    }
 
     #ifdef TRANSACTION_PRINT
     print_dns_header(&tra->header);
@@ -397,7 +560,12 @@ dns_transaction_t* read_dns_transaction(const char* dgram, int length)
 
     for (i = 0; (i < header.ANCount) && (currentPosition < maxPosition); i++)
     {
-        currentPosition = read_dns_answer(dgram, currentPosition, &tra->answers_an[i]);
+        currentPosition = read_dns_answer(dgram, currentPosition, &tra->answers_an[i], tra->arena);
+        if (currentPosition == NULL)
+        {
+            free_dns_transaction(tra);
+            return NULL;
+        }
 
         #ifdef TRANSACTION_PRINT
         printf("\n\nANSWER RECORD #%d:", i);
@@ -407,7 +575,12 @@ dns_transaction_t* read_dns_transaction(const char* dgram, int length)
 
     for (i = 0; (i < header.NSCount) && currentPosition < maxPosition; i++)
     {
-        currentPosition = read_dns_answer(dgram, currentPosition, &tra->answers_ns[i]);
+        currentPosition = read_dns_answer(dgram, currentPosition, &tra->answers_ns[i], tra->arena);
+        if (currentPosition == NULL)
+        {
+            free_dns_transaction(tra);
+            return NULL;
+        }
 
         #ifdef TRANSACTION_PRINT
         printf("\n\nAUTHORITATIVE NAME SERVER #%d:", i);
@@ -417,7 +590,12 @@ dns_transaction_t* read_dns_transaction(const char* dgram, int length)
 
     for (i = 0; (i < header.ARCount) && currentPosition < maxPosition; i++)
     {
-        currentPosition = read_dns_answer(dgram, currentPosition, &tra->answers_ar[i]);
+        currentPosition = read_dns_answer(dgram, currentPosition, &tra->answers_ar[i], tra->arena);
+        if (currentPosition == NULL)
+        {
+            free_dns_transaction(tra);
+            return NULL;
+        }
 
         #ifdef TRANSACTION_PRINT
         printf("\n\nADDITIONAL RECORD #%d:", i);
@@ -428,93 +606,167 @@ dns_transaction_t* read_dns_transaction(const char* dgram, int length)
     return tra;
 }
 
-int write_dns_transaction(char* dgram, int buffer_length, dns_transaction_t* tra)
+// the most a record can take - its names written without compression
+static int max_answer_size(const dns_answer_t* answer)
 {
-    char* position = dgram;
+    return (int)strlen(answer->aname) + 2 + 10 + answer->rdlength;
+}
 
-    position = write_dns_header(position, &tra->header);
+static int same_rrset(const dns_answer_t* a, const dns_answer_t* b)
+{
+    return a->atype == b->atype && a->aclass == b->aclass && (a->aname == b->aname || strcmp(a->aname, b->aname) == 0);
+}
 
+// the most the RRset starting at records[first] can take - sets *next to the record after it. Once the first
+// record is written its owner name is in the compression table, so the others only take a pointer for theirs
+static int max_rrset_size(const dns_answer_t* records, int count, int first, int* next, const dns_compression_t* compression, int offset)
+{
+    int compressible = offset < 0x4000 && compression->count < DNS_COMPRESSION_ENTRIES;
+    int size = max_answer_size(&records[first]);
     int i;
 
-    for (i = 0; (i < tra->header.QDCount) && ((int)(position - dgram) < buffer_length); i++)
-        position = write_dns_question(position, &tra->questions[i]);
+    for (i = first + 1; i < count && same_rrset(&records[first], &records[i]); i++)
+        size += compressible ? 2 + 10 + records[i].rdlength : max_answer_size(&records[i]);
 
-    for (i = 0; (i < tra->header.ANCount) && ((int)(position - dgram) < buffer_length); i++)
-        position = write_dns_answer(position, &tra->answers_an[i]);
+    *next = i;
+    return size;
+}
 
-    for (i = 0; (i < tra->header.NSCount) && ((int)(position - dgram) < buffer_length); i++)
-        position = write_dns_answer(position, &tra->answers_ns[i]);
+// writes the message in at most buffer_length bytes, RRsets only whole (RFC 2181 9): when one of the answer or
+// authority section does not fit, the message ends before it with TC set so the client asks again over TCP -
+// the additional RRsets that do not fit are just left out
+int write_dns_transaction(char* dgram, int buffer_length, dns_transaction_t* tra)
+{
+    dns_header_t header = tra->header;
+    const char* end = dgram + buffer_length;
+    char* position = dgram + 12; // the header goes last, once the counts are known
+    dns_compression_t compression = { .message = dgram, .count = 0 };
+
+    int i;
 
-    for (i = 0; (i < tra->header.ARCount) && ((int)(position - dgram) < buffer_length); i++)
-        position = write_dns_answer(position, &tra->answers_ar[i]);
+    for (i = 0; i < tra->header.QDCount && position + strlen(tra->questions[i].qname) + 2 + 4 <= end; i++)
+        position = write_dns_question(position, &tra->questions[i], &compression);
+    header.QDCount = i;
+
+    const dns_answer_t* sections[3] = { tra->answers_an, tra->answers_ns, tra->answers_ar };
+    uint16_t* counts[3] = { &header.ANCount, &header.NSCount, &header.ARCount };
+    int truncated = 0;
+
+    for (int s = 0; s < 3; s++)
+    {
+        int count = truncated ? 0 : *counts[s];
+        int written = 0;
+        int next;
 
+        for (i = 0; i < count; i = next)
+        {
+            if (position + max_rrset_size(sections[s], count, i, &next, &compression, (int)(position - dgram)) > end)
+            {
+                if (s < 2)
+                {
+                    truncated = 1;
+                    break;
+                }
+
+                continue;
+            }
+
+            for (int r = i; r < next; r++)
+                position = write_dns_answer(position, &sections[s][r], &compression);
+
+            written += next - i;
+        }
+
+        *counts[s] = written;
+    }
+
+    if (truncated)
+        header.flags |= FLAG_TC;
+
+    write_dns_header(dgram, &header);
     return (int)(position - dgram);
 }
 
-dns_transaction_t* create_dns_reply(dns_transaction_t* query)
+dns_transaction_t* create_dns_reply(dns_transaction_t* query, arena_t* arena)
 {
-    dns_transaction_t* reply = (dns_transaction_t*)malloc(sizeof(dns_transaction_t));
+    dns_transaction_t* reply = alloc_dns_transaction(arena);
     if (reply == NULL)
         return NULL;
 
-    *reply = (dns_transaction_t) {
-        .header = (dns_header_t){
-            .id = query->header.id,
-            .flags = query->header.flags | QR_RESPONSE | FLAG_AA,
-            .QDCount = query->header.QDCount,
-            .ANCount = 0,
-            .NSCount = 0,
-            .ARCount = 0,
-        },
-        .questions = (dns_question_t*)calloc(query->header.QDCount, sizeof(dns_question_t)),
-        .answers_an = NULL,
-        .answers_ns = NULL,
-        .answers_ar = NULL,
+    reply->header = (dns_header_t){
+        .id = query->header.id,
+        .flags = query->header.flags | QR_RESPONSE | FLAG_AA,
+        .QDCount = query->header.QDCount,
+        .ANCount = 0,
+        .NSCount = 0,
+        .ARCount = 0,
     };
 
+    reply->questions = (dns_question_t*)arena_calloc(reply->arena, query->header.QDCount, sizeof(dns_question_t));
+    if (reply->questions == NULL)
+    {
+        free_dns_transaction(reply);
+        return NULL;
+    }
+
     // the reply carries a copy of the queried questions
     memcpy(reply->questions, query->questions, query->header.QDCount*sizeof(dns_question_t));
 
     return reply;
 }
 
-void add_answer_to_dns_reply(dns_transaction_t* reply, dns_answer_t new_answer)
+void add_answer_to_dns_reply(dns_transaction_t* reply, const dns_answer_t* new_answer)
 {
-    if (reply == NULL)
+    if (reply == NULL || new_answer == NULL)
         return;
 
     uint16_t* counter = &reply->header.ARCount;
+    uint16_t* capacity = &reply->ar_capacity;
     dns_answer_t **list = &reply->answers_ar;
 
-    if (new_answer.atype == DNS_TYPE_A)
+    if (new_answer->atype == DNS_TYPE_A)
     {
         counter = &reply->header.ANCount;
+        capacity = &reply->an_capacity;
         list = &reply->answers_an;
     }
-    else if (new_answer.atype == DNS_TYPE_NS)
+    else if (new_answer->atype == DNS_TYPE_NS)
     {
         counter = &reply->header.NSCount;
+        capacity = &reply->ns_capacity;
         list = &reply->answers_ns;
     }
 
-    dns_answer_t *new_list = (dns_answer_t*)realloc((*list), sizeof(dns_answer_t)* ((*counter) + 1));
-    if (new_list == NULL)
-        return; // reallocation failed
-    else
+    if (*counter == UINT16_MAX)
+        return; // the section is full
+
+    // the list doubles when full, so adding n answers copies O(n) elements instead of O(n^2)
+    if (*counter == *capacity)
+    {
+        uint32_t new_capacity = (*capacity == 0) ? INITIAL_ANSWER_CAPACITY : min(2u * (*capacity), UINT16_MAX);
+
+        dns_answer_t *new_list = (dns_answer_t*)arena_grow(reply->arena, *list, sizeof(dns_answer_t) * (*capacity), sizeof(dns_answer_t) * new_capacity);
+        if (new_list == NULL)
+            return; // allocation failed
+
         (*list) = new_list;
+        (*capacity) = (uint16_t)new_capacity;
+    }
 
-    new_list[*counter] = new_answer; // copy the new answer to inside the new element on the list
+    (*list)[*counter] = *new_answer; // copy the new answer to inside the new element on the list
 
     (*counter) = (*counter) + 1;
 }
 
 void free_dns_transaction(dns_transaction_t* tra)
 {
-    free(tra->questions);
-    free(tra->answers_an);
-    free(tra->answers_ns);
-    free(tra->answers_ar);
-    free(tra);
+    if (tra == NULL)
+        return;
+
+    if (tra->owns_arena)
+        arena_free(tra->arena);
+    else
+        arena_reset(tra->arena);
 }
 
 void print_dns_transaction(dns_transaction_t* tra)
@@ -546,3 +798,327 @@ void print_dns_transaction(dns_transaction_t* tra)
         print_dns_answer(&tra->answers_ar[i]);
     }
 }
+
+// VIEW
+// ================================================================
+#define MAX_POINTER_HOPS 16 // a legitimate name never needs more than a few
+
+static inline uint16_t peek_u16(const uint8_t* position)
+{
+    return (uint16_t)((position[0] << 8) | position[1]);
+}
+
+static inline uint32_t peek_u32(const uint8_t* position)
+{
+    return ((uint32_t)position[0] << 24) | ((uint32_t)position[1] << 16) | ((uint32_t)position[2] << 8) | (uint32_t)position[3];
+}
+
+// walks over the name stored at the offset (without following pointers) - returns the offset right after it or -1 if malformed
+int dns_skip_name(const uint8_t* dgram, uint16_t length, uint16_t offset)
+{
+    int position = offset;
+
+    while (position < length)
+    {
+        uint8_t label_len = dgram[position];
+
+        if (label_len == 0)
+            return position + 1;
+        else if ((label_len & 0xC0) == 0xC0) // a pointer ends the name
+            return (position + 2 <= length) ? position + 2 : -1;
+        else if (label_len & 0xC0) // reserved label types
+            return -1;
+
+        position += 1 + label_len;
+    }
+
+    return -1;
+}
+
+void dns_name_iter_init(dns_name_iter_t* iter, const dns_view_t* view, uint16_t offset)
+{
+    *iter = (dns_name_iter_t){
+        .dgram = view->dgram,
+        .length = view->length,
+        .position = offset,
+        .decoded = 0,
+        .hops = 0,
+    };
+}
+
+// gives the next label of the name - returns 1 for a label, 0 at the end of the name and -1 if malformed
+int dns_name_iter_next(dns_name_iter_t* iter, const uint8_t** label, uint8_t* label_length)
+{
+    for (;;)
+    {
+        if (iter->position >= iter->length)
+            return -1;
+
+        uint8_t label_len = iter->dgram[iter->position];
+
+        if ((label_len & 0xC0) == 0xC0)
+        {
+            // pointer is 14 bit long comprised of the "label-length" plus one more byte
+            if (iter->position + 1 >= iter->length || ++iter->hops > MAX_POINTER_HOPS)
+                return -1;
+
+            iter->position = ((label_len & 0x3F) << 8) | iter->dgram[iter->position + 1];
+            continue;
+        }
+        else if (label_len & 0xC0)
+            return -1;
+        else if (label_len == 0)
+            return 0;
+
+        if (iter->position + 1 + label_len > iter->length)
+            return -1;
+
+        iter->decoded += label_len + 1;
+        if (iter->decoded > 255)
+            return -1;
+
+        *label = iter->dgram + iter->position + 1;
+        *label_length = label_len;
+        iter->position += 1 + label_len;
+
+        return 1;
+    }
+}
+
+// decodes the name at the offset to plain text (same format as read_dns_name) - returns its length or -1
+int dns_view_read_name(const dns_view_t* view, uint16_t offset, char* destination, int size)
+{
+    dns_name_iter_t iter;
+    dns_name_iter_init(&iter, view, offset);
+
+    const uint8_t* label;
+    uint8_t label_len;
+    int written = 0;
+    int ret;
+
+    while ((ret = dns_name_iter_next(&iter, &label, &label_len)) == 1)
+    {
+        if (written + label_len + 2 > size)
+            return -1;
+
+        memcpy(destination + written, label, label_len);
+        written += label_len;
+        destination[written++] = '.';
+    }
+
+    if (ret < 0 || size < 1)
+        return -1;
+
+    destination[written] = '\0';
+    return written;
+}
+
+// hash of the question - name (in any case), type and class - to tell the answers to a query from answers to another
+uint32_t dns_question_hash(const dns_view_t* view)
+{
+    // FNV-1a 32
+    uint32_t hash = 2166136261u;
+
+    for (uint16_t i = view->question; i < view->question_end; i++)
+    {
+        uint8_t c = view->dgram[i];
+        hash ^= (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+// reads the resource record at the offset and moves the offset past it - returns 0 or -1 if malformed
+int dns_view_read_rr(const dns_view_t* view, uint16_t* offset, dns_rr_view_t* rr)
+{
+    int name_end = dns_skip_name(view->dgram, view->length, *offset);
+    if (name_end < 0 || name_end + 10 > view->length)
+        return -1;
+
+    const uint8_t* fixed = view->dgram + name_end;
+
+    *rr = (dns_rr_view_t){
+        .name = *offset,
+        .type = peek_u16(fixed),
+        .class = peek_u16(fixed + 2),
+        .ttl = peek_u32(fixed + 4),
+        .ttl_offset = name_end + 4,
+        .rdlength = peek_u16(fixed + 8),
+        .rdata = name_end + 10,
+    };
+
+    if (rr->rdata + rr->rdlength > view->length)
+        return -1;
+
+    *offset = rr->rdata + rr->rdlength;
+    return 0;
+}
+
+// maps the sections of the datagram - returns 0 or -1 if it is malformed
+int dns_view_parse(dns_view_t* view, const char* dgram, int length)
+{
+    if (dgram == NULL || length < 12 || length > 65535)
+        return -1;
+
+    const uint8_t* data = (const uint8_t*)dgram;
+
+    *view = (dns_view_t){
+        .dgram = data,
+        .length = (uint16_t)length,
+        .header = (dns_header_t){
+            .id      = peek_u16(data),
+            .flags   = peek_u16(data + 2),
+            .QDCount = peek_u16(data + 4),
+            .ANCount = peek_u16(data + 6),
+            .NSCount = peek_u16(data + 8),
+            .ARCount = peek_u16(data + 10),
+        },
+        .question = 12,
+        .question_end = 12,
+    };
+
+    uint16_t offset = 12;
+
+    for (int q = 0; q < view->header.QDCount; q++)
+    {
+        int name_end = dns_skip_name(data, view->length, offset);
+        if (name_end < 0 || name_end + 4 > view->length)
+            return -1;
+
+        // the question names are read later by the responder - make sure they decode (no pointer loops, not too long)
+        dns_name_iter_t iter;
+        const uint8_t* label;
+        uint8_t label_len;
+        int ret;
+
+        dns_name_iter_init(&iter, view, offset);
+        while ((ret = dns_name_iter_next(&iter, &label, &label_len)) == 1);
+
+        if (ret < 0)
+            return -1;
+
+        if (q == 0)
+        {
+            view->qtype = peek_u16(data + name_end);
+            view->qclass = peek_u16(data + name_end + 2);
+            view->question_end = name_end + 4;
+        }
+
+        offset = name_end + 4;
+    }
+
+    const uint16_t counts[3] = { view->header.ANCount, view->header.NSCount, view->header.ARCount };
+    uint16_t* sections[3] = { &view->answers, &view->authority, &view->additional };
+
+    for (int s = 0; s < 3; s++)
+    {
+        *sections[s] = offset;
+
+        for (int i = 0; i < counts[s]; i++)
+        {
+            dns_rr_view_t rr;
+            if (dns_view_read_rr(view, &offset, &rr) != 0)
+                return -1;
+
+            // the OPT record is owned by the root and only valid among the additional records
+            if (s == 2 && rr.type == DNS_TYPE_OPT && data[rr.name] == 0 && view->opt == 0)
+            {
+                view->opt = rr.name;
+                view->edns_payload = rr.class;
+                view->edns_version = (uint8_t)(rr.ttl >> 16);
+            }
+        }
+    }
+
+    view->end = offset;
+    return 0;
+}
+
+dns_transaction_t* create_dns_reply_from_view(const dns_view_t* query, arena_t* arena)
+{
+    dns_transaction_t* reply = alloc_dns_transaction(arena);
+    if (reply == NULL)
+        return NULL;
+
+    reply->header = (dns_header_t){
+        .id = query->header.id,
+        .flags = query->header.flags | QR_RESPONSE | FLAG_AA,
+        .QDCount = query->header.QDCount,
+        .ANCount = 0,
+        .NSCount = 0,
+        .ARCount = 0,
+    };
+
+    reply->questions = (dns_question_t*)arena_calloc(reply->arena, query->header.QDCount, sizeof(dns_question_t));
+    if (reply->questions == NULL)
+    {
+        free_dns_transaction(reply);
+        return NULL;
+    }
+
+    // the reply carries a copy of the queried questions - decoded straight from the datagram
+    uint16_t offset = query->question;
+    for (uint16_t q = 0; q < query->header.QDCount; q++)
+    {
+        dns_question_t* question = &reply->questions[q];
+        int name_end = dns_skip_name(query->dgram, query->length, offset);
+
+        if (name_end < 0 || name_end + 4 > query->length || dns_view_read_name(query, offset, question->qname, QNAME_SIZE) < 0)
+        {
+            free_dns_transaction(reply);
+            return NULL;
+        }
+
+        question->qtype = peek_u16(query->dgram + name_end);
+        question->qclass = peek_u16(query->dgram + name_end + 2);
+        offset = name_end + 4;
+    }
+
+    return reply;
+}
+
+// writes a reply to the query carrying only its question, as it was asked - returns the length or -1 if it does not fit
+int write_question_reply(const dns_view_t* query, uint16_t rcode, char* out, int out_size)
+{
+    int question_length = query->question_end - query->question;
+    uint16_t flags = (query->header.flags & ~RC_MASK) | QR_RESPONSE | (rcode & RC_MASK);
+
+    if (query->header.QDCount == 0 || 12 + question_length > out_size)
+        return -1;
+
+    dns_header_t header = { .id = query->header.id, .flags = flags, .QDCount = 1 };
+    write_dns_header(out, &header);
+    memcpy(out + 12, query->dgram + query->question, question_length);
+
+    return 12 + question_length;
+}
+
+// adds an OPT record without options to the additional section of the message, advertising the UDP payload we take.
+// The extended RCODE is the whole 12-bit code - its lower 4 bits replace the RCODE of the header - or 0 to keep
+// the RCODE the message has. Returns the new length, or -1 if it does not fit in size.
+int dns_append_opt(char* message, int length, int size, uint16_t payload, uint16_t extended_rcode)
+{
+    if (length < 12 || length + DNS_OPT_SIZE > size)
+        return -1;
+
+    uint8_t* header = (uint8_t*)message;
+    uint8_t* opt = (uint8_t*)message + length;
+    uint16_t arcount = peek_u16(header + 10) + 1;
+
+    if (extended_rcode)
+        header[3] = (header[3] & ~RC_MASK) | (extended_rcode & RC_MASK);
+
+    header[10] = (uint8_t)(arcount >> 8);
+    header[11] = (uint8_t)arcount;
+
+    opt[0] = 0;                                 // root
+    opt[1] = 0;
+    opt[2] = DNS_TYPE_OPT;
+    opt[3] = (uint8_t)(payload >> 8);           // class: the payload
+    opt[4] = (uint8_t)payload;
+    opt[5] = (uint8_t)(extended_rcode >> 4);    // TTL: upper bits of the extended RCODE, version 0, no flags
+    memset(opt + 6, 0, 5);                      // and no options
+
+    return length + DNS_OPT_SIZE;
+}
@@ -19,6 +19,7 @@
 #define _DNS_PROTOCOL_H_
 
 #include <stdint.h>
+#include "arena.h"
 
 // REFERENCES:
 //  http://www.tcpipguide.com/free/t_DNSMessageHeaderandQuestionSectionFormat.htm
@@ -122,6 +123,7 @@ enum dns_type {
     DNS_TYPE_MX     = 15,        // 15 // mail exchange
     DNS_TYPE_TXT    = 16,        // 16 // text strings
     DNS_TYPE_AAAA   = 28,        // 28 // ipv6 host address
+    DNS_TYPE_OPT    = 41,        // 41 // EDNS pseudo-record (RFC 6891) - its class is the UDP payload size and its TTL holds flags
     DNS_TYPE_ANY    = 255,       // - FOR INTERNAL USE ONLY - NOT AN ACTUAL TYPE
 };
 
@@ -164,43 +166,116 @@ typedef struct dns_question
 // +--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+
 
 
+// The name and the data are not stored in the answer: they point into the zone the answer comes from,
+// or into the arena of the transaction it was read into - so copying an answer is cheap.
 #define RDATA_SIZE 255
 typedef struct dns_answer {
-    char aname[QNAME_SIZE]; // this data is parsed - pointers are resolved and label format is converted to plain text
+    const char* aname;  // this data is parsed - pointers are resolved and label format is converted to plain text
     uint16_t atype;     // This field specifies the meaning of the data in the RDATA field
     uint16_t aclass;    // the class of the data in the RDATA field
     uint32_t ttl;       // The number of seconds the results can be cached
     uint16_t rdlength;  // The length of the RDATA field
-    uint8_t rdata[RDATA_SIZE]; // this data is stored "as read from datagram" - no parsing at all
+    const uint8_t* rdata; // this data is stored "as read from datagram" - no parsing at all - up to RDATA_SIZE octets
 } dns_answer_t;
 
 
+// Suffix table used while serializing one message: every name (and each of its suffixes) written
+// so far is remembered by offset, so a later name ending the same way is written as a pointer (RFC 1035 4.1.4)
+#define DNS_COMPRESSION_ENTRIES 64
+typedef struct dns_compression {
+    const char* message;    // start of the message - pointers are offsets from here
+    uint16_t count;
+    uint16_t offsets[DNS_COMPRESSION_ENTRIES];
+} dns_compression_t;
+
 typedef struct dns_transaction {
     dns_header_t header;
     dns_question_t *questions;
     dns_answer_t *answers_an;
     dns_answer_t *answers_ns;
     dns_answer_t *answers_ar;
+    uint16_t an_capacity;   // elements allocated in each answer list - grown geometrically
+    uint16_t ns_capacity;
+    uint16_t ar_capacity;
+    uint8_t owns_arena;     // the arena was created for this transaction alone
+    arena_t* arena;         // the transaction and its lists are allocated from here
 } dns_transaction_t;
 
 
 
+// A view describes a datagram in place: nothing is copied or allocated and every offset is checked against the length.
+// Names are read straight from the packet with the iterator, following compression pointers.
+typedef struct dns_name_iter {
+    const uint8_t* dgram;
+    uint16_t length;
+    uint16_t position;  // offset of the next label
+    uint16_t decoded;   // octets of the name decoded so far - limited to 255
+    uint8_t hops;       // compression pointers followed - limited so loops cannot hang us
+} dns_name_iter_t;
+
+typedef struct dns_rr_view {
+    uint16_t name;      // offset of the owner name
+    uint16_t type;
+    uint16_t class;
+    uint32_t ttl;
+    uint16_t ttl_offset;// offset of the TTL field - lets it be patched in place
+    uint16_t rdlength;
+    uint16_t rdata;     // offset of the RDATA
+} dns_rr_view_t;
+
+typedef struct dns_view {
+    const uint8_t* dgram;
+    uint16_t length;
+    dns_header_t header;
+    uint16_t question;      // offset of the question section (the first question)
+    uint16_t question_end;  // offset right after the first question
+    uint16_t qtype;         // decoded type and class of the first question
+    uint16_t qclass;
+    uint16_t answers;       // offset of the answer section
+    uint16_t authority;     // offset of the authority section
+    uint16_t additional;    // offset of the additional section
+    uint16_t end;           // offset right after the last record
+    uint16_t opt;           // offset of the (first) OPT record - 0 if the message has no EDNS
+    uint16_t edns_payload;  // largest UDP message the sender takes, as it advertised in the OPT record
+    uint8_t edns_version;
+} dns_view_t;
+
+// EDNS (RFC 6891): an OPT record in the additional section tells how large a UDP reply the sender takes,
+// and the reply carries one back. Below 512 the size means 512.
+#define DNS_OPT_SIZE 11         // an OPT record without options
+#define EDNS_MIN_PAYLOAD 512
+#define EDNS_BADVERS 16         // extended RCODE - the upper 8 bits go in the OPT record
+
+int dns_view_parse(dns_view_t* view, const char* dgram, int length);
+int dns_view_read_rr(const dns_view_t* view, uint16_t* offset, dns_rr_view_t* rr);
+int dns_view_read_name(const dns_view_t* view, uint16_t offset, char* destination, int size);
+uint32_t dns_question_hash(const dns_view_t* view);
+int dns_skip_name(const uint8_t* dgram, uint16_t length, uint16_t offset);
+void dns_name_iter_init(dns_name_iter_t* iter, const dns_view_t* view, uint16_t offset);
+int dns_name_iter_next(dns_name_iter_t* iter, const uint8_t** label, uint8_t* label_length);
+
 char* read_dns_name(const char* dgram_start, const char* name_start, char* destination);
 int domain_plain_to_label(const char* name, char *label_buff);
+char* write_dns_name(char* position, const char* name, dns_compression_t* compression);
 
-dns_transaction_t* read_dns_transaction(const char* dgram, int length);
+// The transactions are allocated from the arena given (or from a private one when it is NULL).
+// Freeing a transaction resets its arena, releasing every other transaction allocated from it as well.
+dns_transaction_t* read_dns_transaction(const char* dgram, int length, arena_t* arena);
 void print_dns_transaction(dns_transaction_t* tra);
 void free_dns_transaction(dns_transaction_t* tra);
-dns_transaction_t* create_dns_reply(dns_transaction_t* query);
-void add_answer_to_dns_reply(dns_transaction_t* reply, dns_answer_t new_answer);
+dns_transaction_t* create_dns_reply(dns_transaction_t* query, arena_t* arena);
+dns_transaction_t* create_dns_reply_from_view(const dns_view_t* query, arena_t* arena);
+void add_answer_to_dns_reply(dns_transaction_t* reply, const dns_answer_t* new_answer);
 int write_dns_transaction(char* dgram, int buffer_length, dns_transaction_t* tra);
+int write_question_reply(const dns_view_t* query, uint16_t rcode, char* out, int out_size);
+int dns_append_opt(char* message, int length, int size, uint16_t payload, uint16_t extended_rcode);
 
-//char* read_dns_answer(const char* dgram_start, const char* answer_start, dns_answer_t* answer);
-//char* write_dns_answer(char* position, dns_answer_t* answer);
-void print_dns_answer(dns_answer_t* answer);
+//char* read_dns_answer(const char* dgram_start, const char* answer_start, dns_answer_t* answer, arena_t* arena);
+//char* write_dns_answer(char* position, dns_answer_t* answer, dns_compression_t* compression);
+void print_dns_answer(const dns_answer_t* answer);
 
 //char* read_dns_question(const char* dgram_start, const char* question_start, dns_question_t* question);
-//char* write_dns_question(char* position, dns_question_t* question);
+//char* write_dns_question(char* position, dns_question_t* question, dns_compression_t* compression);
 void print_dns_question(dns_question_t* question);
 
 #endif // _DNS_PROTOCOL_H_
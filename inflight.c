@@ -0,0 +1,266 @@
+// ===================================================================================  //
+//    This program is free software: you can redistribute it and/or modify              //
+//    it under the terms of the GNU General Public License as published by              //
+//    the Free Software Foundation, either version 3 of the License, or                 //
+//    (at your option) any later version.                                               //
+//                                                                                      //
+//    This program is distributed in the hope that it will be useful,                   //
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of                    //
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                     //
+//    GNU General Public License for more details.                                      //
+//                                                                                      //
+//    You should have received a copy of the GNU General Public License                 //
+//    along with this program.  If not, see <https://www.gnu.org/licenses/>.            //
+//                                                                                      //
+//    Copyright: Luiz Gustavo Pfitscher e Feldmann, 2020                                //
+// ===================================================================================  //
+
+#include "inflight.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static uint32_t next_random(inflight_table_t* table)
+{
+    // xorshift64* - plenty to keep the upstream IDs unpredictable to an off-path observer
+    table->rng ^= table->rng >> 12;
+    table->rng ^= table->rng << 25;
+    table->rng ^= table->rng >> 27;
+    return (uint32_t)((table->rng * 2685821657736338717ull) >> 32);
+}
+
+inflight_table_t* inflight_create(uint32_t timeout_ms, unsigned int socket_count, uint64_t seed)
+{
+    inflight_table_t* table = (inflight_table_t*)malloc(sizeof(inflight_table_t));
+    if (table == NULL)
+        return NULL;
+
+    table->sockets = (inflight_socket_t*)calloc(socket_count ? socket_count : 1, sizeof(inflight_socket_t));
+    if (table->sockets == NULL)
+    {
+        free(table);
+        return NULL;
+    }
+
+    table->free_count = INFLIGHT_CAPACITY;
+    table->oldest = INFLIGHT_NIL;
+    table->newest = INFLIGHT_NIL;
+    table->timeout_ms = timeout_ms;
+    table->socket_count = socket_count;
+    table->next_socket = 0;
+    table->rng = seed ? seed : 0x9E3779B97F4A7C15ull; // xorshift must not start at zero
+    table->stats = (inflight_stats_t){ 0 };
+
+    // the slots are handed out from the top of the stack - the IDs are what must be unpredictable
+    for (uint32_t i = 0; i < INFLIGHT_CAPACITY; i++)
+    {
+        table->entries[i].in_use = 0;
+        table->free_slots[i] = (uint16_t)(INFLIGHT_CAPACITY - 1 - i);
+    }
+
+    return table;
+}
+
+void inflight_free(inflight_table_t* table)
+{
+    if (table)
+        free(table->sockets);
+    free(table);
+}
+
+// the socket with the fewest queries in flight among count from first
+unsigned int inflight_pick_socket(inflight_table_t* table, unsigned int first, unsigned int count)
+{
+    unsigned int start = table->next_socket++;
+    unsigned int best = first + start % count;
+
+    for (unsigned int i = 1; i < count; i++)
+    {
+        unsigned int socket = first + (start + i) % count;
+        if (table->sockets[socket].in_flight < table->sockets[best].in_flight)
+            best = socket;
+    }
+
+    return best;
+}
+
+// takes a random ID free on the socket for the slot - the first free one from a random place in the bitmap
+static int take_id(inflight_table_t* table, uint8_t socket, uint16_t slot)
+{
+    inflight_socket_t* ids = &table->sockets[socket];
+    if (ids->in_flight == INFLIGHT_IDS)
+        return -1;
+
+    uint32_t start = next_random(table) % INFLIGHT_IDS;
+    uint32_t word = start / 64;
+    uint64_t free_bits = ~ids->used[word] & (~0ull << (start % 64));
+
+    while (free_bits == 0)
+    {
+        word = (word + 1) % (INFLIGHT_IDS / 64);
+        free_bits = ~ids->used[word];
+    }
+
+    uint16_t id = (uint16_t)(word * 64 + __builtin_ctzll(free_bits));
+    ids->used[word] |= 1ull << (id % 64);
+    ids->slots[id] = slot;
+    ids->in_flight++;
+
+    return id;
+}
+
+static void give_back_id(inflight_table_t* table, uint8_t socket, uint16_t id)
+{
+    inflight_socket_t* ids = &table->sockets[socket];
+
+    ids->used[id / 64] &= ~(1ull << (id % 64));
+    ids->in_flight--;
+}
+
+// detaches the slot from the deadline list and returns it and its IDs to the free pools
+static void release_slot(inflight_table_t* table, int32_t slot)
+{
+    inflight_entry_t* entry = &table->entries[slot];
+
+    if (entry->older != INFLIGHT_NIL)
+        table->entries[entry->older].newer = entry->newer;
+    else
+        table->oldest = entry->newer;
+
+    if (entry->newer != INFLIGHT_NIL)
+        table->entries[entry->newer].older = entry->older;
+    else
+        table->newest = entry->older;
+
+    give_back_id(table, entry->socket, entry->upstream_id);
+    if (entry->hedge_upstream != INFLIGHT_NO_UPSTREAM)
+        give_back_id(table, entry->hedge_socket, entry->hedge_id);
+
+    entry->in_use = 0;
+    table->free_slots[table->free_count++] = (uint16_t)slot;
+    table->stats.occupancy--;
+}
+
+// returns the slot of the query relayed through the socket - its entry has the upstream ID to send it with - or -1 if there is no room
+int inflight_insert(inflight_table_t* table, const struct sockaddr_in* client, uint32_t connection, uint16_t original_id, uint32_t question, uint8_t upstream, uint8_t socket, uint64_t now_ns)
+{
+    if (table->free_count == 0 || socket >= table->socket_count)
+    {
+        table->stats.rejected++;
+        return -1;
+    }
+
+    int32_t slot = table->free_slots[table->free_count - 1];
+    int id = take_id(table, socket, (uint16_t)slot);
+    if (id < 0)
+    {
+        table->stats.rejected++;
+        return -1;
+    }
+
+    table->free_count--;
+    table->entries[slot] = (inflight_entry_t){
+        .client = *client,
+        .deadline = now_ns / 1000000 + table->timeout_ms,
+        .relayed_ns = now_ns,
+        .older = table->newest,
+        .newer = INFLIGHT_NIL,
+        .connection = connection,
+        .question = question,
+        .original_id = original_id,
+        .upstream_id = (uint16_t)id,
+        .socket = socket,
+        .upstream = upstream,
+        .hedge_upstream = INFLIGHT_NO_UPSTREAM,
+        .in_use = 1,
+    };
+
+    if (table->newest != INFLIGHT_NIL)
+        table->entries[table->newest].newer = slot;
+    else
+        table->oldest = slot;
+
+    table->newest = slot;
+
+    table->stats.relayed++;
+    table->stats.occupancy++;
+    if (table->stats.occupancy > table->stats.peak_occupancy)
+        table->stats.peak_occupancy = table->stats.occupancy;
+
+    return slot;
+}
+
+// gives the query in the slot a second ID on the socket of its hedge - returns it, or -1 if the socket has none free
+int inflight_hedge(inflight_table_t* table, uint16_t slot, uint8_t upstream, uint8_t socket)
+{
+    inflight_entry_t* entry = &table->entries[slot];
+    if (!entry->in_use || entry->hedge_upstream != INFLIGHT_NO_UPSTREAM || socket >= table->socket_count)
+        return -1;
+
+    int id = take_id(table, socket, slot);
+    if (id < 0)
+        return -1;
+
+    entry->hedge_id = (uint16_t)id;
+    entry->hedge_socket = socket;
+    entry->hedge_upstream = upstream;
+
+    return id;
+}
+
+// takes the entry of an answer out of the table - returns the slot it had, or -1 if the socket has no query in flight with the ID and question
+int inflight_remove(inflight_table_t* table, uint8_t socket, uint16_t upstream_id, uint32_t question, inflight_entry_t* removed)
+{
+    if (socket >= table->socket_count || !(table->sockets[socket].used[upstream_id / 64] & (1ull << (upstream_id % 64))))
+    {
+        table->stats.unmatched++;
+        return -1;
+    }
+
+    uint16_t slot = table->sockets[socket].slots[upstream_id];
+    inflight_entry_t* entry = &table->entries[slot];
+
+    if (entry->question != question)
+    {
+        table->stats.mismatched++;
+        return -1;
+    }
+
+    if (removed)
+        *removed = *entry;
+
+    release_slot(table, slot);
+    table->stats.answered++;
+
+    return slot;
+}
+
+// drops every entry whose deadline has passed, telling on_expired (if any) about each - returns how many were dropped
+unsigned int inflight_expire(inflight_table_t* table, uint64_t now_ms, inflight_expired_fn on_expired, void* context)
+{
+    unsigned int expired = 0;
+
+    while (table->oldest != INFLIGHT_NIL && table->entries[table->oldest].deadline <= now_ms)
+    {
+        if (on_expired)
+            on_expired(&table->entries[table->oldest], context);
+
+        release_slot(table, table->oldest);
+        expired++;
+    }
+
+    table->stats.expired += expired;
+    return expired;
+}
+
+void print_inflight_stats(const inflight_stats_t* stats)
+{
+    printf("\nRelayed: %llu\nAnswered: %llu\nTimed out: %llu\nRejected (table full): %llu\nUnmatched answers: %llu\nAnswers to another question: %llu\nIn flight: %u (peak %u)",
+           (unsigned long long)stats->relayed,
+           (unsigned long long)stats->answered,
+           (unsigned long long)stats->expired,
+           (unsigned long long)stats->rejected,
+           (unsigned long long)stats->unmatched,
+           (unsigned long long)stats->mismatched,
+           stats->occupancy,
+           stats->peak_occupancy);
+}
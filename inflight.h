@@ -0,0 +1,97 @@
+// ===================================================================================  //
+//    This program is free software: you can redistribute it and/or modify              //
+//    it under the terms of the GNU General Public License as published by              //
+//    the Free Software Foundation, either version 3 of the License, or                 //
+//    (at your option) any later version.                                               //
+//                                                                                      //
+//    This program is distributed in the hope that it will be useful,                   //
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of                    //
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                     //
+//    GNU General Public License for more details.                                      //
+//                                                                                      //
+//    You should have received a copy of the GNU General Public License                 //
+//    along with this program.  If not, see <https://www.gnu.org/licenses/>.            //
+//                                                                                      //
+//    Copyright: Luiz Gustavo Pfitscher e Feldmann, 2020                                //
+// ===================================================================================  //
+
+#ifndef _INFLIGHT_H_
+#define _INFLIGHT_H_
+
+#include "socket_compat.h"
+#include <stdint.h>
+
+// Table of the queries relayed to the upstream server and still waiting for an answer.
+// The queries go out through a pool of sockets, each connected from its own ephemeral port and with its own
+// 16-bit ID space: a bitmap of the IDs in flight, from which a new query takes a random free one, and the
+// slot of the entry using each ID - matching an answer is two array accesses, and an answer is only taken
+// from the socket, with the ID and for the question of the query. Since every entry gets the same timeout,
+// the order of insertion is also the order of the deadlines and expiring is a walk from the oldest.
+
+#define INFLIGHT_CAPACITY 65536 // queries in flight at once, over all the sockets
+#define INFLIGHT_IDS 65536      // per socket - one for each possible 16-bit DNS ID
+#define INFLIGHT_NIL (-1)
+#define INFLIGHT_NO_UPSTREAM 0xFF
+
+typedef struct inflight_entry {
+    struct sockaddr_in client;  // where the answer must be sent back to
+    uint64_t deadline;          // monotonic ms after which the upstream is assumed to have lost the query
+    uint64_t relayed_ns;        // monotonic ns the query was relayed at - for the upstream round trip
+    int32_t older;              // neighbours in the deadline ordered list
+    int32_t newer;
+    uint32_t hedge_delay_us;    // how long after relaying it the query was hedged
+    uint32_t connection;        // TCP connection the query came on (tcp_connection_id) - 0 if it came over UDP
+    uint32_t question;          // hash of the question (dns_question_hash) - the answer must repeat it
+    uint16_t original_id;       // ID chosen by the client - restored on the way back
+    uint16_t upstream_id;       // ID it was relayed with, on its socket
+    uint16_t hedge_id;          // and its hedge on the hedge socket
+    uint8_t socket;             // where the query was sent - answers from anywhere else are not taken
+    uint8_t hedge_socket;
+    uint8_t upstream;           // the upstream of the socket
+    uint8_t hedge_upstream;     // where its hedge was sent - INFLIGHT_NO_UPSTREAM if not hedged
+    uint8_t in_use;
+} inflight_entry_t;
+
+typedef struct inflight_socket {
+    uint64_t used[INFLIGHT_IDS / 64];   // the IDs in flight
+    uint16_t slots[INFLIGHT_IDS];       // entry of each ID in flight
+    uint32_t in_flight;
+} inflight_socket_t;
+
+typedef struct inflight_stats {
+    uint64_t relayed;           // entries created
+    uint64_t answered;          // entries matched by an upstream answer
+    uint64_t expired;           // entries that reached their deadline
+    uint64_t rejected;          // queries not relayed because the table was full
+    uint64_t unmatched;         // answers with an ID not in flight on their socket (late, duplicated or forged)
+    uint64_t mismatched;        // answers with an ID in flight but to another question (forged, or very late)
+    uint32_t occupancy;         // entries currently in use
+    uint32_t peak_occupancy;
+} inflight_stats_t;
+
+typedef struct inflight_table {
+    inflight_entry_t entries[INFLIGHT_CAPACITY];
+    uint16_t free_slots[INFLIGHT_CAPACITY];
+    uint32_t free_count;
+    int32_t oldest;
+    int32_t newest;
+    uint32_t timeout_ms;
+    inflight_socket_t* sockets;
+    uint32_t socket_count;
+    uint32_t next_socket;       // where the search for the least busy socket starts - round robin among the ties
+    uint64_t rng;
+    inflight_stats_t stats;
+} inflight_table_t;
+
+typedef void (*inflight_expired_fn)(const inflight_entry_t* entry, void* context);
+
+inflight_table_t* inflight_create(uint32_t timeout_ms, unsigned int socket_count, uint64_t seed);
+void inflight_free(inflight_table_t* table);
+unsigned int inflight_pick_socket(inflight_table_t* table, unsigned int first, unsigned int count);
+int inflight_insert(inflight_table_t* table, const struct sockaddr_in* client, uint32_t connection, uint16_t original_id, uint32_t question, uint8_t upstream, uint8_t socket, uint64_t now_ns);
+int inflight_hedge(inflight_table_t* table, uint16_t slot, uint8_t upstream, uint8_t socket);
+int inflight_remove(inflight_table_t* table, uint8_t socket, uint16_t upstream_id, uint32_t question, inflight_entry_t* removed);
+unsigned int inflight_expire(inflight_table_t* table, uint64_t now_ms, inflight_expired_fn on_expired, void* context);
+void print_inflight_stats(const inflight_stats_t* stats);
+
+#endif // _INFLIGHT_H_
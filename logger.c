@@ -0,0 +1,462 @@
+// ===================================================================================  //
+//    This program is free software: you can redistribute it and/or modify              //
+//    it under the terms of the GNU General Public License as published by              //
+//    the Free Software Foundation, either version 3 of the License, or                 //
+//    (at your option) any later version.                                               //
+//                                                                                      //
+//    This program is distributed in the hope that it will be useful,                   //
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of                    //
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                     //
+//    GNU General Public License for more details.                                      //
+//                                                                                      //
+//    You should have received a copy of the GNU General Public License                 //
+//    along with this program.  If not, see <https://www.gnu.org/licenses/>.            //
+//                                                                                      //
+//    Copyright: Luiz Gustavo Pfitscher e Feldmann, 2020                                //
+// ===================================================================================  //
+
+#ifndef _WIN32
+    #define _GNU_SOURCE
+#endif
+
+#include "logger.h"
+#include "clock_compat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#ifndef _WIN32
+    #include <pthread.h>
+#endif
+
+#define LOG_RING_SIZE 4096          // records - a power of two
+#define LOG_TEXT_SIZE 400           // bytes for the strings of one record
+#define LOG_LINE_SIZE 1024          // longest formatted message
+#define LOG_OUTPUT_SIZE 65536       // formatted messages are written out in blocks of up to this size
+#define LOG_IDLE_SLEEP_US 1000      // how long the logging thread sleeps when the ring is empty
+
+static const char* level_names[LOG_LEVEL_COUNT] = { "error", "warning", "info", "debug" };
+static const char* category_names[LOG_CATEGORY_COUNT] = { "server", "zone", "query", "relay" };
+
+// the per-packet messages are debug - off unless asked for
+uint8_t log_levels[LOG_CATEGORY_COUNT] = { LOG_LEVEL_INFO, LOG_LEVEL_INFO, LOG_LEVEL_INFO, LOG_LEVEL_INFO };
+
+// One slot of the ring (a bounded multi-producer queue after Dmitry Vyukov): the sequence tells
+// whose turn it is - equal to the position when the slot is free for the producer taking that position,
+// and one past it once the record is complete and the consumer may read it.
+typedef struct log_record {
+    _Atomic size_t sequence;
+    uint64_t time_ns;
+    const char* format;
+    uint8_t level;
+    uint8_t category;
+    uint8_t arg_count;
+    uint8_t types[LOG_MAX_ARGS];
+    uint64_t values[LOG_MAX_ARGS];  // the integers, the doubles bit for bit, the addresses - and for the strings their offset in text
+    char text[LOG_TEXT_SIZE];
+} log_record_t;
+
+static log_record_t* ring = NULL;  // NULL while the logging thread is not running - the messages are written right away
+static _Atomic size_t enqueue_position;
+static size_t dequeue_position;     // only moved by the consumer
+static uint64_t origin_ns;          // the timestamps are relative to the start of the logging
+static _Atomic uint64_t written;
+static _Atomic uint64_t dropped;
+static uint64_t reported_dropped;   // drops already reported in the output
+
+static void set_origin(void)
+{
+    if (origin_ns == 0)
+        origin_ns = monotonic_ns();
+}
+
+#ifndef _WIN32
+static pthread_t thread;
+static atomic_int stopping;
+#endif
+
+// FORMATTING
+// ================================================================
+// writes the arguments of the record as its format tells - returns the length written
+static int format_message(const log_record_t* record, char* out, int size)
+{
+    const char* f = record->format;
+    int length = 0;
+    int arg = 0;
+
+    while (*f && length < size - 1)
+    {
+        if (*f != '%' || f[1] == '%')
+        {
+            out[length++] = *f;
+            f += (*f == '%') ? 2 : 1;
+            continue;
+        }
+
+        // copy the flags, width and precision and skip the length modifiers - the type comes from the argument
+        char spec[16] = "%";
+        int spec_length = 1;
+        const char* start = f++;
+
+        while (*f && strchr("-+ #0123456789.", *f) && spec_length < (int)sizeof(spec) - 4)
+            spec[spec_length++] = *f++;
+
+        while (*f && strchr("hlLzjt", *f))
+            f++;
+
+        char conversion = *f;
+        if (conversion == '\0' || arg >= record->arg_count)
+        {
+            // nothing to print: keep the text of the conversion
+            int n = (int)(f - start) + (conversion != '\0');
+            n = (n < size - 1 - length) ? n : size - 1 - length;
+            memcpy(out + length, start, n);
+            length += n;
+            f += (conversion != '\0');
+            continue;
+        }
+
+        f++;
+
+        uint64_t value = record->values[arg];
+        uint8_t type = record->types[arg++];
+
+        // a number given to %s (or to a conversion we do not take) prints as a number
+        if (conversion == 's' || strchr("diuxXocfFeEgG", conversion) == NULL)
+            conversion = (type == LOG_ARG_DOUBLE) ? 'g' : 'd';
+
+        int integer = (strchr("diuxXoc", conversion) != NULL);
+        int n;
+
+        if (type == LOG_ARG_STRING || type == LOG_ARG_ADDRESS)
+        {
+            char address[16];
+            const char* text = address;
+
+            if (type == LOG_ARG_STRING)
+                text = record->text + value;
+            else
+                snprintf(address, sizeof(address), "%u.%u.%u.%u", (unsigned)(value >> 24) & 0xFF, (unsigned)(value >> 16) & 0xFF, (unsigned)(value >> 8) & 0xFF, (unsigned)value & 0xFF);
+
+            strcpy(spec + spec_length, "s");
+            n = snprintf(out + length, size - length, spec, text);
+        }
+        else if (type == LOG_ARG_DOUBLE)
+        {
+            double d;
+            memcpy(&d, &value, sizeof(d));
+
+            if (integer)
+            {
+                strcpy(spec + spec_length, "lld");
+                n = snprintf(out + length, size - length, spec, (long long)d);
+            }
+            else
+            {
+                spec[spec_length] = conversion;
+                spec[spec_length + 1] = '\0';
+                n = snprintf(out + length, size - length, spec, d);
+            }
+        }
+        else if (!integer)
+        {
+            spec[spec_length] = conversion;
+            spec[spec_length + 1] = '\0';
+            n = snprintf(out + length, size - length, spec, (type == LOG_ARG_SIGNED) ? (double)(int64_t)value : (double)value);
+        }
+        else if (conversion == 'c')
+        {
+            strcpy(spec + spec_length, "c");
+            n = snprintf(out + length, size - length, spec, (int)value);
+        }
+        else
+        {
+            // signed values print as signed whatever the conversion, the unsigned ones as asked
+            spec[spec_length++] = 'l';
+            spec[spec_length++] = 'l';
+            spec[spec_length++] = (type == LOG_ARG_SIGNED && (conversion == 'u' || conversion == 'd' || conversion == 'i')) ? 'd' :
+                                  (conversion == 'd' || conversion == 'i') ? 'u' : conversion;
+            spec[spec_length] = '\0';
+            n = (type == LOG_ARG_SIGNED) ? snprintf(out + length, size - length, spec, (long long)value)
+                                         : snprintf(out + length, size - length, spec, (unsigned long long)value);
+        }
+
+        if (n > 0)
+            length = (length + n < size - 1) ? length + n : size - 1;
+    }
+
+    out[length] = '\0';
+    return length;
+}
+
+// formats the whole line of the record, with the time, category and level in front
+static int format_record(const log_record_t* record, char* out, int size)
+{
+    int length = snprintf(out, size, "\n[%10.6f] %s: %s%s", (record->time_ns - origin_ns) / 1e9, category_names[record->category],
+                          (record->level <= LOG_LEVEL_WARNING) ? level_names[record->level] : "",
+                          (record->level <= LOG_LEVEL_WARNING) ? ": " : "");
+
+    if (length < 0 || length >= size)
+        return 0;
+
+    return length + format_message(record, out + length, size - length);
+}
+
+// fills the record from the arguments - the strings are copied, as they may be gone by the time it is formatted
+static void fill_record(log_record_t* record, enum log_level level, enum log_category category, int count, const log_arg_t* args)
+{
+    record->time_ns = monotonic_ns();
+    record->format = args[0].value.s;
+    record->level = (uint8_t)level;
+    record->category = (uint8_t)category;
+    record->arg_count = (uint8_t)((count - 1 < LOG_MAX_ARGS) ? count - 1 : LOG_MAX_ARGS);
+
+    size_t text_length = 0;
+
+    for (int a = 0; a < record->arg_count; a++)
+    {
+        const log_arg_t* arg = &args[a + 1];
+        record->types[a] = arg->type;
+
+        if (arg->type == LOG_ARG_STRING)
+        {
+            // what does not fit is cut - a string that does not fit at all points to the NUL ending the last one
+            const char* s = arg->value.s ? arg->value.s : "(null)";
+            size_t available = LOG_TEXT_SIZE - text_length;
+            size_t n = 0;
+
+            while (n + 1 < available && s[n] != '\0')
+                n++;
+
+            record->values[a] = available ? text_length : LOG_TEXT_SIZE - 1;
+            memcpy(record->text + text_length, s, n);
+            text_length += n;
+
+            if (available)
+                record->text[text_length++] = '\0';
+        }
+        else
+            memcpy(&record->values[a], &arg->value, sizeof(uint64_t));
+    }
+}
+
+static FILE* record_stream(const log_record_t* record)
+{
+    return (record->level <= LOG_LEVEL_WARNING) ? stderr : stdout;
+}
+
+// RING
+// ================================================================
+void log_write(enum log_level level, enum log_category category, int count, const log_arg_t* args)
+{
+    if (ring == NULL)
+    {
+        // no logging thread: written right away
+        log_record_t record;
+        set_origin();
+
+        char line[LOG_LINE_SIZE];
+
+        fill_record(&record, level, category, count, args);
+        fwrite(line, 1, format_record(&record, line, sizeof(line)), record_stream(&record));
+        atomic_fetch_add_explicit(&written, 1, memory_order_relaxed);
+        return;
+    }
+
+    size_t position = atomic_load_explicit(&enqueue_position, memory_order_relaxed);
+    log_record_t* record;
+
+    for (;;)
+    {
+        record = &ring[position & (LOG_RING_SIZE - 1)];
+        size_t sequence = atomic_load_explicit(&record->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+
+        if (difference == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&enqueue_position, &position, position + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (difference < 0)
+        {
+            // the ring is full - better lose the message than the packet
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            return;
+        }
+        else
+            position = atomic_load_explicit(&enqueue_position, memory_order_relaxed);
+    }
+
+    fill_record(record, level, category, count, args);
+    atomic_store_explicit(&record->sequence, position + 1, memory_order_release);
+}
+
+// formats every complete record in the ring and writes them out - only one thread may drain at a time
+void log_drain(void)
+{
+    if (ring == NULL)
+        return;
+
+    static char output[2][LOG_OUTPUT_SIZE];    // stdout and stderr
+    size_t used[2] = { 0, 0 };
+    uint64_t count = 0;
+
+    for (;;)
+    {
+        log_record_t* record = &ring[dequeue_position & (LOG_RING_SIZE - 1)];
+        if (atomic_load_explicit(&record->sequence, memory_order_acquire) != dequeue_position + 1)
+            break;
+
+        int stream = (record_stream(record) == stderr);
+        if (used[stream] + LOG_LINE_SIZE > LOG_OUTPUT_SIZE)
+        {
+            fwrite(output[stream], 1, used[stream], stream ? stderr : stdout);
+            used[stream] = 0;
+        }
+
+        used[stream] += format_record(record, output[stream] + used[stream], LOG_LINE_SIZE);
+        count++;
+
+        // hand the slot back to the producers a full lap later
+        atomic_store_explicit(&record->sequence, dequeue_position + LOG_RING_SIZE, memory_order_release);
+        dequeue_position++;
+    }
+
+    uint64_t lost = atomic_load_explicit(&dropped, memory_order_relaxed);
+    if (lost != reported_dropped)
+    {
+        if (used[1] + LOG_LINE_SIZE > LOG_OUTPUT_SIZE)
+        {
+            fwrite(output[1], 1, used[1], stderr);
+            used[1] = 0;
+        }
+
+        used[1] += snprintf(output[1] + used[1], LOG_OUTPUT_SIZE - used[1], "\n[logging] %llu message(s) dropped: the ring was full",
+                            (unsigned long long)(lost - reported_dropped));
+        reported_dropped = lost;
+    }
+
+    for (int stream = 0; stream < 2; stream++)
+    {
+        if (used[stream] > 0)
+        {
+            FILE* fp = stream ? stderr : stdout;
+            fwrite(output[stream], 1, used[stream], fp);
+            fflush(fp);
+        }
+    }
+
+    atomic_fetch_add_explicit(&written, count, memory_order_relaxed);
+}
+
+#ifndef _WIN32
+static void* log_thread(void* arg)
+{
+    (void)arg;
+
+    while (!atomic_load(&stopping))
+    {
+        size_t before = dequeue_position;
+        log_drain();
+
+        if (dequeue_position == before)
+            usleep(LOG_IDLE_SLEEP_US);
+    }
+
+    return NULL;
+}
+#endif
+
+// CONTROL
+// ================================================================
+// takes "level" for every category or "category=level" for one - returns -1 if the setting is not understood
+int log_configure(const char* setting)
+{
+    const char* equals = strchr(setting, '=');
+    const char* level = equals ? equals + 1 : setting;
+    int category = -1;
+
+    if (equals)
+    {
+        for (int c = 0; c < LOG_CATEGORY_COUNT && category < 0; c++)
+            if (strlen(category_names[c]) == (size_t)(equals - setting) && strncmp(setting, category_names[c], equals - setting) == 0)
+                category = c;
+
+        if (category < 0)
+            return -1;
+    }
+
+    for (int l = 0; l < LOG_LEVEL_COUNT; l++)
+    {
+        if (strcmp(level, level_names[l]) == 0)
+        {
+            for (int c = 0; c < LOG_CATEGORY_COUNT; c++)
+                if (category < 0 || c == category)
+                    log_levels[c] = (uint8_t)l;
+
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+// from here on the messages go through the ring - on windows log_drain must be called to write them
+int log_start(void)
+{
+    log_record_t* records = (log_record_t*)calloc(LOG_RING_SIZE, sizeof(log_record_t));
+    if (records == NULL)
+        return -1;
+
+    for (size_t i = 0; i < LOG_RING_SIZE; i++)
+        atomic_init(&records[i].sequence, i);
+
+    set_origin();
+    atomic_store(&enqueue_position, 0);
+    dequeue_position = 0;
+    ring = records;
+
+    #ifndef _WIN32
+    atomic_store(&stopping, 0);
+    if (pthread_create(&thread, NULL, log_thread, NULL) != 0)
+    {
+        ring = NULL;
+        free(records);
+        return -1;
+    }
+    #endif
+
+    return 0;
+}
+
+// writes what is left in the ring - the messages logged afterwards are written right away
+// (no other thread may be logging by now)
+void log_stop(void)
+{
+    if (ring == NULL)
+        return;
+
+    #ifndef _WIN32
+    atomic_store(&stopping, 1);
+    pthread_join(thread, NULL);
+    #endif
+
+    log_drain();
+
+    free(ring);
+    ring = NULL;
+}
+
+log_stats_t log_stats(void)
+{
+    return (log_stats_t){
+        .written = atomic_load(&written),
+        .dropped = atomic_load(&dropped),
+    };
+}
+
+void print_log_stats(const log_stats_t* stats)
+{
+    printf("\nWritten: %llu\nDropped: %llu", (unsigned long long)stats->written, (unsigned long long)stats->dropped);
+}
@@ -0,0 +1,132 @@
+// ===================================================================================  //
+//    This program is free software: you can redistribute it and/or modify              //
+//    it under the terms of the GNU General Public License as published by              //
+//    the Free Software Foundation, either version 3 of the License, or                 //
+//    (at your option) any later version.                                               //
+//                                                                                      //
+//    This program is distributed in the hope that it will be useful,                   //
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of                    //
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                     //
+//    GNU General Public License for more details.                                      //
+//                                                                                      //
+//    You should have received a copy of the GNU General Public License                 //
+//    along with this program.  If not, see <https://www.gnu.org/licenses/>.            //
+//                                                                                      //
+//    Copyright: Luiz Gustavo Pfitscher e Feldmann, 2020                                //
+// ===================================================================================  //
+
+#ifndef _LOGGER_H_
+#define _LOGGER_H_
+
+#include "socket_compat.h"
+#include <stdint.h>
+
+// Leveled logging that stays off the packet path: a message is a binary record - the address of its format
+// (a string literal), its arguments as raw values and a copy of its strings - pushed into a lock-free ring.
+// A background thread formats the records and writes them out (on windows the event loop does it between
+// packets). When the ring is full the message is dropped and counted instead of making the worker wait.
+// Each category has its own level, so the per-packet messages (debug) can be enabled for one part only.
+//
+//   LOG_DEBUG(LOG_QUERY, "Query from %s for %s type %u", &client_addr, qname, qtype);
+//
+// The format takes the printf conversions - without length modifiers, the arguments keep their own type -
+// and a struct sockaddr_in* argument prints as its dotted address. At most LOG_MAX_ARGS arguments.
+
+enum log_level {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARNING,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_COUNT,
+};
+
+enum log_category {
+    LOG_SERVER,     // sockets, workers, signals
+    LOG_ZONE,       // zone and blocklist loading
+    LOG_QUERY,      // queries from the clients and what answered them
+    LOG_RELAY,      // queries relayed upstream and their answers
+    LOG_CATEGORY_COUNT,
+};
+
+#define LOG_MAX_ARGS 8
+
+enum log_arg_type {
+    LOG_ARG_SIGNED,
+    LOG_ARG_UNSIGNED,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_STRING,
+    LOG_ARG_ADDRESS,
+};
+
+typedef struct log_arg {
+    uint8_t type;
+    union {
+        int64_t i;
+        uint64_t u;
+        double d;
+        const char* s;
+    } value;
+} log_arg_t;
+
+typedef struct log_stats {
+    uint64_t written;
+    uint64_t dropped;       // the ring was full
+} log_stats_t;
+
+extern uint8_t log_levels[LOG_CATEGORY_COUNT];
+
+static inline int log_enabled(enum log_level level, enum log_category category)
+{
+    return level <= log_levels[category];
+}
+
+static inline log_arg_t log_signed(long long value)                   { return (log_arg_t){ .type = LOG_ARG_SIGNED, .value.i = value }; }
+static inline log_arg_t log_unsigned(unsigned long long value)        { return (log_arg_t){ .type = LOG_ARG_UNSIGNED, .value.u = value }; }
+static inline log_arg_t log_double(double value)                      { return (log_arg_t){ .type = LOG_ARG_DOUBLE, .value.d = value }; }
+static inline log_arg_t log_string(const char* value)                 { return (log_arg_t){ .type = LOG_ARG_STRING, .value.s = value }; }
+static inline log_arg_t log_address(const struct sockaddr_in* value)  { return (log_arg_t){ .type = LOG_ARG_ADDRESS, .value.u = ntohl(value->sin_addr.s_addr) }; }
+
+#define LOG_ARG(x) _Generic((x),                                            \
+    char*: log_string, const char*: log_string,                             \
+    float: log_double, double: log_double,                                  \
+    unsigned char: log_unsigned, unsigned short: log_unsigned,              \
+    unsigned int: log_unsigned, unsigned long: log_unsigned,                \
+    unsigned long long: log_unsigned,                                       \
+    struct sockaddr_in*: log_address, const struct sockaddr_in*: log_address, \
+    default: log_signed)(x)
+
+// the format and the arguments become an array of log_arg_t, the format first
+#define LOG_COUNT(...) LOG_COUNT_(__VA_ARGS__, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define LOG_COUNT_(_1, _2, _3, _4, _5, _6, _7, _8, _9, n, ...) n
+#define LOG_CONCAT(a, b) LOG_CONCAT_(a, b)
+#define LOG_CONCAT_(a, b) a##b
+#define LOG_MAP(...) LOG_CONCAT(LOG_MAP_, LOG_COUNT(__VA_ARGS__))(__VA_ARGS__)
+#define LOG_MAP_1(a) LOG_ARG(a)
+#define LOG_MAP_2(a, ...) LOG_ARG(a), LOG_MAP_1(__VA_ARGS__)
+#define LOG_MAP_3(a, ...) LOG_ARG(a), LOG_MAP_2(__VA_ARGS__)
+#define LOG_MAP_4(a, ...) LOG_ARG(a), LOG_MAP_3(__VA_ARGS__)
+#define LOG_MAP_5(a, ...) LOG_ARG(a), LOG_MAP_4(__VA_ARGS__)
+#define LOG_MAP_6(a, ...) LOG_ARG(a), LOG_MAP_5(__VA_ARGS__)
+#define LOG_MAP_7(a, ...) LOG_ARG(a), LOG_MAP_6(__VA_ARGS__)
+#define LOG_MAP_8(a, ...) LOG_ARG(a), LOG_MAP_7(__VA_ARGS__)
+#define LOG_MAP_9(a, ...) LOG_ARG(a), LOG_MAP_8(__VA_ARGS__)
+
+#define LOG(level, category, ...) do {                                                              \
+        if (log_enabled(level, category))                                                           \
+            log_write(level, category, LOG_COUNT(__VA_ARGS__), (const log_arg_t[]){ LOG_MAP(__VA_ARGS__) }); \
+    } while (0)
+
+#define LOG_ERROR(category, ...)    LOG(LOG_LEVEL_ERROR, category, __VA_ARGS__)
+#define LOG_WARNING(category, ...)  LOG(LOG_LEVEL_WARNING, category, __VA_ARGS__)
+#define LOG_INFO(category, ...)     LOG(LOG_LEVEL_INFO, category, __VA_ARGS__)
+#define LOG_DEBUG(category, ...)    LOG(LOG_LEVEL_DEBUG, category, __VA_ARGS__)
+
+int log_configure(const char* setting);
+int log_start(void);
+void log_drain(void);
+void log_stop(void);
+void log_write(enum log_level level, enum log_category category, int count, const log_arg_t* args);
+log_stats_t log_stats(void);
+void print_log_stats(const log_stats_t* stats);
+
+#endif // _LOGGER_H_
@@ -15,125 +15,627 @@
 //    Copyright: Luiz Gustavo Pfitscher e Feldmann, 2020                                //
 // ===================================================================================  //
 
+#ifndef _WIN32
+    #define _GNU_SOURCE // recvmmsg, sendmmsg
+#endif
+
 #include "dns_protocol.h"
-#include <winsock2.h>
+#include "socket_compat.h"
 #include <stdio.h>
-#include <conio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "zone_file.h"
-#include "llist.h" // simple linked list libray - get liblist at https://github.com/mellowcandle/liblist
+#include "zone_image.h"
+#include "inflight.h"
+#include "cache.h"
+#include "blocklist.h"
+#include "logger.h"
+#include "metrics.h"
+#include "upstream.h"
+#include "tcp_server.h"
+#include "rate_limit.h"
+#include "clock_compat.h"
+#include <stdatomic.h>
+
+#ifdef _WIN32
+    #include <conio.h>
+#else
+    #include <sys/epoll.h>
+    #include <sys/eventfd.h>
+    #include <sys/un.h>
+    #include <sys/stat.h>
+    #include <poll.h>
+    #include <signal.h>
+    #include <pthread.h>
+    #include <sched.h>
+#endif
+
+#define BUFFLEN 4096 // largest datagram - the EDNS payload is capped to it
+#define UDP_REPLY_LIMIT 512 // largest reply a plain (non EDNS) UDP client accepts
+#define DEFAULT_EDNS_PAYLOAD 1232 // largest EDNS reply by default - fits the IPv6 minimum MTU, so no fragments
+#define TCP_REPLY_LIMIT 65535 // largest message the length prefix of DNS over TCP allows
+#define DEFAULT_BATCH_SIZE 32
+#define MAX_BATCH_SIZE 1024
+#define MAX_DRAIN_ROUNDS 8 // batches read from one socket before giving the other one a turn
+#define MAX_WORKERS 256
+#define DEFAULT_RELAY_TIMEOUT_MS 3000
+#define DEFAULT_CACHE_MB 16
+#define DEFAULT_NEGATIVE_TTL 3600
+#define ZONE_FILE "config.txt"
+#define DNS_PORT 53
+#define DEFAULT_UPSTREAM "192.168.99.1"
+#define METRICS_BUFFER_SIZE 65536
+#define STATS_REQUEST_TIMEOUT_MS 1000
+#define DEFAULT_TCP_CONNECTIONS 256
+#define DEFAULT_TCP_IDLE_MS 10000
+#define TCP_BACKLOG 128
+#define MAX_EVENTS 256 // epoll events taken per wakeup
+#define DEFAULT_UPSTREAM_SOCKETS 4
+#define MAX_UPSTREAM_SOCKETS 8 // per upstream
+#define MAX_RELAY_SOCKETS (MAX_UPSTREAMS * MAX_UPSTREAM_SOCKETS)
+#define MAX_RATE_LIMIT 1000000
+#define DEFAULT_RATE_LIMIT_PREFIX 24
+#define DEFAULT_RATE_LIMIT_SLIP 2
+#define MAX_RATE_LIMIT_SLIP 100
+
+typedef struct server_options {
+    unsigned int batch_size;        // datagrams per recvmmsg/sendmmsg
+    unsigned int worker_count;      // 0 = one per cpu
+    unsigned int relay_timeout_ms;  // how long a relayed query waits for the upstream answer
+    unsigned int cache_mb;          // memory for the cache of relayed answers, split among the workers - 0 disables it
+    unsigned int negative_ttl;      // longest a cached NXDOMAIN or NODATA answer is served, in seconds - 0 does not cache them
+    const char* blocklist_file;     // names answered with the sinkhole instead of relayed - NULL for none
+    int sinkhole_nxdomain;          // the blocked names do not exist - otherwise they get the addresses below
+    uint8_t sinkhole_ipv4[4];
+    uint8_t sinkhole_ipv6[16];
+    const char* stats_address;      // where the metrics are served: [ip:]port or the path of a unix socket - NULL for nowhere
+    struct sockaddr_in upstreams[MAX_UPSTREAMS]; // where the queries the server cannot answer are relayed
+    unsigned int upstream_count;
+    unsigned int upstream_sockets;  // sockets relaying to each upstream, each from its own port and with its own IDs
+    int hedging;                    // a query slower than the p95 of its upstream is also sent to the next best one
+    unsigned int tcp_connections;   // open TCP connections, split among the workers - 0 disables TCP
+    unsigned int tcp_idle_ms;       // how long a TCP connection may go without a query
+    unsigned int edns_payload;      // largest UDP reply to a client advertising more with EDNS (and what we advertise)
+    unsigned int rate_limit;        // responses per second to each client prefix over UDP, per worker - 0 does not limit
+    unsigned int rate_limit_prefix; // bits of the client address the limit applies to
+    unsigned int rate_limit_slip;   // one in this many limited queries gets a truncated reply, the others are dropped
+    int daemonize;
+} server_options_t;
+
+server_options_t options = {
+    .batch_size = DEFAULT_BATCH_SIZE,
+    .worker_count = 1,
+    .relay_timeout_ms = DEFAULT_RELAY_TIMEOUT_MS,
+    .cache_mb = DEFAULT_CACHE_MB,
+    .upstream_sockets = DEFAULT_UPSTREAM_SOCKETS,
+    .negative_ttl = DEFAULT_NEGATIVE_TTL,
+    .tcp_connections = DEFAULT_TCP_CONNECTIONS,
+    .tcp_idle_ms = DEFAULT_TCP_IDLE_MS,
+    .edns_payload = DEFAULT_EDNS_PAYLOAD,
+    .rate_limit_prefix = DEFAULT_RATE_LIMIT_PREFIX,
+    .rate_limit_slip = DEFAULT_RATE_LIMIT_SLIP,
+    .daemonize = 0,
+};
+
+// The zone is shared read-only by all the workers and replaced as a whole: a reload builds the new one
+// on the side and publishes it with an atomic pointer swap, so a lookup sees either the old or the new zone
+dns_zone_t* _Atomic current_zone = NULL;
+dns_blocklist_t* _Atomic current_blocklist = NULL; // swapped and released along with the zone
+
+#ifndef _WIN32
+// The old zone is freed once no worker can still be using it (quiescent-state based reclamation):
+// a worker announces the epoch it saw every time it wakes up and goes offline (0) while waiting for events.
+// Once every worker is offline or past the epoch of the swap, nobody holds the old pointer.
+_Atomic uint64_t zone_epoch = 1;
+
+int shutdown_event = -1; // eventfd signaled by the main thread to stop every worker (and the other threads)
+#endif
+
+// DATAGRAM BATCHES
+// ================================================================
+// on linux datagrams are moved in batches with recvmmsg/sendmmsg - on windows they go one at a time
+typedef struct dgram_batch {
+    SOCKET sock;
+    #ifndef _WIN32
+    unsigned int capacity;
+    unsigned int count;
+    struct mmsghdr* msgs;
+    struct iovec* iovs;
+    struct sockaddr_in* addrs;
+    char* buffers;          // capacity * BUFFLEN bytes
+    #endif
+    metrics_shard_t* metrics; // where the sends are timed and the errors counted - NULL for nowhere
+} dgram_batch_t;
+
+
+int InitBatch(dgram_batch_t* batch, SOCKET sock, unsigned int capacity)
+{
+    *batch = (dgram_batch_t){ .sock = sock };
+
+    #ifndef _WIN32
+    batch->capacity = capacity;
+    batch->msgs = (struct mmsghdr*)calloc(capacity, sizeof(struct mmsghdr));
+    batch->iovs = (struct iovec*)calloc(capacity, sizeof(struct iovec));
+    batch->addrs = (struct sockaddr_in*)calloc(capacity, sizeof(struct sockaddr_in));
+    batch->buffers = (char*)malloc((size_t)capacity * BUFFLEN);
+
+    if (!batch->msgs || !batch->iovs || !batch->addrs || !batch->buffers)
+    {
+        fprintf(stderr, "\nFailed to allocate a batch of %u datagrams", capacity);
+        return SOCKET_ERROR;
+    }
+    #else
+    (void)capacity;
+    #endif
+
+    return 0;
+}
+
+void FreeBatch(dgram_batch_t* batch)
+{
+    #ifndef _WIN32
+    free(batch->msgs);
+    free(batch->iovs);
+    free(batch->addrs);
+    free(batch->buffers);
+    #endif
+
+    *batch = (dgram_batch_t){ .sock = INVALID_SOCKET };
+}
+
+int FlushBatch(dgram_batch_t* batch)
+{
+    #ifndef _WIN32
+    unsigned int sent = 0;
+
+    while (sent < batch->count)
+    {
+        uint64_t start = monotonic_ns();
+        int ret = sendmmsg(batch->sock, &batch->msgs[sent], batch->count - sent, 0);
+
+        if (batch->metrics)
+            metrics_record(batch->metrics, STAGE_SEND, monotonic_ns() - start);
+
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            LOG_ERROR(LOG_SERVER, "sendmmsg failed: %d %s - dropped %u datagram(s)", errno, strerror(errno), batch->count - sent);
+            if (batch->metrics)
+                metrics_add(batch->metrics, METRIC_SEND_ERRORS, batch->count - sent);
+            break;
+        }
+
+        sent += ret;
+    }
+
+    batch->count = 0;
+    #else
+    (void)batch;
+    #endif
+
+    return 0;
+}
+
+// sends the datagram to the destination (or the connected peer if dest is NULL)
+// on linux it is only copied to the batch and goes out on the next flush
+int QueueDatagram(dgram_batch_t* batch, const char* data, int length, const struct sockaddr_in* dest)
+{
+    #ifndef _WIN32
+    if (length < 0 || length > BUFFLEN)
+        return SOCKET_ERROR;
+
+    if (batch->count == batch->capacity)
+        FlushBatch(batch);
+
+    unsigned int i = batch->count++;
+    char* buffer = batch->buffers + (size_t)i * BUFFLEN;
+    memcpy(buffer, data, length);
+
+    batch->iovs[i] = (struct iovec){ .iov_base = buffer, .iov_len = length };
+    batch->msgs[i].msg_hdr = (struct msghdr){
+        .msg_iov = &batch->iovs[i],
+        .msg_iovlen = 1,
+    };
+
+    if (dest)
+    {
+        batch->addrs[i] = *dest;
+        batch->msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+        batch->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+
+    return 0;
+    #else
+    uint64_t start = monotonic_ns();
+    int ret = dest ? sendto(batch->sock, data, length, 0, (SOCKADDR*)dest, sizeof(*dest)) : send(batch->sock, data, length, 0);
+
+    if (batch->metrics)
+    {
+        metrics_record(batch->metrics, STAGE_SEND, monotonic_ns() - start);
+        if (ret == SOCKET_ERROR)
+            metrics_add(batch->metrics, METRIC_SEND_ERRORS, 1);
+    }
 
-SOCKET local_name_server;
-SOCKET remote_name_server;
+    return ret;
+    #endif
+}
 
-dns_answer_t* dns_record_collection = NULL;
-unsigned int dns_record_count = 0;
+// WORKERS
+// ================================================================
+// each worker owns its sockets and relay state so the workers never share anything but the zone
+typedef struct worker {
+    unsigned int id;
+    SOCKET local_name_server;
+    SOCKET upstream_sockets[MAX_RELAY_SOCKETS]; // a pool connected to each upstream server - those of upstream u from u * options.upstream_sockets
+    unsigned int socket_count;
+    inflight_table_t* inflight;     // relayed queries waiting for the upstream answer
+    dns_cache_t* cache;             // answers relayed before - NULL if caching is off
+    arena_t* arena;                 // memory of the reply being built - reset after every packet
+    dgram_batch_t client_replies;   // answers going back to the clients through local_name_server
+    dgram_batch_t relayed_queries[MAX_RELAY_SOCKETS]; // queries delegated to the upstream servers through each socket
+    upstream_set_t upstreams;       // how fast and reliable each upstream has been for this worker
+    hedge_queue_t hedges;           // relayed queries to send again to a second upstream if still unanswered by then
+    rate_limiter_t* limiter;        // credit of the clients sending over UDP - NULL if they are not limited
+    tcp_server_t tcp;               // the TCP listener on port 53 and its connections
+    char* reply;                    // the reply being written - TCP_REPLY_LIMIT bytes
+    #ifndef _WIN32
+    dgram_batch_t received;         // datagrams read by recvmmsg
+    int epoll_fd;                   // the TCP connections are added as they are accepted
+    pthread_t thread;
+    _Atomic uint64_t epoch;         // zone epoch seen when it last woke up - 0 while waiting for events
+    #endif
+    metrics_shard_t metrics;        // written only by this worker, read by the stats endpoint
+} worker_t;
 
+// PACKET HANDLERS
+// ================================================================
+// sends the reply back the way the query came: queued for the batch of datagrams, or on the TCP connection if there is one
+int SendReply(worker_t* worker, tcp_connection_t* connection, const struct sockaddr_in* client, const char* reply, int length)
+{
+    if (connection == NULL)
+        return QueueDatagram(&worker->client_replies, reply, length, client);
 
-typedef struct delegate_request {
-    uint16_t id;
-    struct sockaddr_in query_source;
-} delegate_request_t;
+    return tcp_queue_reply(&worker->tcp, connection, reply, length, monotonic_ms()) == 0 ? 0 : SOCKET_ERROR;
+}
 
-llist delegate_requests_list;
+// echoes EDNS to a client that used it - the reply was written leaving room for the OPT record
+static int AddEdns(const dns_view_t* query, char* reply, int length)
+{
+    return query->opt ? dns_append_opt(reply, length, length + DNS_OPT_SIZE, (uint16_t)options.edns_payload, 0) : length;
+}
 
-void ReceivedQuery(const char* dgram, int length, struct sockaddr_in query_addr)
+// handles a query received as a datagram, or on the TCP connection if there is one
+void ReceivedQuery(worker_t* worker, const char* dgram, int length, struct sockaddr_in query_addr, tcp_connection_t* connection)
 {
-    // log the query
-    printf("\n\n\nLocal nameserver got query from %s: ", inet_ntoa(query_addr.sin_addr));
+    // map the request in place - nothing is copied until we know what to do with it
+    dns_view_t query;
+    uint64_t received = monotonic_ns();
+
+    metrics_add(&worker->metrics, METRIC_QUERIES, 1);
+
+    // a client over its rate costs no more than this lookup - a TCP client cannot be spoofed, so it is not limited
+    rate_limit_action_t limit = RATE_LIMIT_PASS;
+    if (worker->limiter && connection == NULL)
+    {
+        limit = rate_limit_check(worker->limiter, &query_addr, received / 1000000);
+        if (limit == RATE_LIMIT_DROP)
+        {
+            metrics_add(&worker->metrics, METRIC_RATE_LIMIT_DROPPED, 1);
+            LOG_DEBUG(LOG_QUERY, "Dropped a query from %s: over the rate limit", &query_addr);
+            return;
+        }
+    }
+
+    if (dns_view_parse(&query, dgram, length) != 0)
+    {
+        metrics_add(&worker->metrics, METRIC_MALFORMED_QUERIES, 1);
+        LOG_DEBUG(LOG_QUERY, "Malformed query from %s", &query_addr);
+        return;
+    }
+
+    uint64_t parsed = monotonic_ns();
+    metrics_record(&worker->metrics, STAGE_PARSE, parsed - received);
+
+    // the queries that slip get nothing but the question back, truncated - a real client asks again over TCP
+    if (limit == RATE_LIMIT_SLIP)
+    {
+        metrics_add(&worker->metrics, METRIC_RATE_LIMIT_SLIPPED, 1);
+        LOG_DEBUG(LOG_QUERY, "Truncated the reply to %s: over the rate limit", &query_addr);
+
+        int len = write_question_reply(&query, RC_NOERROR, worker->reply, UDP_REPLY_LIMIT);
+        if (len > 0)
+        {
+            worker->reply[2] |= FLAG_TC >> 8;
+            if (SendReply(worker, connection, &query_addr, worker->reply, len) == SOCKET_ERROR)
+                LOG_ERROR(LOG_SERVER, "Error trying to send reply: %d", WSAGetLastError());
+        }
+
+        return;
+    }
+
+    // the name is only decoded when the query is logged
+    if (log_enabled(LOG_LEVEL_DEBUG, LOG_QUERY))
+    {
+        char qname[QNAME_SIZE + 1];
+        if (dns_view_read_name(&query, query.question, qname, sizeof(qname)) < 0)
+            qname[0] = '\0';
+
+        LOG_DEBUG(LOG_QUERY, "Query from %s%s: %s type %u", &query_addr, connection ? " over TCP" : "", qname, query.qtype);
+    }
+
+    // the same zone must serve the whole query even if a reload swaps it meanwhile
+    const dns_zone_t* zone = atomic_load(&current_zone);
+    const dns_blocklist_t* blocklist = atomic_load(&current_blocklist);
+
+    // a TCP client takes the whole reply - over UDP the RRsets that do not fit the size it advertised are truncated
+    char* out_buff = worker->reply;
+    int reply_limit = connection ? TCP_REPLY_LIMIT : UDP_REPLY_LIMIT;
+
+    if (query.opt)
+    {
+        if (!connection)
+            reply_limit = min(max(query.edns_payload, EDNS_MIN_PAYLOAD), (int)options.edns_payload);
+        reply_limit -= DNS_OPT_SIZE;
+
+        // only version 0 exists - the client is told so it can fall back (RFC 6891 6.1.3)
+        if (query.edns_version > 0)
+        {
+            int len = write_question_reply(&query, RC_NOERROR, out_buff, reply_limit);
+            len = (len > 0) ? dns_append_opt(out_buff, len, len + DNS_OPT_SIZE, (uint16_t)options.edns_payload, EDNS_BADVERS) : len;
+            LOG_DEBUG(LOG_QUERY, "EDNS version %u: answered BADVERS", query.edns_version);
+
+            if (len > 0 && SendReply(worker, connection, &query_addr, out_buff, len) == SOCKET_ERROR)
+                LOG_ERROR(LOG_SERVER, "Error trying to send reply: %d", WSAGetLastError());
+
+            return;
+        }
+    }
+
+    // spoofed names are answered straight from the answers serialized when the zone was loaded
+    int len = write_precompiled_reply(&query, zone, out_buff, reply_limit);
+
+    if (len > 0)
+    {
+        metrics_record(&worker->metrics, STAGE_LOOKUP, monotonic_ns() - parsed);
+        metrics_add(&worker->metrics, METRIC_PRECOMPILED_ANSWERS, 1);
+        LOG_DEBUG(LOG_QUERY, "Match found: precompiled answer of %d bytes", len);
 
-    // read the request
-    dns_transaction_t* query = read_dns_transaction(dgram, length);
+        len = AddEdns(&query, out_buff, len);
+        if (SendReply(worker, connection, &query_addr, out_buff, len) == SOCKET_ERROR)
+            LOG_ERROR(LOG_SERVER, "Error trying to send reply: %d", WSAGetLastError());
 
-    if (!query)
         return;
-    //else
-    //    print_dns_transaction(query);
+    }
 
-    // look for a match in the records
-    dns_transaction_t* reply = build_dns_reply_from_query(query, dns_record_collection, dns_record_count);
+    // look for a match in the records (only for the queries the precompiled answers cannot serve)
+    dns_transaction_t* reply = (len < 0) ? build_dns_reply_from_view(&query, zone, worker->arena) : NULL;
 
     if (!reply)
     {
-        // no matches found
-        // relay query to remote nameserver
+        // the names of the blocklist go to the sinkhole instead of the upstream server
+        len = write_blocked_reply(&query, blocklist, out_buff, reply_limit);
+        if (len > 0)
+        {
+            metrics_record(&worker->metrics, STAGE_LOOKUP, monotonic_ns() - parsed);
+            metrics_add(&worker->metrics, METRIC_BLOCKED, 1);
+            LOG_DEBUG(LOG_QUERY, "Blocked: sinkhole answer of %d bytes", len);
 
-        delegate_request_t* entry = (delegate_request_t*)malloc(sizeof(delegate_request_t)); // keep track of what IP originated this query so we know who to send the reply we'll get later
-        *entry = (delegate_request_t){
-            .id = query->header.id,
-            .query_source = query_addr,
-            };
+            len = AddEdns(&query, out_buff, len);
+            if (SendReply(worker, connection, &query_addr, out_buff, len) == SOCKET_ERROR)
+                LOG_ERROR(LOG_SERVER, "Error trying to send reply: %d", WSAGetLastError());
+
+            return;
+        }
+
+        // answers relayed before are served locally while their TTL lasts
+        int negative = 0;
+        len = cache_lookup(worker->cache, &query, monotonic_ms(), out_buff, reply_limit, &negative);
+        if (len > 0)
+        {
+            metrics_record(&worker->metrics, STAGE_LOOKUP, monotonic_ns() - parsed);
+            metrics_add(&worker->metrics, negative ? METRIC_NEGATIVE_CACHE_HITS : METRIC_CACHE_HITS, 1);
+            LOG_DEBUG(LOG_QUERY, "Answered from the cache%s", negative ? " (negative answer)" : "");
+
+            len = AddEdns(&query, out_buff, len);
+            if (SendReply(worker, connection, &query_addr, out_buff, len) == SOCKET_ERROR)
+                LOG_ERROR(LOG_SERVER, "Error trying to send reply: %d", WSAGetLastError());
+
+            return;
+        }
+
+        // no matches found
+        // relay query to the best upstream under an ID of our own - keep track of who asked so we know where to send the reply we'll get later
+        uint64_t looked_up = monotonic_ns();
+        uint32_t connection_id = connection ? tcp_connection_id(&worker->tcp, connection) : 0;
+        int upstream = upstream_select(&worker->upstreams, -1, looked_up / 1000000);
+        unsigned int socket = inflight_pick_socket(worker->inflight, upstream * options.upstream_sockets, options.upstream_sockets);
+        int slot = inflight_insert(worker->inflight, &query_addr, connection_id, query.header.id, dns_question_hash(&query), (uint8_t)upstream, (uint8_t)socket, looked_up);
 
+        metrics_record(&worker->metrics, STAGE_LOOKUP, looked_up - parsed);
 
-        if (llist_push(delegate_requests_list, entry) == LLIST_SUCCESS)
+        if (slot < 0)
         {
-            if (send(remote_name_server, dgram, length, 0) != SOCKET_ERROR)
-                printf("\nNo matches found: relaying request to backup server...");
+            metrics_add(&worker->metrics, METRIC_RELAY_REJECTED, 1);
+            LOG_WARNING(LOG_RELAY, "Too many queries in flight: dropping request");
+        }
+        else
+        {
+            metrics_add(&worker->metrics, METRIC_RELAYED, 1);
+
+            // the connection stops being read while too many of its queries wait for the upstream
+            if (connection)
+                connection->pending++;
+
+            char relayed[BUFFLEN];
+            memcpy(relayed, dgram, length);
+            *((uint16_t*)relayed) = htons(worker->inflight->entries[slot].upstream_id);
+
+            // the upstream answer must fit our buffers as well as the client
+            if (query.opt)
+                *((uint16_t*)(relayed + query.opt + 3)) = htons((uint16_t)min(max(query.edns_payload, EDNS_MIN_PAYLOAD), (int)options.edns_payload));
+
+            if (QueueDatagram(&worker->relayed_queries[socket], relayed, length, NULL) != SOCKET_ERROR)
+                LOG_DEBUG(LOG_QUERY, "No matches found: relaying request to upstream %d through socket %u...", upstream, socket);
             else
-                fprintf(stderr, "\nError forwarding request: %d", WSAGetLastError());
+                LOG_ERROR(LOG_SERVER, "Error forwarding request: %d", WSAGetLastError());
+
+            worker->upstreams.upstreams[upstream].stats.sent++;
+
+            // sent again to the next best upstream if it takes longer than most answers of this one
+            uint32_t hedge_delay_us = worker->upstreams.upstreams[upstream].p95_us;
+            if (options.hedging && hedge_delay_us > 0 && hedge_delay_us < options.relay_timeout_ms * 1000u &&
+                hedge_push(&worker->hedges, looked_up + hedge_delay_us * 1000ull, looked_up, (uint16_t)slot, relayed, length) != 0)
+                metrics_add(&worker->metrics, METRIC_HEDGES_DROPPED, 1);
         }
     }
     else
     {
         // match was found :)
-        print_dns_transaction(reply);
+        uint64_t looked_up = monotonic_ns();
+        metrics_record(&worker->metrics, STAGE_LOOKUP, looked_up - parsed);
+        metrics_add(&worker->metrics, METRIC_ZONE_ANSWERS, 1);
+
+        LOG_DEBUG(LOG_QUERY, "Match found: %u answer(s), %u authority, %u additional",
+                  reply->header.ANCount, reply->header.NSCount, reply->header.ARCount);
+
+        len = write_dns_transaction(out_buff, reply_limit, reply);
+        metrics_record(&worker->metrics, STAGE_SERIALIZE, monotonic_ns() - looked_up);
+
+        len = AddEdns(&query, out_buff, len);
+        if (SendReply(worker, connection, &query_addr, out_buff, len) == SOCKET_ERROR)
+            LOG_ERROR(LOG_SERVER, "Error trying to send reply: %d", WSAGetLastError());
+    }
+
+    if (reply)
+        free_dns_transaction(reply);
+}
+
+// handles the queries the connection has received, reading more until its socket is drained - or until too many
+// of them wait for the upstream, in which case it goes on once their answers come
+void ServeTcpConnection(worker_t* worker, tcp_connection_t* connection)
+{
+    for (;;)
+    {
+        const char* query;
+        int length;
+
+        while (connection->pending < TCP_MAX_PIPELINED && (length = tcp_next_query(&worker->tcp, connection, &query)) > 0)
+            ReceivedQuery(worker, query, length, connection->peer, connection);
+
+        if (connection->pending >= TCP_MAX_PIPELINED || tcp_read(&worker->tcp, connection, monotonic_ms()) == 0)
+            break;
+    }
+}
 
-        char out_buff[512];
-        int len = write_dns_transaction(out_buff, 256, reply);
+// a relayed query that came over TCP got its answer or timed out - returns its connection, or NULL if it was closed since
+tcp_connection_t* FinishTcpRelay(worker_t* worker, uint32_t connection_id)
+{
+    tcp_connection_t* connection = tcp_find(&worker->tcp, connection_id);
 
-        //printf("\nbuffer length is %d", len);
+    if (connection)
+    {
+        connection->pending--;
 
-        if (sendto(local_name_server, out_buff, len, 0, (SOCKADDR*)&query_addr, sizeof(query_addr)) == SOCKET_ERROR)
-            fprintf(stderr, "\nError trying to send reply: %d", WSAGetLastError());
+        // picks up the queries left waiting - or closes the connection if the client is gone and this was the last one
+        if (connection->pending == TCP_MAX_PIPELINED - 1)
+            ServeTcpConnection(worker, connection);
+        tcp_schedule_flush(&worker->tcp, connection);
     }
 
-    free(reply);
-    free(query);
+    return connection;
 }
 
-void ReceivedAnswer(const char* dgram, int length)
+void ReceivedAnswer(worker_t* worker, unsigned int socket, const char* dgram, int length)
 {
-    printf("\n\n\nRemote nameserver provided answer:");
+    unsigned int upstream = socket / options.upstream_sockets;
 
     // get the reply from the server
-    dns_transaction_t* remote_reply = read_dns_transaction(dgram, length);
-    if (remote_reply == NULL)
+    dns_view_t remote_reply;
+    if (dns_view_parse(&remote_reply, dgram, length) != 0)
+    {
+        metrics_add(&worker->metrics, METRIC_MALFORMED_ANSWERS, 1);
+        LOG_WARNING(LOG_RELAY, "Malformed answer from the remote nameserver");
         return;
-    else
-        print_dns_transaction(remote_reply);
+    }
 
-    // find which IP Address must receive the reply based on it's ID
-    void find_func(llist_node node)
+    LOG_DEBUG(LOG_RELAY, "Remote nameserver provided answer: ID: %u RC: %u Answers: %u Authority: %u Additional: %u",
+              remote_reply.header.id, remote_reply.header.flags & RC_MASK,
+              remote_reply.header.ANCount, remote_reply.header.NSCount, remote_reply.header.ARCount);
+
+    // find which IP Address must receive the reply based on the ID we gave the query on this socket - and the question it asked
+    inflight_entry_t entry;
+    int slot = inflight_remove(worker->inflight, (uint8_t)socket, remote_reply.header.id, dns_question_hash(&remote_reply), &entry);
+    if (slot < 0)
     {
-        delegate_request_t* entry = (delegate_request_t*)node;
+        metrics_add(&worker->metrics, METRIC_UNMATCHED_ANSWERS, 1);
+        LOG_DEBUG(LOG_RELAY, "No query waiting for answer id %u on socket %u of upstream %u (late, duplicated, hedged or forged answer?)", remote_reply.header.id, socket, upstream);
+        return;
+    }
 
-        if (entry->id != remote_reply->header.id)
-            return;
+    hedge_cancel(&worker->hedges, (uint16_t)slot);
 
-        if (sendto(local_name_server, dgram, length, 0, (SOCKADDR*)&entry->query_source, sizeof(entry->query_source)) != SOCKET_ERROR)
-            printf("\nReply forwarded to %s", inet_ntoa(entry->query_source.sin_addr));
-        else
-            fprintf(stderr, "\nError trying to forward reply (id %u) back to IP %s : error code %d", remote_reply->header.id, inet_ntoa(entry->query_source.sin_addr),  WSAGetLastError());
+    uint64_t now = monotonic_ns();
+    uint64_t waited_us = (now - entry.relayed_ns) / 1000;
+    metrics_record(&worker->metrics, STAGE_UPSTREAM, now - entry.relayed_ns);
+    metrics_add(&worker->metrics, METRIC_UPSTREAM_ANSWERS, 1);
+
+    if (upstream == entry.upstream)
+        upstream_answered(&worker->upstreams, upstream, waited_us);
+    else
+    {
+        // the hedge came first: its upstream was quicker, the first one is at least this slow
+        upstream_answered(&worker->upstreams, upstream, waited_us > entry.hedge_delay_us ? waited_us - entry.hedge_delay_us : 0);
+        upstream_outlasted(&worker->upstreams, entry.upstream, waited_us);
+        worker->upstreams.upstreams[upstream].stats.hedge_wins++;
+        metrics_add(&worker->metrics, METRIC_HEDGE_WINS, 1);
+    }
+
+    // only answers to queries we actually relayed make it to the cache
+    if (cache_store(worker->cache, &remote_reply, now / 1000000) == 0)
+        LOG_DEBUG(LOG_RELAY, "Answer cached");
 
-        llist_delete_node(delegate_requests_list, node, 1, NULL);
+    // give the client back the ID it chose
+    char forwarded[BUFFLEN];
+    memcpy(forwarded, dgram, length);
+    *((uint16_t*)forwarded) = htons(entry.original_id);
+
+    tcp_connection_t* connection = NULL;
+    if (entry.connection && (connection = FinishTcpRelay(worker, entry.connection)) == NULL)
+    {
+        LOG_DEBUG(LOG_RELAY, "Reply for %s dropped: its TCP connection is closed", &entry.client);
+        return;
     }
-    llist_for_each(delegate_requests_list, find_func);
 
-    free_dns_transaction(remote_reply);
+    if (SendReply(worker, connection, &entry.client, forwarded, length) != SOCKET_ERROR)
+        LOG_DEBUG(LOG_RELAY, "Reply forwarded to %s", &entry.client);
+    else
+        LOG_ERROR(LOG_SERVER, "Error trying to forward reply (id %u) back to IP %s : error code %d", entry.original_id, &entry.client, WSAGetLastError());
 }
 
-int ConfigSocket(SOCKET* sock, u_long ip, int bConnect)
+int ConfigSocket(SOCKET* sock, u_long ip, u_short port, int bConnect, int bReusePort)
 {
-    static const char enableReuse = 1;
-    if (setsockopt(*sock, SOL_SOCKET, SO_REUSEADDR, &enableReuse, sizeof(enableReuse)) < 0)
+    if (set_socket_flag(*sock, SOL_SOCKET, SO_REUSEADDR, 1) < 0)
+    {
+        LOG_ERROR(LOG_SERVER, "setsockopt(SO_REUSEADD) failed");
+        return SOCKET_ERROR;
+    }
+
+    #ifdef SO_REUSEPORT
+    // lets every worker bind its own socket to port 53 - the kernel spreads the clients among them
+    if (bReusePort && set_socket_flag(*sock, SOL_SOCKET, SO_REUSEPORT, 1) < 0)
     {
-        fprintf(stderr, "\nsetsockopt(SO_REUSEADD) failed");
+        LOG_ERROR(LOG_SERVER, "setsockopt(SO_REUSEPORT) failed");
         return SOCKET_ERROR;
     }
+    #else
+    (void)bReusePort;
+    #endif
 
-    static u_long nonBlockingMode = 1;
-    if (ioctlsocket(*sock, FIONBIO, &nonBlockingMode) != NO_ERROR)
+    if (set_socket_nonblocking(*sock) != NO_ERROR)
     {
-        fprintf(stderr, "\nioctlsocket failed changing (non)blocking mode to %lu", nonBlockingMode);
+        LOG_ERROR(LOG_SERVER, "Failed changing socket to non-blocking mode");
         return SOCKET_ERROR;
     }
 
@@ -141,131 +643,1534 @@ int ConfigSocket(SOCKET* sock, u_long ip, int bConnect)
     {
         struct sockaddr_in addr;
         addr.sin_family = AF_INET;
-        addr.sin_port = htons(53); // dns port is 53
+        addr.sin_port = port;
         addr.sin_addr.s_addr = ip;
 
         if (bConnect)
         {
             if (connect(*sock, (SOCKADDR*)&addr, sizeof(addr)) == SOCKET_ERROR)
             {
-                fprintf(stderr, "\nconnect() failed: %d", WSAGetLastError());
+                LOG_ERROR(LOG_SERVER, "connect() failed: %d", WSAGetLastError());
                 return SOCKET_ERROR;
             }
             else
-                printf("\nconnect() is OK!");
+                LOG_DEBUG(LOG_SERVER, "connect() is OK!");
         }
         else
         {
             if (bind(*sock, (SOCKADDR*)&addr, sizeof(addr)) == SOCKET_ERROR)
             {
-                fprintf(stderr, "\nbind() failed: %d", WSAGetLastError());
+                LOG_ERROR(LOG_SERVER, "bind() failed: %d", WSAGetLastError());
                 return SOCKET_ERROR;
             }
             else
-                printf("\nbind() is OK!");
+                LOG_DEBUG(LOG_SERVER, "bind() is OK!");
         }
     }
 
     return 0;
 }
 
-int main(int argc, char** argv)
+
+int InitWorker(worker_t* worker, unsigned int id, int reuse_port)
 {
-    // create a list of
-    delegate_requests_list = llist_create(NULL, NULL, 0);
+    unsigned int batch_size = options.batch_size;
 
-    // read our records
-    dns_record_count = read_zone_file("config.txt", &dns_record_collection);
-    print_records_collection(dns_record_collection, dns_record_count);
+    *worker = (worker_t){
+        .id = id,
+        .local_name_server = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP),
+        .socket_count = options.upstream_count * options.upstream_sockets,
+        .inflight = inflight_create(options.relay_timeout_ms, options.upstream_count * options.upstream_sockets, monotonic_ns() ^ ((uint64_t)(uintptr_t)worker << 16)),
+        .arena = arena_create(ARENA_DEFAULT_BLOCK_SIZE),
+        .reply = (char*)malloc(TCP_REPLY_LIMIT),
+        .tcp.listener = INVALID_SOCKET,
+        #ifndef _WIN32
+        .epoll_fd = -1,
+        #endif
+    };
 
-    // init winsock
-    WSADATA wsaData;
+    for (unsigned int i = 0; i < MAX_RELAY_SOCKETS; i++)
+        worker->upstream_sockets[i] = INVALID_SOCKET;
 
-    if( WSAStartup(MAKEWORD(2,2), &wsaData) != 0)
+    if (worker->arena == NULL || worker->reply == NULL)
     {
-        fprintf(stderr, "\nWSAStartup failed: %d\n", WSAGetLastError());
-        goto bail;
+        LOG_ERROR(LOG_SERVER, "Failed to allocate the arena of worker %u", id);
+        return SOCKET_ERROR;
+    }
+
+    if (worker->inflight == NULL)
+    {
+        LOG_ERROR(LOG_SERVER, "Failed to allocate the relay table of worker %u", id);
+        return SOCKET_ERROR;
+    }
+
+    if (options.cache_mb > 0)
+    {
+        worker->cache = cache_create((size_t)options.cache_mb * 1024 * 1024 / options.worker_count, options.negative_ttl);
+        if (worker->cache == NULL)
+        {
+            LOG_ERROR(LOG_SERVER, "Failed to allocate the cache of worker %u", id);
+            return SOCKET_ERROR;
+        }
+    }
+
+    if (options.rate_limit > 0)
+    {
+        worker->limiter = rate_limit_create(options.rate_limit, options.rate_limit_prefix, options.rate_limit_slip, monotonic_ns() ^ (uint64_t)(uintptr_t)worker);
+        if (worker->limiter == NULL)
+        {
+            LOG_ERROR(LOG_SERVER, "Failed to allocate the rate limiter of worker %u", id);
+            return SOCKET_ERROR;
+        }
     }
-    else
-        printf("\nWinsock DLL is %s.\n", wsaData.szSystemStatus);
 
-    // create our sockets
-    local_name_server = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-    remote_name_server = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (options.hedging && hedge_queue_init(&worker->hedges) != 0)
+    {
+        LOG_ERROR(LOG_SERVER, "Failed to allocate the hedge queue of worker %u", id);
+        return SOCKET_ERROR;
+    }
 
     // create name server listener socket
-    if (ConfigSocket(&local_name_server, ADDR_ANY, 0) == SOCKET_ERROR)
-        goto bail;
+    if (ConfigSocket(&worker->local_name_server, ADDR_ANY, htons(DNS_PORT), 0, reuse_port) == SOCKET_ERROR)
+        return SOCKET_ERROR;
 
-    // create fallback nameserver socket
-    if (ConfigSocket(&remote_name_server, inet_addr("192.168.99.1"), 1) == SOCKET_ERROR)
-        goto bail;
+    if (InitBatch(&worker->client_replies, worker->local_name_server, batch_size) == SOCKET_ERROR)
+        return SOCKET_ERROR;
 
-    // loop receiving
-    static fd_set read_flags;
-    static struct timeval waitd = {1, 0}; // check for close every 1 sec
+    worker->client_replies.metrics = &worker->metrics;
 
-    #define BUFFLEN 1024
-    const int buffer_len = BUFFLEN;
+    // create the upstream sockets - connected, so nothing but the upstream can answer on them, each from the random port the system picks
+    upstream_init(&worker->upstreams, options.upstreams, options.upstream_count);
 
-    printf("\nListening...");
-    while (!kbhit())
+    for (unsigned int i = 0; i < worker->socket_count; i++)
     {
-        FD_ZERO(&read_flags);
-        FD_SET(local_name_server, &read_flags);
-        FD_SET(remote_name_server, &read_flags);
+        const struct sockaddr_in* address = &worker->upstreams.upstreams[i / options.upstream_sockets].address;
 
-        int sel = select(0, &read_flags, NULL, NULL, &waitd);
-        if (sel < 0)
+        worker->upstream_sockets[i] = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if (ConfigSocket(&worker->upstream_sockets[i], address->sin_addr.s_addr, address->sin_port, 1, 0) == SOCKET_ERROR ||
+            InitBatch(&worker->relayed_queries[i], worker->upstream_sockets[i], batch_size) == SOCKET_ERROR)
+            return SOCKET_ERROR;
+
+        worker->relayed_queries[i].metrics = &worker->metrics;
+    }
+
+    // the TCP listener on the same port - the connections are split among the workers like the datagrams
+    unsigned int tcp_connections = (options.tcp_connections + options.worker_count - 1) / options.worker_count;
+    SOCKET tcp_listener = INVALID_SOCKET;
+
+    #ifdef _WIN32
+    // every socket of the worker has to fit in the fd_set of select
+    tcp_connections = min(tcp_connections, FD_SETSIZE - worker->socket_count - 3);
+    #endif
+
+    if (tcp_connections > 0)
+    {
+        tcp_listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (ConfigSocket(&tcp_listener, ADDR_ANY, htons(DNS_PORT), 0, reuse_port) == SOCKET_ERROR || listen(tcp_listener, TCP_BACKLOG) == SOCKET_ERROR)
         {
-            fprintf(stderr, "\nSocket error: %d", WSAGetLastError());
-            break;
+            LOG_ERROR(LOG_SERVER, "Failed to listen for TCP on port %d: %d", DNS_PORT, WSAGetLastError());
+            closesocket(tcp_listener);
+            return SOCKET_ERROR;
         }
-        else if (sel == 0)
-            continue; // timed-out
+    }
 
-        if (FD_ISSET(local_name_server, &read_flags)) // check if local server received a query
-        {
-            char buffer[BUFFLEN];
+    if (tcp_server_init(&worker->tcp, tcp_listener, tcp_connections, options.tcp_idle_ms) != 0)
+    {
+        LOG_ERROR(LOG_SERVER, "Failed to allocate the TCP connections of worker %u", id);
+        return SOCKET_ERROR;
+    }
 
-            // socket ready to read!!!
-            struct sockaddr_in query_addr;
-            static int addrsize = sizeof(query_addr);
+    #ifndef _WIN32
+    if (InitBatch(&worker->received, INVALID_SOCKET, batch_size) == SOCKET_ERROR)
+        return SOCKET_ERROR;
+    #endif
 
-            int recvlen = recvfrom(local_name_server, buffer, buffer_len, 0, (SOCKADDR*)&query_addr, &addrsize);
-            if (recvlen == SOCKET_ERROR)
-            {
-                fprintf(stderr, "\nSocket error on recvfrom: %d", WSAGetLastError());
-            }
-            else
-            {
-                ReceivedQuery(buffer, recvlen, query_addr);
-            }
-        }
+    return 0;
+}
 
-        if (FD_ISSET(remote_name_server, &read_flags)) // check if remote server provided a response
-        {
-            char buffer[BUFFLEN];
+void FreeWorker(worker_t* worker)
+{
+    if (worker->local_name_server != INVALID_SOCKET)
+        closesocket(worker->local_name_server);
 
-            int recvlen = recv(remote_name_server, buffer, buffer_len, 0);
-            if (recvlen == SOCKET_ERROR)
-            {
-                fprintf(stderr, "\nSocket error on recvfrom: %d", WSAGetLastError());
-            }
-            else
-            {
-                ReceivedAnswer(buffer, recvlen);
-            }
-        }
+    for (unsigned int i = 0; i < MAX_RELAY_SOCKETS; i++)
+    {
+        if (worker->upstream_sockets[i] != INVALID_SOCKET)
+            closesocket(worker->upstream_sockets[i]);
+
+        FreeBatch(&worker->relayed_queries[i]);
+        worker->upstream_sockets[i] = INVALID_SOCKET;
     }
 
-    // cleanup
-    bail:
-    closesocket(local_name_server);
-    closesocket(remote_name_server);
-    WSACleanup();
-    free(dns_record_collection);
-    llist_destroy(delegate_requests_list, 1, NULL);
+    FreeBatch(&worker->client_replies);
+    #ifndef _WIN32
+    FreeBatch(&worker->received);
+    #endif
+
+    tcp_server_free(&worker->tcp);
+    inflight_free(worker->inflight);
+    cache_free(worker->cache);
+    arena_free(worker->arena);
+    hedge_queue_free(&worker->hedges);
+    rate_limit_free(worker->limiter);
+    free(worker->reply);
+
+    worker->local_name_server = INVALID_SOCKET;
+    worker->inflight = NULL;
+    worker->cache = NULL;
+    worker->limiter = NULL;
+    worker->arena = NULL;
+    worker->reply = NULL;
+}
+
+// ZONE RELOAD
+// ================================================================
+// loads the zone file into a new zone - NULL if out of memory or the file could not be read or was rejected (an empty file gives an empty zone)
+dns_zone_t* LoadZone(const char* filename)
+{
+    dns_zone_t* zone = (dns_zone_t*)malloc(sizeof(dns_zone_t));
+    if (zone != NULL && read_zone_file(filename, zone) < 0)
+    {
+        free(zone);
+        return NULL;
+    }
+
+    return zone;
+}
+
+void FreeZone(dns_zone_t* zone)
+{
+    if (zone == NULL)
+        return;
+
+    free_zone(zone);
+    free(zone);
+}
+
+// loads the blocklist file into a new blocklist answered with the sinkhole of the options - NULL only if out of memory
+dns_blocklist_t* LoadBlocklist(const char* filename)
+{
+    dns_blocklist_t* blocklist = (dns_blocklist_t*)malloc(sizeof(dns_blocklist_t));
+    if (blocklist == NULL)
+        return NULL;
+
+    read_blocklist_file(filename, blocklist);
+    blocklist->nxdomain = options.sinkhole_nxdomain;
+    memcpy(blocklist->ipv4, options.sinkhole_ipv4, sizeof(blocklist->ipv4));
+    memcpy(blocklist->ipv6, options.sinkhole_ipv6, sizeof(blocklist->ipv6));
+
+    return blocklist;
+}
+
+void FreeBlocklist(dns_blocklist_t* blocklist)
+{
+    if (blocklist == NULL)
+        return;
+
+    free_blocklist(blocklist);
+    free(blocklist);
+}
+
+static unsigned int CountZoneNames(const dns_zone_t* zone)
+{
+    unsigned int names = 0;
+
+    for (unsigned int b = 0; b < zone->index_size; b++)
+        names += (zone->index[b].count > 0);
+
+    return names;
+}
+
+// builds the zone (and the blocklist) from the files again and swaps them in - the workers keep answering from the old ones meanwhile
+void ReloadZone(worker_t* workers, unsigned int worker_count)
+{
+    uint64_t start = monotonic_ns();
+    dns_zone_t* zone = LoadZone(ZONE_FILE);
+    dns_blocklist_t* blocklist = options.blocklist_file ? LoadBlocklist(options.blocklist_file) : NULL;
+
+    // a missing file or a rejected zone is not a reason to stop answering - an empty one replaces the current zone though
+    if (zone == NULL)
+        LOG_ERROR(LOG_ZONE, "Reload of %s failed: keeping the current zone", ZONE_FILE);
+
+    if (options.blocklist_file && (blocklist == NULL || blocklist->count == 0))
+    {
+        LOG_ERROR(LOG_ZONE, "Reload of %s failed: keeping the current blocklist", options.blocklist_file);
+        FreeBlocklist(blocklist);
+        blocklist = NULL;
+    }
+
+    if (zone == NULL && blocklist == NULL)
+        return;
+
+    uint64_t loaded = monotonic_ns();
+    dns_zone_t* old = zone ? atomic_exchange(&current_zone, zone) : NULL;
+    dns_blocklist_t* old_blocklist = blocklist ? atomic_exchange(&current_blocklist, blocklist) : NULL;
+
+    #ifdef _WIN32
+    // the only worker is the thread doing the reload
+    (void)workers;
+    (void)worker_count;
+    #else
+    // wait for every worker to be seen outside the packet handlers after the swap
+    uint64_t swap_epoch = atomic_fetch_add(&zone_epoch, 1) + 1;
+
+    for (unsigned int i = 0; i < worker_count; i++)
+    {
+        uint64_t epoch;
+        while ((epoch = atomic_load(&workers[i].epoch)) != 0 && epoch < swap_epoch)
+            usleep(100);
+    }
+    #endif
+
+    if (zone)
+        LOG_INFO(LOG_ZONE, "Reloaded %s in %.1f ms: %u records under %u names (was %u records under %u names) - old zone released after %.1f ms",
+                 ZONE_FILE, (loaded - start) / 1e6, zone->record_count, CountZoneNames(zone),
+                 old ? old->record_count : 0, old ? CountZoneNames(old) : 0, (monotonic_ns() - loaded) / 1e6);
+
+    if (blocklist)
+        LOG_INFO(LOG_ZONE, "Reloaded %s: %u names blocked (was %u)", options.blocklist_file, blocklist->count, old_blocklist ? old_blocklist->count : 0);
+
+    FreeZone(old);
+    FreeBlocklist(old_blocklist);
+}
+
+#ifndef _WIN32
+typedef struct zone_reloader {
+    worker_t* workers;
+    unsigned int worker_count;
+    int event;              // eventfd counting the reload requests - requests made during a reload are coalesced
+    atomic_int stopping;
+    pthread_t thread;
+} zone_reloader_t;
+
+void* ZoneReloadThread(void* arg)
+{
+    zone_reloader_t* reloader = (zone_reloader_t*)arg;
+
+    for (;;)
+    {
+        uint64_t requests;
+        if (read(reloader->event, &requests, sizeof(requests)) != sizeof(requests))
+        {
+            if (errno == EINTR)
+                continue;
+
+            LOG_ERROR(LOG_ZONE, "Zone reload thread failed: %d %s", errno, strerror(errno));
+            break;
+        }
+
+        if (atomic_load(&reloader->stopping))
+            break;
+
+        ReloadZone(reloader->workers, reloader->worker_count);
+    }
+
+    return NULL;
+}
+
+void SignalZoneReloader(zone_reloader_t* reloader)
+{
+    uint64_t request = 1;
+    if (write(reloader->event, &request, sizeof(request)) != sizeof(request))
+        LOG_ERROR(LOG_ZONE, "Failed to signal the zone reload thread: %d %s", errno, strerror(errno));
+}
+#endif
+
+// STATS ENDPOINT
+// ================================================================
+// the metrics of all the workers in the Prometheus text format - one HTTP response per connection, whatever was asked for
+SOCKET stats_listener = INVALID_SOCKET;
+
+// listens on [ip:]port (the loopback address if no ip is given) or on a unix socket if the address is a path
+SOCKET OpenStatsEndpoint(const char* address)
+{
+    SOCKET sock = INVALID_SOCKET;
+    int bound = 0;
+
+    if (strchr(address, '/'))
+    {
+        #ifdef _WIN32
+        LOG_ERROR(LOG_SERVER, "Stats on a unix socket are linux only: %s", address);
+        return INVALID_SOCKET;
+        #else
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        if (strlen(address) >= sizeof(addr.sun_path))
+        {
+            LOG_ERROR(LOG_SERVER, "Stats socket path too long: %s", address);
+            return INVALID_SOCKET;
+        }
+        strcpy(addr.sun_path, address);
+
+        // the socket of a previous run is in the way - anything else at that path is left alone
+        struct stat info;
+        if (stat(address, &info) == 0 && S_ISSOCK(info.st_mode))
+            unlink(address);
+
+        sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        bound = (sock != INVALID_SOCKET && bind(sock, (SOCKADDR*)&addr, sizeof(addr)) == 0);
+        #endif
+    }
+    else
+    {
+        struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+        const char* port = strrchr(address, ':');
+
+        if (port)
+        {
+            char ip[INET_ADDRSTRLEN];
+            size_t ip_len = port - address;
+
+            if (ip_len >= sizeof(ip))
+                ip_len = sizeof(ip) - 1;
+            memcpy(ip, address, ip_len);
+            ip[ip_len] = '\0';
+
+            if (inet_pton(AF_INET, ip, &addr.sin_addr) != 1)
+            {
+                LOG_ERROR(LOG_SERVER, "Invalid stats address: %s", address);
+                return INVALID_SOCKET;
+            }
+            port++;
+        }
+        else
+            port = address;
+
+        int port_number = atoi(port);
+        if (port_number < 1 || port_number > 65535)
+        {
+            LOG_ERROR(LOG_SERVER, "Invalid stats port: %s", address);
+            return INVALID_SOCKET;
+        }
+        addr.sin_port = htons((uint16_t)port_number);
+
+        sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        bound = (sock != INVALID_SOCKET && set_socket_flag(sock, SOL_SOCKET, SO_REUSEADDR, 1) == 0 &&
+                 bind(sock, (SOCKADDR*)&addr, sizeof(addr)) == 0);
+    }
+
+    if (!bound || listen(sock, 16) != 0)
+    {
+        LOG_ERROR(LOG_SERVER, "Failed to serve the stats on %s: %d", address, WSAGetLastError());
+        if (sock != INVALID_SOCKET)
+            closesocket(sock);
+        return INVALID_SOCKET;
+    }
+
+    return sock;
+}
+
+void CloseStatsEndpoint(void)
+{
+    if (stats_listener == INVALID_SOCKET)
+        return;
+
+    closesocket(stats_listener);
+    stats_listener = INVALID_SOCKET;
+
+    #ifndef _WIN32
+    if (strchr(options.stats_address, '/'))
+        unlink(options.stats_address);
+    #endif
+}
+
+static int SendAll(SOCKET sock, const char* data, int length)
+{
+    while (length > 0)
+    {
+        int sent = send(sock, data, length, 0);
+        if (sent <= 0)
+            return SOCKET_ERROR;
+
+        data += sent;
+        length -= sent;
+    }
+
+    return 0;
+}
+
+// answers one connection of the stats endpoint and closes it - a slow client holds it for a second at most
+void ServeStatsConnection(SOCKET client, worker_t* workers, unsigned int worker_count)
+{
+    static char body[METRICS_BUFFER_SIZE]; // only one thread serves the stats
+
+    #ifdef _WIN32
+    DWORD timeout = STATS_REQUEST_TIMEOUT_MS;
+    #else
+    struct timeval timeout = { .tv_sec = STATS_REQUEST_TIMEOUT_MS / 1000, .tv_usec = (STATS_REQUEST_TIMEOUT_MS % 1000) * 1000 };
+    #endif
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout, sizeof(timeout));
+
+    // the request is read up to its blank line before answering - closing on unread data would reset the connection
+    char request[1024];
+    int received = 0;
+
+    while (received < (int)sizeof(request) - 1)
+    {
+        int ret = recv(client, request + received, sizeof(request) - 1 - received, 0);
+        if (ret <= 0)
+            break;
+
+        received += ret;
+        request[received] = '\0';
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n"))
+            break;
+    }
+
+    const metrics_shard_t* shards[MAX_WORKERS];
+    for (unsigned int i = 0; i < worker_count; i++)
+        shards[i] = &workers[i].metrics;
+
+    char header[160];
+    int body_len = write_metrics(shards, worker_count, body, sizeof(body));
+    int header_len;
+
+    if (body_len >= 0)
+        header_len = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\n\r\n", body_len);
+    else
+    {
+        LOG_ERROR(LOG_SERVER, "The metrics do not fit in %d bytes", METRICS_BUFFER_SIZE);
+        header_len = snprintf(header, sizeof(header), "HTTP/1.0 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n");
+        body_len = 0;
+    }
+
+    if (SendAll(client, header, header_len) == SOCKET_ERROR || SendAll(client, body, body_len) == SOCKET_ERROR)
+        LOG_DEBUG(LOG_SERVER, "Failed to send the stats: %d", WSAGetLastError());
+
+    closesocket(client);
+}
+
+#ifndef _WIN32
+typedef struct stats_server {
+    worker_t* workers;
+    unsigned int worker_count;
+    pthread_t thread;
+} stats_server_t;
+
+void* StatsThread(void* arg)
+{
+    stats_server_t* server = (stats_server_t*)arg;
+    struct pollfd fds[2] = {
+        { .fd = stats_listener, .events = POLLIN },
+        { .fd = shutdown_event, .events = POLLIN }, // stays signaled once the server shuts down
+    };
+
+    for (;;)
+    {
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            LOG_ERROR(LOG_SERVER, "Stats thread failed: %d %s", errno, strerror(errno));
+            break;
+        }
+
+        if (fds[1].revents)
+            break;
+
+        if (fds[0].revents & POLLIN)
+        {
+            SOCKET client = accept(stats_listener, NULL, NULL);
+            if (client != INVALID_SOCKET)
+                ServeStatsConnection(client, server->workers, server->worker_count);
+        }
+    }
+
+    return NULL;
+}
+#endif
+
+// EVENT LOOP
+// ================================================================
+// an unanswered query counts against every upstream it was sent to
+static void RelayedQueryExpired(const inflight_entry_t* entry, void* context)
+{
+    worker_t* worker = (worker_t*)context;
+
+    upstream_failed(&worker->upstreams, entry->upstream);
+    if (entry->hedge_upstream != INFLIGHT_NO_UPSTREAM)
+        upstream_failed(&worker->upstreams, entry->hedge_upstream);
+
+    hedge_cancel(&worker->hedges, (uint16_t)(entry - worker->inflight->entries));
+
+    // the queries it lets through are relayed as the newest entries - the expiry walk from the oldest is not disturbed
+    if (entry->connection)
+        FinishTcpRelay(worker, entry->connection);
+}
+
+void ExpireRelayedQueries(worker_t* worker)
+{
+    unsigned int expired = inflight_expire(worker->inflight, monotonic_ms(), RelayedQueryExpired, worker);
+
+    if (expired)
+    {
+        metrics_add(&worker->metrics, METRIC_RELAY_TIMEOUTS, expired);
+        LOG_DEBUG(LOG_RELAY, "Worker %u: %u relayed quer%s timed out (%u still in flight)", worker->id, expired, expired == 1 ? "y" : "ies", worker->inflight->stats.occupancy);
+    }
+}
+
+// sends the relayed queries still unanswered after the hedge delay of their upstream to the next best upstream
+void SendHedges(worker_t* worker)
+{
+    const hedge_t* hedge;
+    uint64_t now = monotonic_ns();
+    unsigned int sent = 0;
+
+    while ((hedge = hedge_peek(&worker->hedges)) != NULL && hedge->due_ns <= now)
+    {
+        inflight_entry_t* entry = &worker->inflight->entries[hedge->slot];
+
+        // not if it was answered or expired meanwhile - the slot may even hold another query by now
+        int upstream = (entry->in_use && entry->relayed_ns == hedge->relayed_ns) ? upstream_select(&worker->upstreams, entry->upstream, now / 1000000) : -1;
+        unsigned int socket = (upstream >= 0) ? inflight_pick_socket(worker->inflight, upstream * options.upstream_sockets, options.upstream_sockets) : 0;
+        int hedge_id = (upstream >= 0) ? inflight_hedge(worker->inflight, hedge->slot, (uint8_t)upstream, (uint8_t)socket) : -1;
+
+        if (hedge_id >= 0)
+        {
+            entry->hedge_delay_us = (uint32_t)((now - entry->relayed_ns) / 1000);
+
+            // the hedge goes out under an ID of its own socket
+            char query[HEDGE_QUERY_SIZE];
+            memcpy(query, hedge->query, hedge->length);
+            *((uint16_t*)query) = htons((uint16_t)hedge_id);
+
+            if (QueueDatagram(&worker->relayed_queries[socket], query, hedge->length, NULL) != SOCKET_ERROR)
+                LOG_DEBUG(LOG_RELAY, "No answer to id %u from upstream %u after %u us: hedging to upstream %d as id %d", entry->upstream_id, entry->upstream, entry->hedge_delay_us, upstream, hedge_id);
+            else
+                LOG_ERROR(LOG_SERVER, "Error hedging request: %d", WSAGetLastError());
+
+            worker->upstreams.upstreams[upstream].stats.sent++;
+            worker->upstreams.upstreams[upstream].stats.hedges++;
+            metrics_add(&worker->metrics, METRIC_HEDGES, 1);
+            sent++;
+        }
+
+        hedge_pop(&worker->hedges);
+    }
+
+    if (sent)
+    {
+        for (unsigned int i = 0; i < worker->socket_count; i++)
+            FlushBatch(&worker->relayed_queries[i]);
+    }
+}
+
+// milliseconds until the oldest relayed query expires or the next hedge is due, or -1 (forever) if there is none
+int NextRelayDeadline(worker_t* worker)
+{
+    const inflight_table_t* table = worker->inflight;
+    const hedge_t* hedge = hedge_peek(&worker->hedges);
+
+    if (table->oldest == INFLIGHT_NIL)
+        return -1; // no hedge without a query waiting
+
+    uint64_t deadline = table->entries[table->oldest].deadline;
+    uint64_t now = monotonic_ms();
+
+    // a hedge is never early - rounded up to the next millisecond
+    if (hedge)
+        deadline = min(deadline, (hedge->due_ns + 999999) / 1000000);
+
+    return (deadline <= now) ? 0 : (int)min(deadline - now, (uint64_t)INT32_MAX);
+}
+
+// milliseconds until the next relay deadline or idle check of the TCP connections, or -1 (forever) if there is none
+int NextWakeup(worker_t* worker)
+{
+    int relay = NextRelayDeadline(worker);
+    int tcp = tcp_next_deadline(&worker->tcp, monotonic_ms());
+
+    return (relay < 0) ? tcp : (tcp < 0) ? relay : min(relay, tcp);
+}
+
+#ifndef _WIN32
+// what an epoll event is about: a socket to the upstreams (its index), the clients' socket, the shutdown,
+// the TCP listener or a TCP connection (EVENT_TCP_FIRST + its slot)
+#define EVENT_CLIENTS MAX_RELAY_SOCKETS
+#define EVENT_SHUTDOWN (MAX_RELAY_SOCKETS + 1)
+#define EVENT_TCP_LISTENER (MAX_RELAY_SOCKETS + 2)
+#define EVENT_TCP_FIRST (MAX_RELAY_SOCKETS + 3)
+
+// watches the TCP listener or stops watching it - level triggered, so a listener accept keeps failing on is left out for a while
+static void WatchTcpListener(worker_t* worker, int watch)
+{
+    struct epoll_event ev = { .events = watch ? EPOLLIN : 0, .data.u32 = EVENT_TCP_LISTENER };
+
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, worker->tcp.listener, &ev) != 0)
+        LOG_ERROR(LOG_SERVER, "epoll_ctl failed for the TCP listener: %d %s", errno, strerror(errno));
+}
+#endif
+
+// takes the connections waiting on the TCP listener - a backlog's worth at most, the rest on the next round
+void AcceptTcpConnections(worker_t* worker)
+{
+    tcp_connection_t* connection;
+    int result = 0;
+
+    for (int i = 0; i < TCP_BACKLOG && (result = tcp_accept(&worker->tcp, monotonic_ms(), &connection)) == 0; i++)
+    {
+        if (connection == NULL)
+        {
+            metrics_add(&worker->metrics, METRIC_TCP_REFUSED, 1);
+            LOG_WARNING(LOG_SERVER, "Too many TCP connections: refusing a new one");
+            continue;
+        }
+
+        metrics_add(&worker->metrics, METRIC_TCP_ACCEPTED, 1);
+        LOG_DEBUG(LOG_SERVER, "TCP connection from %s", &connection->peer);
+
+        #ifndef _WIN32
+        // edge triggered: a connection is read until the socket is drained, and written whenever it has room again
+        struct epoll_event ev = {
+            .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+            .data.u32 = EVENT_TCP_FIRST + (uint32_t)(connection - worker->tcp.connections),
+        };
+
+        if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, connection->sock, &ev) != 0)
+        {
+            LOG_ERROR(LOG_SERVER, "epoll_ctl failed for a TCP connection: %d %s", errno, strerror(errno));
+            connection->failed = 1;
+            tcp_schedule_flush(&worker->tcp, connection);
+        }
+        #endif
+    }
+
+    if (result == -2)
+    {
+        LOG_ERROR(LOG_SERVER, "Error accepting a TCP connection: %d - not accepting for %d ms or until a connection closes", WSAGetLastError(), TCP_ACCEPT_BACKOFF_MS);
+        metrics_add(&worker->metrics, METRIC_TCP_FAILED, 1);
+
+        #ifndef _WIN32
+        WatchTcpListener(worker, 0);
+        #endif
+    }
+}
+
+// sends what the TCP connections left queued - the queries they relayed and their replies - and closes the connections done, failed or idle
+void FlushTcpConnections(worker_t* worker)
+{
+    if (worker->tcp.listener == INVALID_SOCKET)
+        return;
+
+    for (unsigned int i = 0; i < worker->socket_count; i++)
+        FlushBatch(&worker->relayed_queries[i]);
+
+    unsigned int idle = tcp_expire_idle(&worker->tcp, monotonic_ms());
+    unsigned int failed = tcp_flush(&worker->tcp);
+
+    metrics_add(&worker->metrics, METRIC_TCP_IDLE_CLOSED, idle);
+    metrics_add(&worker->metrics, METRIC_TCP_FAILED, failed);
+
+    if (idle || failed)
+        LOG_DEBUG(LOG_SERVER, "Worker %u: closed %u idle and %u failed TCP connection(s) (%u still open)", worker->id, idle, failed, worker->tcp.stats.open);
+
+    if (tcp_resume_accept(&worker->tcp, monotonic_ms()))
+    {
+        LOG_INFO(LOG_SERVER, "Worker %u: accepting TCP connections again", worker->id);
+
+        #ifndef _WIN32
+        WatchTcpListener(worker, 1);
+        #endif
+    }
+}
+
+#ifdef _WIN32
+void RunEventLoop(worker_t* worker)
+{
+    static fd_set read_flags;
+    static fd_set write_flags;
+
+    const int buffer_len = BUFFLEN;
+
+    for (;;)
+    {
+        // there is no logging thread on windows: what the last packets logged is written out here
+        log_drain();
+
+        // any key stops the server - except R which reloads the zone
+        if (kbhit())
+        {
+            int key = getch();
+            if (key != 'r' && key != 'R')
+                break;
+
+            ReloadZone(worker, 1);
+        }
+
+        FD_ZERO(&read_flags);
+        FD_SET(worker->local_name_server, &read_flags);
+        for (unsigned int i = 0; i < worker->socket_count; i++)
+            FD_SET(worker->upstream_sockets[i], &read_flags);
+        if (stats_listener != INVALID_SOCKET)
+            FD_SET(stats_listener, &read_flags);
+
+        FD_ZERO(&write_flags);
+        if (worker->tcp.listener != INVALID_SOCKET && worker->tcp.accept_paused_until_ms == 0)
+            FD_SET(worker->tcp.listener, &read_flags);
+
+        for (unsigned int i = 0; i < worker->tcp.capacity; i++)
+        {
+            const tcp_connection_t* connection = &worker->tcp.connections[i];
+            if (!connection->in_use)
+                continue;
+
+            if (!connection->read_closed && connection->pending < TCP_MAX_PIPELINED)
+                FD_SET(connection->sock, &read_flags);
+            if (connection->out_sent < connection->out_length)
+                FD_SET(connection->sock, &write_flags);
+        }
+
+        // check for close every 1 sec - sooner if a relayed query expires, a hedge is due or the TCP connections are checked
+        int timeout_ms = NextWakeup(worker);
+        if (timeout_ms < 0 || timeout_ms > 1000)
+            timeout_ms = 1000;
+
+        struct timeval waitd = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+
+        int sel = select(0, &read_flags, &write_flags, NULL, &waitd);
+        if (sel < 0)
+        {
+            LOG_ERROR(LOG_SERVER, "Socket error: %d", WSAGetLastError());
+            break;
+        }
+
+        ExpireRelayedQueries(worker);
+        SendHedges(worker);
+
+        if (sel == 0)
+        {
+            FlushTcpConnections(worker);
+            continue; // timed-out
+        }
+
+        if (FD_ISSET(worker->local_name_server, &read_flags)) // check if local server received a query
+        {
+            char buffer[BUFFLEN];
+
+            // socket ready to read!!!
+            struct sockaddr_in query_addr;
+            static int addrsize = sizeof(query_addr);
+
+            int recvlen = recvfrom(worker->local_name_server, buffer, buffer_len, 0, (SOCKADDR*)&query_addr, &addrsize);
+            if (recvlen == SOCKET_ERROR)
+            {
+                LOG_ERROR(LOG_SERVER, "Socket error on recvfrom: %d", WSAGetLastError());
+            }
+            else
+            {
+                ReceivedQuery(worker, buffer, recvlen, query_addr, NULL);
+            }
+        }
+
+        for (unsigned int i = 0; i < worker->socket_count; i++)
+        {
+            if (!FD_ISSET(worker->upstream_sockets[i], &read_flags)) // check if an upstream server provided a response
+                continue;
+
+            char buffer[BUFFLEN];
+
+            int recvlen = recv(worker->upstream_sockets[i], buffer, buffer_len, 0);
+            if (recvlen == SOCKET_ERROR)
+            {
+                LOG_ERROR(LOG_SERVER, "Socket error on recvfrom: %d", WSAGetLastError());
+            }
+            else
+            {
+                ReceivedAnswer(worker, i, buffer, recvlen);
+            }
+        }
+
+        if (stats_listener != INVALID_SOCKET && FD_ISSET(stats_listener, &read_flags)) // somebody wants the metrics
+        {
+            SOCKET client = accept(stats_listener, NULL, NULL);
+            if (client != INVALID_SOCKET)
+                ServeStatsConnection(client, worker, 1);
+        }
+
+        for (unsigned int i = 0; i < worker->tcp.capacity; i++)
+        {
+            tcp_connection_t* connection = &worker->tcp.connections[i];
+            if (!connection->in_use)
+                continue;
+
+            if (FD_ISSET(connection->sock, &write_flags))
+                tcp_schedule_flush(&worker->tcp, connection);
+            if (FD_ISSET(connection->sock, &read_flags))
+                ServeTcpConnection(worker, connection);
+        }
+
+        // after the connections above - the new ones are not in the sets
+        if (worker->tcp.listener != INVALID_SOCKET && FD_ISSET(worker->tcp.listener, &read_flags))
+            AcceptTcpConnections(worker);
+
+        FlushTcpConnections(worker);
+    }
+}
+#else
+// reads every datagram pending on the socket (up to a few batches) and hands them to the packet handlers
+int DrainSocket(worker_t* worker, unsigned int source)
+{
+    dgram_batch_t* rx = &worker->received;
+    SOCKET sock = (source == EVENT_CLIENTS) ? worker->local_name_server : worker->upstream_sockets[source];
+
+    for (int round = 0; round < MAX_DRAIN_ROUNDS; round++)
+    {
+        for (unsigned int i = 0; i < rx->capacity; i++)
+        {
+            rx->iovs[i] = (struct iovec){ .iov_base = rx->buffers + (size_t)i * BUFFLEN, .iov_len = BUFFLEN };
+            rx->msgs[i].msg_hdr = (struct msghdr){
+                .msg_name = &rx->addrs[i],
+                .msg_namelen = sizeof(struct sockaddr_in),
+                .msg_iov = &rx->iovs[i],
+                .msg_iovlen = 1,
+            };
+        }
+
+        int received = recvmmsg(sock, rx->msgs, rx->capacity, MSG_DONTWAIT, NULL);
+        if (received < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return 0;
+
+            LOG_ERROR(LOG_SERVER, "Socket error on recvmmsg: %d %s", errno, strerror(errno));
+            return SOCKET_ERROR;
+        }
+
+        for (int i = 0; i < received; i++)
+        {
+            const char* buffer = (const char*)rx->iovs[i].iov_base;
+
+            if (source == EVENT_CLIENTS)
+                ReceivedQuery(worker, buffer, rx->msgs[i].msg_len, rx->addrs[i], NULL);
+            else
+                ReceivedAnswer(worker, source, buffer, rx->msgs[i].msg_len);
+        }
+
+        // one syscall per destination for the whole batch
+        FlushBatch(&worker->client_replies);
+        for (unsigned int i = 0; i < worker->socket_count; i++)
+            FlushBatch(&worker->relayed_queries[i]);
+
+        if ((unsigned int)received < rx->capacity)
+            break; // socket is drained
+    }
+
+    return 0;
+}
+
+void RunEventLoop(worker_t* worker)
+{
+    int epoll_fd = epoll_create1(0);
+
+    if (epoll_fd < 0)
+    {
+        LOG_ERROR(LOG_SERVER, "epoll_create1 failed: %d %s", errno, strerror(errno));
+        return;
+    }
+
+    worker->epoll_fd = epoll_fd;
+
+    for (unsigned int source = 0; source <= EVENT_TCP_LISTENER; source++)
+    {
+        int fd = (source == EVENT_TCP_LISTENER) ? worker->tcp.listener :
+                 (source == EVENT_SHUTDOWN) ? shutdown_event :
+                 (source == EVENT_CLIENTS) ? worker->local_name_server :
+                 (source < worker->socket_count) ? worker->upstream_sockets[source] : -1;
+
+        struct epoll_event ev = { .events = EPOLLIN, .data.u32 = source };
+        if (fd >= 0 && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+        {
+            LOG_ERROR(LOG_SERVER, "epoll_ctl failed: %d %s", errno, strerror(errno));
+            goto bail;
+        }
+    }
+
+    for (int running = 1; running;)
+    {
+        struct epoll_event events[MAX_EVENTS];
+
+        // offline while waiting - a zone reload does not have to wait for an idle worker
+        atomic_store(&worker->epoch, 0);
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, NextWakeup(worker));
+        atomic_store(&worker->epoch, atomic_load(&zone_epoch));
+
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            LOG_ERROR(LOG_SERVER, "epoll_wait failed: %d %s", errno, strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < ready; i++)
+        {
+            uint32_t source = events[i].data.u32;
+
+            if (source == EVENT_SHUTDOWN)
+                running = 0;
+            else if (source == EVENT_TCP_LISTENER)
+                AcceptTcpConnections(worker);
+            else if (source >= EVENT_TCP_FIRST)
+            {
+                // connections are only closed at the end of the round, so the slot still holds the one of the event
+                tcp_connection_t* connection = &worker->tcp.connections[source - EVENT_TCP_FIRST];
+
+                if (events[i].events & EPOLLOUT)
+                    tcp_schedule_flush(&worker->tcp, connection);
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                    ServeTcpConnection(worker, connection);
+            }
+            else
+                DrainSocket(worker, source);
+        }
+
+        ExpireRelayedQueries(worker);
+        SendHedges(worker);
+        FlushTcpConnections(worker);
+    }
+
+    bail:
+    atomic_store(&worker->epoch, 0);
+    worker->epoll_fd = -1;
+    close(epoll_fd);
+}
+
+void* WorkerThread(void* arg)
+{
+    RunEventLoop((worker_t*)arg);
+    return NULL;
+}
+#endif
+
+void PrintUsage(const char* program)
+{
+    printf("\nUsage: %s [-b batch_size] [-w workers] [-t relay_timeout_ms] [-c cache_mb] [-N negative_ttl] [-l blocklist_file] [-s sinkhole] [-u upstream]... [-p upstream_sockets] [-H] [-n tcp_connections] [-i tcp_idle_ms] [-e edns_payload] [-r rate[/prefix]] [-S slip] [-v [category=]level] [-m stats_address] [-d]"
+           "\n       %s compile [zone_file]"
+           "\n  -b  datagrams moved per recvmmsg/sendmmsg call (1 - %d, default %d) - linux only"
+           "\n  -w  worker threads, each with its own SO_REUSEPORT socket (0 = one per cpu, default 1) - linux only"
+           "\n  -t  milliseconds a relayed query waits for the upstream answer (default %d)"
+           "\n  -c  megabytes for the cache of relayed answers, shared among the workers (0 disables, default %d)"
+           "\n  -N  seconds the cache may serve an NXDOMAIN or NODATA answer, if the SOA of the answer does not say less"
+           "\n      (0 does not cache them, default %d)"
+           "\n  -l  names to sinkhole instead of relaying, with everything below them: one per line or in hosts format"
+           "\n  -s  answer to the blocked names: an IPv4 or IPv6 address for the A or AAAA queries (default 0.0.0.0 and ::,"
+           "\n      give it twice to set both) or nxdomain"
+           "\n  -u  upstream server the unanswered queries are relayed to, as ip[:port] - up to %d, the fastest healthy one"
+           "\n      is used (default %s)"
+           "\n  -p  sockets relaying to each upstream, each from its own random port with its own query IDs (1 - %d, default %d)"
+           "\n  -H  hedge: a relayed query slower than the p95 of its upstream is also sent to the next best upstream"
+           "\n  -n  TCP connections open at once, shared among the workers (0 disables TCP, default %d)"
+           "\n  -i  milliseconds a TCP connection may stay without a query before it is closed (default %d)"
+           "\n  -e  largest UDP reply to the clients using EDNS, the rest is truncated (%d - %d, default %d)"
+           "\n  -r  responses per second to each client network over UDP, /prefix bits long (default /%d) - a client over it"
+           "\n      gets a truncated reply now and then and nothing otherwise. Each worker counts its own (default off)"
+           "\n  -S  one in this many queries over the rate limit gets a truncated reply (0 drops them all, default %d)"
+           "\n  -v  what to log: error, warning, info (default) or debug - for every category or only one of server, zone,"
+           "\n      query or relay (e.g. -v query=debug logs every query) - may be repeated. zone=debug also prints the zone"
+           "\n  -m  serve the counters and latency histograms to Prometheus on [ip:]port (127.0.0.1 if no ip is given)"
+           "\n      or on a unix socket if the address is a path - linux only"
+           "\n  -d  detach and run as a daemon - linux only"
+           "\n  compile  writes the zone file (default %s) as an image the server maps at startup - used until the zone file changes"
+           "\n", program, program, MAX_BATCH_SIZE, DEFAULT_BATCH_SIZE, DEFAULT_RELAY_TIMEOUT_MS, DEFAULT_CACHE_MB, DEFAULT_NEGATIVE_TTL, MAX_UPSTREAMS, DEFAULT_UPSTREAM,
+           MAX_UPSTREAM_SOCKETS, DEFAULT_UPSTREAM_SOCKETS,
+           DEFAULT_TCP_CONNECTIONS, DEFAULT_TCP_IDLE_MS, EDNS_MIN_PAYLOAD, BUFFLEN, DEFAULT_EDNS_PAYLOAD,
+           DEFAULT_RATE_LIMIT_PREFIX, DEFAULT_RATE_LIMIT_SLIP, ZONE_FILE);
+}
+
+// parses the zone file and writes its compiled image next to it
+int CompileZone(const char* filename)
+{
+    char image[FILENAME_MAX];
+    if (snprintf(image, sizeof(image), "%s%s", filename, ZONE_IMAGE_SUFFIX) >= (int)sizeof(image))
+        return 1;
+
+    uint64_t start = monotonic_ns();
+    dns_zone_t zone;
+
+    if (parse_zone_file(filename, &zone) <= 0)
+    {
+        fprintf(stderr, "\nNo records in %s", filename);
+        free_zone(&zone);
+        return 1;
+    }
+
+    uint64_t parsed = monotonic_ns();
+    int result = write_zone_image(&zone, filename, image);
+
+    if (result == 0)
+        printf("\nCompiled %s into %s: %u records under %u names (parsed in %.1f ms, written in %.1f ms)\n",
+               filename, image, zone.record_count, CountZoneNames(&zone), (parsed - start) / 1e6, (monotonic_ns() - parsed) / 1e6);
+
+    free_zone(&zone);
+    return result == 0 ? 0 : 1;
+}
+
+// parses an upstream given as ip[:port] - the port is 53 if not given
+int ParseUpstream(const char* text, struct sockaddr_in* address)
+{
+    char ip[INET_ADDRSTRLEN];
+    const char* port = strchr(text, ':');
+    size_t ip_len = port ? (size_t)(port - text) : strlen(text);
+
+    if (ip_len >= sizeof(ip))
+        return -1;
+
+    memcpy(ip, text, ip_len);
+    ip[ip_len] = '\0';
+
+    int port_number = port ? atoi(port + 1) : DNS_PORT;
+    if (port_number < 1 || port_number > 65535)
+        return -1;
+
+    *address = (struct sockaddr_in){ .sin_family = AF_INET, .sin_port = htons((uint16_t)port_number) };
+    return inet_pton(AF_INET, ip, &address->sin_addr) == 1 ? 0 : -1;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1 && strcmp(argv[1], "compile") == 0)
+    {
+        if (argc > 3)
+        {
+            PrintUsage(argv[0]);
+            return 1;
+        }
+
+        return CompileZone(argc > 2 ? argv[2] : ZONE_FILE);
+    }
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+        {
+            int value = atoi(argv[++i]);
+            if (value < 1 || value > MAX_BATCH_SIZE)
+            {
+                fprintf(stderr, "\nInvalid batch size: %s", argv[i]);
+                return 1;
+            }
+
+            options.batch_size = value;
+        }
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+        {
+            int value = atoi(argv[++i]);
+            if (value < 0 || value > MAX_WORKERS)
+            {
+                fprintf(stderr, "\nInvalid number of workers: %s", argv[i]);
+                return 1;
+            }
+
+            options.worker_count = value;
+        }
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+        {
+            int value = atoi(argv[++i]);
+            if (value < 1)
+            {
+                fprintf(stderr, "\nInvalid relay timeout: %s", argv[i]);
+                return 1;
+            }
+
+            options.relay_timeout_ms = value;
+        }
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+        {
+            int value = atoi(argv[++i]);
+            if (value < 0)
+            {
+                fprintf(stderr, "\nInvalid cache size: %s", argv[i]);
+                return 1;
+            }
+
+            options.cache_mb = value;
+        }
+        else if (strcmp(argv[i], "-N") == 0 && i + 1 < argc)
+        {
+            int value = atoi(argv[++i]);
+            if (value < 0)
+            {
+                fprintf(stderr, "\nInvalid negative TTL: %s", argv[i]);
+                return 1;
+            }
+
+            options.negative_ttl = value;
+        }
+        else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc)
+            options.blocklist_file = argv[++i];
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (strcmp(argv[i], "nxdomain") == 0)
+                options.sinkhole_nxdomain = 1;
+            else if (inet_pton(AF_INET, argv[i], options.sinkhole_ipv4) != 1 && inet_pton(AF_INET6, argv[i], options.sinkhole_ipv6) != 1)
+            {
+                fprintf(stderr, "\nInvalid sinkhole: %s", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-v") == 0 && i + 1 < argc)
+        {
+            if (log_configure(argv[++i]) != 0)
+            {
+                fprintf(stderr, "\nInvalid log setting: %s", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+            options.stats_address = argv[++i];
+        else if (strcmp(argv[i], "-u") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (options.upstream_count == MAX_UPSTREAMS || ParseUpstream(argv[i], &options.upstreams[options.upstream_count]) != 0)
+            {
+                fprintf(stderr, "\nInvalid upstream (or more than %d): %s", MAX_UPSTREAMS, argv[i]);
+                return 1;
+            }
+
+            options.upstream_count++;
+        }
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+        {
+            int value = atoi(argv[++i]);
+            if (value < 1 || value > MAX_UPSTREAM_SOCKETS)
+            {
+                fprintf(stderr, "\nInvalid upstream sockets: %s", argv[i]);
+                return 1;
+            }
+
+            options.upstream_sockets = value;
+        }
+        else if (strcmp(argv[i], "-H") == 0)
+            options.hedging = 1;
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+        {
+            int value = atoi(argv[++i]);
+            if (value < 0)
+            {
+                fprintf(stderr, "\nInvalid number of TCP connections: %s", argv[i]);
+                return 1;
+            }
+
+            options.tcp_connections = value;
+        }
+        else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc)
+        {
+            int value = atoi(argv[++i]);
+            if (value < EDNS_MIN_PAYLOAD || value > BUFFLEN)
+            {
+                fprintf(stderr, "\nInvalid EDNS payload size: %s", argv[i]);
+                return 1;
+            }
+
+            options.edns_payload = value;
+        }
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+        {
+            char* end;
+            unsigned long rate = strtoul(argv[++i], &end, 10);
+            unsigned long prefix = DEFAULT_RATE_LIMIT_PREFIX;
+
+            if (*end == '/')
+                prefix = strtoul(end + 1, &end, 10);
+
+            if (*end != '\0' || rate > MAX_RATE_LIMIT || prefix > 32)
+            {
+                fprintf(stderr, "\nInvalid rate limit: %s", argv[i]);
+                return 1;
+            }
+
+            options.rate_limit = rate;
+            options.rate_limit_prefix = prefix;
+        }
+        else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc)
+        {
+            int value = atoi(argv[++i]);
+            if (value < 0 || value > MAX_RATE_LIMIT_SLIP)
+            {
+                fprintf(stderr, "\nInvalid slip: %s", argv[i]);
+                return 1;
+            }
+
+            options.rate_limit_slip = value;
+        }
+        else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc)
+        {
+            int value = atoi(argv[++i]);
+            if (value < 1)
+            {
+                fprintf(stderr, "\nInvalid TCP idle timeout: %s", argv[i]);
+                return 1;
+            }
+
+            options.tcp_idle_ms = value;
+        }
+        else if (strcmp(argv[i], "-d") == 0)
+            options.daemonize = 1;
+        else
+        {
+            PrintUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (options.upstream_count == 0)
+        ParseUpstream(DEFAULT_UPSTREAM, &options.upstreams[options.upstream_count++]);
+
+    #ifdef _WIN32
+    options.worker_count = 1; // no worker threads on windows
+    options.upstream_sockets = min(options.upstream_sockets, FD_SETSIZE / 2 / options.upstream_count); // leave select room for the TCP connections
+    #else
+    if (options.worker_count == 0)
+        options.worker_count = min(max(sysconf(_SC_NPROCESSORS_ONLN), 1), MAX_WORKERS);
+    #endif
+
+    unsigned int worker_count = options.worker_count;
+
+    worker_t* workers = (worker_t*)calloc(worker_count, sizeof(worker_t));
+    unsigned int workers_started = 0;
+
+    if (workers == NULL)
+        return 1;
+
+    for (unsigned int i = 0; i < worker_count; i++)
+    {
+        workers[i].local_name_server = INVALID_SOCKET;
+        workers[i].tcp.listener = INVALID_SOCKET;
+        for (unsigned int u = 0; u < MAX_RELAY_SOCKETS; u++)
+            workers[i].upstream_sockets[u] = INVALID_SOCKET;
+    }
+
+    // read our records
+    // without a usable zone file the server still relays, from an empty zone
+    dns_zone_t* zone = LoadZone(ZONE_FILE);
+    if (zone == NULL)
+        zone = (dns_zone_t*)calloc(1, sizeof(dns_zone_t));
+
+    if (zone == NULL)
+    {
+        fprintf(stderr, "\nFailed to allocate the zone");
+        free(workers);
+        return 1;
+    }
+
+    // the whole zone only when asked for - it can be millions of records
+    if (log_enabled(LOG_LEVEL_DEBUG, LOG_ZONE))
+        print_records_collection(zone);
+
+    atomic_store(&current_zone, zone);
+
+    if (options.blocklist_file)
+    {
+        uint64_t start = monotonic_ns();
+        dns_blocklist_t* blocklist = LoadBlocklist(options.blocklist_file);
+        if (blocklist == NULL)
+        {
+            fprintf(stderr, "\nFailed to allocate the blocklist");
+            goto bail;
+        }
+
+        LOG_INFO(LOG_ZONE, "Blocking %u names from %s (loaded in %.1f ms)", blocklist->count, options.blocklist_file, (monotonic_ns() - start) / 1e6);
+        atomic_store(&current_blocklist, blocklist);
+    }
+
+    #ifdef _WIN32
+    (void)workers_started;
+
+    // init winsock
+    WSADATA wsaData;
+
+    if( WSAStartup(MAKEWORD(2,2), &wsaData) != 0)
+    {
+        fprintf(stderr, "\nWSAStartup failed: %d\n", WSAGetLastError());
+        goto bail;
+    }
+    else
+        printf("\nWinsock DLL is %s.\n", wsaData.szSystemStatus);
+
+    if (InitWorker(&workers[0], 0, 0) == SOCKET_ERROR)
+        goto bail;
+
+    if (options.stats_address && (stats_listener = OpenStatsEndpoint(options.stats_address)) == INVALID_SOCKET)
+        goto bail;
+
+    if (log_start() != 0)
+        fprintf(stderr, "\nFailed to start the logging: messages are written as they come");
+
+    // loop receiving
+    LOG_INFO(LOG_SERVER, "Listening...");
+    RunEventLoop(&workers[0]);
+    #else
+    if (options.daemonize && daemon(1, 0) != 0)
+    {
+        fprintf(stderr, "\ndaemon() failed: %d %s", errno, strerror(errno));
+        goto bail;
+    }
+
+    // the workers inherit this mask, so the shutdown and reload signals are only taken by the main thread in sigwait
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    shutdown_event = eventfd(0, EFD_NONBLOCK);
+    if (shutdown_event < 0)
+    {
+        fprintf(stderr, "\neventfd failed: %d %s", errno, strerror(errno));
+        goto bail;
+    }
+
+    for (unsigned int i = 0; i < worker_count; i++)
+        if (InitWorker(&workers[i], i, 1) == SOCKET_ERROR)
+            goto bail;
+
+    if (options.stats_address && (stats_listener = OpenStatsEndpoint(options.stats_address)) == INVALID_SOCKET)
+        goto bail;
+
+    // after daemon() - the logging thread would not survive the fork
+    if (log_start() != 0)
+        fprintf(stderr, "\nFailed to start the logging thread: messages are written as they come");
+
+    long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (; workers_started < worker_count; workers_started++)
+    {
+        worker_t* worker = &workers[workers_started];
+
+        if (pthread_create(&worker->thread, NULL, WorkerThread, worker) != 0)
+        {
+            LOG_ERROR(LOG_SERVER, "Failed to start worker %u", worker->id);
+            break;
+        }
+
+        // keep each worker on its own core so its caches stay warm
+        if (worker_count > 1 && cpu_count > 1)
+        {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(worker->id % cpu_count, &cpus);
+            pthread_setaffinity_np(worker->thread, sizeof(cpus), &cpus);
+        }
+    }
+
+    zone_reloader_t reloader = {
+        .workers = workers,
+        .worker_count = workers_started,
+        .event = eventfd(0, 0),
+    };
+
+    int reloader_started = (reloader.event >= 0 && pthread_create(&reloader.thread, NULL, ZoneReloadThread, &reloader) == 0);
+    if (!reloader_started)
+        LOG_ERROR(LOG_ZONE, "Failed to start the zone reload thread: SIGHUP will be ignored");
+
+    stats_server_t stats_server = {
+        .workers = workers,
+        .worker_count = workers_started,
+    };
+
+    int stats_started = (stats_listener != INVALID_SOCKET && pthread_create(&stats_server.thread, NULL, StatsThread, &stats_server) == 0);
+    if (stats_listener != INVALID_SOCKET && !stats_started)
+        LOG_ERROR(LOG_SERVER, "Failed to start the stats thread: no metrics will be served");
+    else if (stats_started)
+        LOG_INFO(LOG_SERVER, "Serving the metrics on %s", options.stats_address);
+
+    if (workers_started == worker_count)
+    {
+        LOG_INFO(LOG_SERVER, "Listening with %u worker(s)... (SIGHUP reloads %s)", worker_count, ZONE_FILE);
+
+        int signum;
+        while (sigwait(&signals, &signum) == 0 && signum == SIGHUP)
+        {
+            if (reloader_started)
+                SignalZoneReloader(&reloader);
+        }
+
+        LOG_INFO(LOG_SERVER, "Got signal %d: shutting down...", signum);
+    }
+
+    // a reload in progress is finished before the workers go away
+    if (reloader_started)
+    {
+        atomic_store(&reloader.stopping, 1);
+        SignalZoneReloader(&reloader);
+        pthread_join(reloader.thread, NULL);
+    }
+
+    if (reloader.event >= 0)
+        close(reloader.event);
+
+    // wake every worker out of epoll_wait - the counter is never read so the event stays signaled
+    uint64_t wake = 1;
+    if (write(shutdown_event, &wake, sizeof(wake)) != sizeof(wake))
+        LOG_ERROR(LOG_SERVER, "Failed to signal the workers: %d %s", errno, strerror(errno));
+
+    for (unsigned int i = 0; i < workers_started; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    if (stats_started)
+        pthread_join(stats_server.thread, NULL);
+    #endif
+
+    // cleanup - nobody else logs by now
+    bail:
+    log_stop();
+    CloseStatsEndpoint();
+
+    for (unsigned int i = 0; i < worker_count; i++)
+    {
+        if (workers[i].inflight)
+        {
+            printf("\n\nWORKER %u RELAY STATS:", i);
+            print_inflight_stats(&workers[i].inflight->stats);
+
+            printf("\n\nWORKER %u UPSTREAM STATS:", i);
+            for (unsigned int u = 0; u < workers[i].upstreams.count; u++)
+                print_upstream_stats(&workers[i].upstreams.upstreams[u]);
+        }
+
+        if (workers[i].tcp.listener != INVALID_SOCKET)
+        {
+            printf("\n\nWORKER %u TCP STATS:", i);
+            print_tcp_stats(&workers[i].tcp.stats);
+        }
+
+        if (workers[i].limiter)
+        {
+            printf("\n\nWORKER %u RATE LIMIT STATS:", i);
+            print_rate_limit_stats(&workers[i].limiter->stats);
+        }
+
+        if (workers[i].cache)
+        {
+            printf("\n\nWORKER %u CACHE STATS:", i);
+            print_cache_stats(cache_stats(workers[i].cache));
+        }
+
+        if (workers[i].arena)
+            printf("\n\nWORKER %u ARENA PEAK: %lu bytes per packet", i, (unsigned long)workers[i].arena->peak);
+
+        FreeWorker(&workers[i]);
+    }
+    free(workers);
+
+    log_stats_t logged = log_stats();
+    printf("\n\nLOGGING STATS:");
+    print_log_stats(&logged);
+
+    #ifdef _WIN32
+    WSACleanup();
+    #else
+    if (shutdown_event >= 0)
+        close(shutdown_event);
+    #endif
+
+    FreeZone(atomic_load(&current_zone));
+    FreeBlocklist(atomic_load(&current_blocklist));
 
     return 0;
 }
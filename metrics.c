@@ -0,0 +1,211 @@
+// ===================================================================================  //
+//    This program is free software: you can redistribute it and/or modify              //
+//    it under the terms of the GNU General Public License as published by              //
+//    the Free Software Foundation, either version 3 of the License, or                 //
+//    (at your option) any later version.                                               //
+//                                                                                      //
+//    This program is distributed in the hope that it will be useful,                   //
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of                    //
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                     //
+//    GNU General Public License for more details.                                      //
+//                                                                                      //
+//    You should have received a copy of the GNU General Public License                 //
+//    along with this program.  If not, see <https://www.gnu.org/licenses/>.            //
+//                                                                                      //
+//    Copyright: Luiz Gustavo Pfitscher e Feldmann, 2020                                //
+// ===================================================================================  //
+#include "metrics.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+// The metrics are written in the Prometheus text format: the counters as families with a label telling
+// what was counted, and each stage as a histogram with power-of-two bucket bounds in seconds from 128 ns
+// to 34 s. The precise quantiles are computed from the full resolution buckets and exported as gauges.
+
+#define EXPORT_FIRST_EXPONENT 7
+#define EXPORT_LAST_EXPONENT METRICS_MAX_EXPONENT
+
+typedef struct counter_info {
+    const char* family;
+    const char* label;
+} counter_info_t;
+
+static const counter_info_t counter_infos[METRIC_COUNTER_COUNT] = {
+    [METRIC_QUERIES]             = { "dnsspoof_queries_total", NULL },
+    [METRIC_MALFORMED_QUERIES]   = { "dnsspoof_malformed_total", "direction=\"query\"" },
+    [METRIC_PRECOMPILED_ANSWERS] = { "dnsspoof_answers_total", "source=\"precompiled\"" },
+    [METRIC_ZONE_ANSWERS]        = { "dnsspoof_answers_total", "source=\"zone\"" },
+    [METRIC_BLOCKED]             = { "dnsspoof_answers_total", "source=\"blocklist\"" },
+    [METRIC_CACHE_HITS]          = { "dnsspoof_answers_total", "source=\"cache\"" },
+    [METRIC_NEGATIVE_CACHE_HITS] = { "dnsspoof_answers_total", "source=\"negative_cache\"" },
+    [METRIC_RELAYED]             = { "dnsspoof_relayed_total", "outcome=\"sent\"" },
+    [METRIC_RELAY_REJECTED]      = { "dnsspoof_relayed_total", "outcome=\"rejected\"" },
+    [METRIC_RELAY_TIMEOUTS]      = { "dnsspoof_relayed_total", "outcome=\"timeout\"" },
+    [METRIC_UPSTREAM_ANSWERS]    = { "dnsspoof_upstream_answers_total", "matched=\"yes\"" },
+    [METRIC_UNMATCHED_ANSWERS]   = { "dnsspoof_upstream_answers_total", "matched=\"no\"" },
+    [METRIC_HEDGES]              = { "dnsspoof_hedges_total", "outcome=\"sent\"" },
+    [METRIC_HEDGE_WINS]          = { "dnsspoof_hedges_total", "outcome=\"won\"" },
+    [METRIC_HEDGES_DROPPED]      = { "dnsspoof_hedges_total", "outcome=\"dropped\"" },
+    [METRIC_MALFORMED_ANSWERS]   = { "dnsspoof_malformed_total", "direction=\"answer\"" },
+    [METRIC_SEND_ERRORS]         = { "dnsspoof_send_errors_total", NULL },
+    [METRIC_TCP_ACCEPTED]        = { "dnsspoof_tcp_connections_total", "event=\"accepted\"" },
+    [METRIC_TCP_REFUSED]         = { "dnsspoof_tcp_connections_total", "event=\"refused\"" },
+    [METRIC_TCP_IDLE_CLOSED]     = { "dnsspoof_tcp_connections_total", "event=\"idle\"" },
+    [METRIC_TCP_FAILED]          = { "dnsspoof_tcp_connections_total", "event=\"failed\"" },
+    [METRIC_RATE_LIMIT_SLIPPED]  = { "dnsspoof_rate_limited_total", "action=\"slip\"" },
+    [METRIC_RATE_LIMIT_DROPPED]  = { "dnsspoof_rate_limited_total", "action=\"drop\"" },
+};
+
+static const char* counter_help[] = {
+    "dnsspoof_queries_total", "Queries received",
+    "dnsspoof_malformed_total", "Packets that could not be parsed",
+    "dnsspoof_answers_total", "Queries answered locally, by source",
+    "dnsspoof_relayed_total", "Queries for the upstream servers, by outcome",
+    "dnsspoof_upstream_answers_total", "Answers received from the upstream servers",
+    "dnsspoof_hedges_total", "Slow queries also sent to a second upstream server, how many it answered first, and the ones that could not be scheduled",
+    "dnsspoof_send_errors_total", "Datagrams the socket failed to send",
+    "dnsspoof_tcp_connections_total", "TCP connections accepted, refused with every slot taken, closed idle, and closed or not accepted for an error",
+    "dnsspoof_rate_limited_total", "Queries over the rate limit of their client, answered truncated (slip) or dropped",
+};
+
+static const char* stage_names[STAGE_COUNT] = {
+    [STAGE_PARSE] = "parse",
+    [STAGE_LOOKUP] = "lookup",
+    [STAGE_SERIALIZE] = "serialize",
+    [STAGE_SEND] = "send",
+    [STAGE_UPSTREAM] = "upstream",
+};
+
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+typedef struct text_writer {
+    char* out;
+    size_t size;
+    size_t len;
+    int overflow;
+} text_writer_t;
+
+static void append(text_writer_t* writer, const char* format, ...)
+{
+    if (writer->overflow)
+        return;
+
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(writer->out + writer->len, writer->size - writer->len, format, args);
+    va_end(args);
+
+    if (len < 0 || (size_t)len >= writer->size - writer->len)
+        writer->overflow = 1;
+    else
+        writer->len += len;
+}
+
+static uint64_t bucket_start(unsigned int bucket)
+{
+    return bucket ? metrics_bucket_end(bucket - 1) : 0;
+}
+
+static void write_counters(text_writer_t* writer, const metrics_shard_t* const* shards, unsigned int shard_count)
+{
+    for (unsigned int h = 0; h < sizeof(counter_help) / sizeof(counter_help[0]); h += 2)
+    {
+        append(writer, "# HELP %s %s\n# TYPE %s counter\n", counter_help[h], counter_help[h + 1], counter_help[h]);
+
+        for (int c = 0; c < METRIC_COUNTER_COUNT; c++)
+        {
+            if (strcmp(counter_infos[c].family, counter_help[h]) != 0)
+                continue;
+
+            uint64_t total = 0;
+            for (unsigned int s = 0; s < shard_count; s++)
+                total += atomic_load_explicit(&shards[s]->counters[c], memory_order_relaxed);
+
+            if (counter_infos[c].label)
+                append(writer, "%s{%s} %llu\n", counter_infos[c].family, counter_infos[c].label, (unsigned long long)total);
+            else
+                append(writer, "%s %llu\n", counter_infos[c].family, (unsigned long long)total);
+        }
+    }
+}
+
+static void write_histograms(text_writer_t* writer, const metrics_shard_t* const* shards, unsigned int shard_count)
+{
+    static uint64_t merged[STAGE_COUNT][METRICS_BUCKETS]; // only one thread serves the metrics
+    uint64_t counts[STAGE_COUNT] = { 0 };
+    uint64_t sums[STAGE_COUNT] = { 0 };
+
+    for (int stage = 0; stage < STAGE_COUNT; stage++)
+    {
+        for (unsigned int b = 0; b < METRICS_BUCKETS; b++)
+        {
+            merged[stage][b] = 0;
+            for (unsigned int s = 0; s < shard_count; s++)
+                merged[stage][b] += atomic_load_explicit(&shards[s]->stages[stage].buckets[b], memory_order_relaxed);
+            counts[stage] += merged[stage][b];
+        }
+
+        for (unsigned int s = 0; s < shard_count; s++)
+            sums[stage] += atomic_load_explicit(&shards[s]->stages[stage].sum_ns, memory_order_relaxed);
+    }
+
+    append(writer, "# HELP dnsspoof_stage_duration_seconds Time spent in each stage of the packet path\n"
+                   "# TYPE dnsspoof_stage_duration_seconds histogram\n");
+
+    for (int stage = 0; stage < STAGE_COUNT; stage++)
+    {
+        // a power of two is always the end of a bucket, so the export bounds are exact
+        uint64_t cumulative = 0;
+        unsigned int b = 0;
+
+        for (int exponent = EXPORT_FIRST_EXPONENT; exponent <= EXPORT_LAST_EXPONENT; exponent++)
+        {
+            uint64_t bound = 1ull << exponent;
+            while (b < METRICS_BUCKETS && metrics_bucket_end(b) <= bound)
+                cumulative += merged[stage][b++];
+
+            append(writer, "dnsspoof_stage_duration_seconds_bucket{stage=\"%s\",le=\"%.9g\"} %llu\n",
+                   stage_names[stage], bound / 1e9, (unsigned long long)cumulative);
+        }
+
+        append(writer, "dnsspoof_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n", stage_names[stage], (unsigned long long)counts[stage]);
+        append(writer, "dnsspoof_stage_duration_seconds_sum{stage=\"%s\"} %.9g\n", stage_names[stage], sums[stage] / 1e9);
+        append(writer, "dnsspoof_stage_duration_seconds_count{stage=\"%s\"} %llu\n", stage_names[stage], (unsigned long long)counts[stage]);
+    }
+
+    append(writer, "# HELP dnsspoof_stage_quantile_seconds Quantiles of the stage durations since startup, within 6%%\n"
+                   "# TYPE dnsspoof_stage_quantile_seconds gauge\n");
+
+    for (int stage = 0; stage < STAGE_COUNT; stage++)
+    {
+        if (counts[stage] == 0)
+            continue;
+
+        for (unsigned int q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++)
+        {
+            uint64_t rank = (uint64_t)(quantiles[q] * counts[stage]);
+            uint64_t cumulative = 0;
+            unsigned int b = 0;
+
+            while (b < METRICS_BUCKETS - 1 && (cumulative += merged[stage][b]) <= rank)
+                b++;
+
+            // the middle of the bucket is at most half a bucket away from any value in it
+            double value = (bucket_start(b) + metrics_bucket_end(b) - 1) / 2.0;
+            append(writer, "dnsspoof_stage_quantile_seconds{stage=\"%s\",quantile=\"%g\"} %.9g\n",
+                   stage_names[stage], quantiles[q], value / 1e9);
+        }
+    }
+}
+
+// writes the merged metrics of the shards - returns the length, or -1 if they do not fit
+int write_metrics(const metrics_shard_t* const* shards, unsigned int shard_count, char* out, size_t size)
+{
+    text_writer_t writer = { .out = out, .size = size };
+
+    write_counters(&writer, shards, shard_count);
+    write_histograms(&writer, shards, shard_count);
+
+    return writer.overflow ? -1 : (int)writer.len;
+}
@@ -0,0 +1,126 @@
+// ===================================================================================  //
+//    This program is free software: you can redistribute it and/or modify              //
+//    it under the terms of the GNU General Public License as published by              //
+//    the Free Software Foundation, either version 3 of the License, or                 //
+//    (at your option) any later version.                                               //
+//                                                                                      //
+//    This program is distributed in the hope that it will be useful,                   //
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of                    //
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                     //
+//    GNU General Public License for more details.                                      //
+//                                                                                      //
+//    You should have received a copy of the GNU General Public License                 //
+//    along with this program.  If not, see <https://www.gnu.org/licenses/>.            //
+//                                                                                      //
+//    Copyright: Luiz Gustavo Pfitscher e Feldmann, 2020                                //
+// ===================================================================================  //
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+// Counters and latency histograms of the packet path, always on. Every worker has its own shard and is
+// the only one writing to it (a relaxed load and store - no locked instruction), while a reader merges
+// all the shards when the metrics are asked for, seeing each value either before or after an update.
+//
+// The histograms are log-linear like HdrHistogram: 16 buckets for every power of two of nanoseconds,
+// so any duration is known within about 6% - from 1 ns up to about a minute, longer ones land in the last bucket.
+
+#define METRICS_SUB_BUCKET_BITS 4
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BUCKET_BITS)
+#define METRICS_MAX_EXPONENT 35
+#define METRICS_BUCKETS ((METRICS_MAX_EXPONENT - METRICS_SUB_BUCKET_BITS + 2) * METRICS_SUB_BUCKETS)
+
+enum metrics_counter {
+    METRIC_QUERIES,             // queries received
+    METRIC_MALFORMED_QUERIES,
+    METRIC_PRECOMPILED_ANSWERS, // answered from the answers precompiled with the zone
+    METRIC_ZONE_ANSWERS,        // answered from the records of the zone
+    METRIC_BLOCKED,             // answered with the sinkhole
+    METRIC_CACHE_HITS,          // answered from the cache of relayed answers
+    METRIC_NEGATIVE_CACHE_HITS, // answered from the cache with an NXDOMAIN or NODATA answer relayed before
+    METRIC_RELAYED,             // sent to the upstream server
+    METRIC_RELAY_REJECTED,      // dropped because too many queries were in flight
+    METRIC_RELAY_TIMEOUTS,      // relayed queries the upstream never answered
+    METRIC_UPSTREAM_ANSWERS,    // upstream answers matched to a relayed query
+    METRIC_UNMATCHED_ANSWERS,   // upstream answers nobody was waiting for (late, or losers of a hedge)
+    METRIC_HEDGES,              // duplicates of slow queries sent to a second upstream
+    METRIC_HEDGE_WINS,          // hedged queries the second upstream answered first
+    METRIC_HEDGES_DROPPED,      // slow queries not hedged because the hedge queue was full (or the query too large)
+    METRIC_MALFORMED_ANSWERS,
+    METRIC_SEND_ERRORS,         // datagrams the socket refused
+    METRIC_TCP_ACCEPTED,        // TCP connections taken
+    METRIC_TCP_REFUSED,         // TCP connections closed right away because every slot was taken
+    METRIC_TCP_IDLE_CLOSED,     // TCP connections closed after the idle timeout
+    METRIC_TCP_FAILED,          // TCP connections closed for a broken message, a client not reading or a socket error, or not accepted for an error
+    METRIC_RATE_LIMIT_SLIPPED,  // queries over the rate limit of their client answered with an empty truncated reply
+    METRIC_RATE_LIMIT_DROPPED,  // queries over the rate limit of their client dropped
+    METRIC_COUNTER_COUNT,
+};
+
+enum metrics_stage {
+    STAGE_PARSE,        // mapping the query
+    STAGE_LOOKUP,       // deciding the answer: precompiled, zone, blocklist, cache - or relaying
+    STAGE_SERIALIZE,    // writing the answers built from the zone records
+    STAGE_SEND,         // one sendmmsg of a batch (one sendto on windows)
+    STAGE_UPSTREAM,     // from relaying a query to the upstream answer
+    STAGE_COUNT,
+};
+
+typedef struct metrics_histogram {
+    _Atomic uint64_t buckets[METRICS_BUCKETS];
+    _Atomic uint64_t sum_ns;
+} metrics_histogram_t;
+
+typedef struct metrics_shard {
+    _Atomic uint64_t counters[METRIC_COUNTER_COUNT];
+    metrics_histogram_t stages[STAGE_COUNT];
+} metrics_shard_t;
+
+// only the owner of the shard writes to it
+static inline void metrics_add(metrics_shard_t* shard, enum metrics_counter counter, uint64_t n)
+{
+    _Atomic uint64_t* value = &shard->counters[counter];
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static inline unsigned int metrics_bucket(uint64_t ns)
+{
+    if (ns < METRICS_SUB_BUCKETS)
+        return (unsigned int)ns;
+
+    unsigned int exponent = 63 - __builtin_clzll(ns);
+    if (exponent > METRICS_MAX_EXPONENT)
+        return METRICS_BUCKETS - 1;
+
+    // the power of two picks the group, the bits right below the leading one the bucket in it
+    unsigned int group = exponent - METRICS_SUB_BUCKET_BITS + 1;
+    return group * METRICS_SUB_BUCKETS + (unsigned int)((ns >> (exponent - METRICS_SUB_BUCKET_BITS)) & (METRICS_SUB_BUCKETS - 1));
+}
+
+// the first value of the next bucket
+static inline uint64_t metrics_bucket_end(unsigned int bucket)
+{
+    if (bucket < METRICS_SUB_BUCKETS)
+        return bucket + 1;
+
+    unsigned int group = bucket / METRICS_SUB_BUCKETS;
+    uint64_t sub_bucket = bucket % METRICS_SUB_BUCKETS;
+    return (METRICS_SUB_BUCKETS + sub_bucket + 1) << (group - 1);
+}
+
+static inline void metrics_record(metrics_shard_t* shard, enum metrics_stage stage, uint64_t ns)
+{
+    metrics_histogram_t* histogram = &shard->stages[stage];
+    _Atomic uint64_t* bucket = &histogram->buckets[metrics_bucket(ns)];
+
+    atomic_store_explicit(bucket, atomic_load_explicit(bucket, memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_store_explicit(&histogram->sum_ns, atomic_load_explicit(&histogram->sum_ns, memory_order_relaxed) + ns, memory_order_relaxed);
+}
+
+int write_metrics(const metrics_shard_t* const* shards, unsigned int shard_count, char* out, size_t size);
+
+#endif // _METRICS_H_
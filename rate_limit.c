@@ -0,0 +1,116 @@
+// ===================================================================================  //
+//    This program is free software: you can redistribute it and/or modify              //
+//    it under the terms of the GNU General Public License as published by              //
+//    the Free Software Foundation, either version 3 of the License, or                 //
+//    (at your option) any later version.                                               //
+//                                                                                      //
+//    This program is distributed in the hope that it will be useful,                   //
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of                    //
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                     //
+//    GNU General Public License for more details.                                      //
+//                                                                                      //
+//    You should have received a copy of the GNU General Public License                 //
+//    along with this program.  If not, see <https://www.gnu.org/licenses/>.            //
+//                                                                                      //
+//    Copyright: Luiz Gustavo Pfitscher e Feldmann, 2020                                //
+// ===================================================================================  //
+
+#include "rate_limit.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+rate_limiter_t* rate_limit_create(uint32_t rate, unsigned int prefix_length, uint32_t slip, uint64_t seed)
+{
+    rate_limiter_t* limiter = (rate_limiter_t*)calloc(1, sizeof(rate_limiter_t));
+    if (limiter == NULL)
+        return NULL;
+
+    limiter->mask = (prefix_length == 0) ? 0 : 0xFFFFFFFFu << (32 - min(prefix_length, 32));
+    limiter->rate = rate;
+    limiter->burst = rate * RATE_LIMIT_COST;
+    limiter->slip = slip;
+    limiter->seed = (uint32_t)(seed ^ (seed >> 32));
+
+    return limiter;
+}
+
+void rate_limit_free(rate_limiter_t* limiter)
+{
+    free(limiter);
+}
+
+// charges the client for a response - tells whether it gets one
+rate_limit_action_t rate_limit_check(rate_limiter_t* limiter, const struct sockaddr_in* client, uint64_t now_ms)
+{
+    uint32_t prefix = ntohl(client->sin_addr.s_addr) & limiter->mask;
+    uint32_t now = (uint32_t)now_ms;
+
+    // multiplicative hash - the top bits are the best mixed
+    uint32_t set = (uint32_t)(((uint64_t)(prefix ^ limiter->seed) * 0x9E3779B97F4A7C15ull) >> (64 - RATE_LIMIT_SET_BITS));
+    rate_limit_entry_t* ways = &limiter->entries[set * RATE_LIMIT_WAYS];
+    rate_limit_entry_t* entry = NULL;
+    rate_limit_entry_t* victim = &ways[0];
+
+    for (unsigned int w = 0; w < RATE_LIMIT_WAYS; w++)
+    {
+        if (ways[w].in_use && ways[w].prefix == prefix)
+        {
+            entry = &ways[w];
+            break;
+        }
+
+        // a free entry, or else the one seen the longest ago
+        if (victim->in_use && (!ways[w].in_use || now - ways[w].seen_ms > now - victim->seen_ms))
+            victim = &ways[w];
+    }
+
+    if (entry == NULL)
+    {
+        if (victim->in_use)
+            limiter->stats.evicted++;
+
+        *victim = (rate_limit_entry_t){
+            .prefix = prefix,
+            .seen_ms = now,
+            .credit = limiter->burst - RATE_LIMIT_COST,
+            .in_use = 1,
+        };
+
+        limiter->stats.passed++;
+        return RATE_LIMIT_PASS;
+    }
+
+    // a second of silence fills the bucket - anything shorter adds the rate for each millisecond
+    uint32_t elapsed = now - entry->seen_ms;
+    uint64_t credit = (elapsed >= 1000) ? limiter->burst : entry->credit + (uint64_t)elapsed * limiter->rate;
+    entry->credit = (uint32_t)min(credit, limiter->burst);
+    entry->seen_ms = now;
+
+    if (entry->credit >= RATE_LIMIT_COST)
+    {
+        entry->credit -= RATE_LIMIT_COST;
+        entry->limited = 0;
+        limiter->stats.passed++;
+        return RATE_LIMIT_PASS;
+    }
+
+    // every slip-th limited query slips
+    if (limiter->slip && ++entry->limited >= limiter->slip)
+    {
+        entry->limited = 0;
+        limiter->stats.slipped++;
+        return RATE_LIMIT_SLIP;
+    }
+
+    limiter->stats.dropped++;
+    return RATE_LIMIT_DROP;
+}
+
+void print_rate_limit_stats(const rate_limit_stats_t* stats)
+{
+    printf("\nPassed: %llu\nSlipped: %llu\nDropped: %llu\nEvicted: %llu",
+           (unsigned long long)stats->passed,
+           (unsigned long long)stats->slipped,
+           (unsigned long long)stats->dropped,
+           (unsigned long long)stats->evicted);
+}
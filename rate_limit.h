@@ -0,0 +1,72 @@
+// ===================================================================================  //
+//    This program is free software: you can redistribute it and/or modify              //
+//    it under the terms of the GNU General Public License as published by              //
+//    the Free Software Foundation, either version 3 of the License, or                 //
+//    (at your option) any later version.                                               //
+//                                                                                      //
+//    This program is distributed in the hope that it will be useful,                   //
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of                    //
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                     //
+//    GNU General Public License for more details.                                      //
+//                                                                                      //
+//    You should have received a copy of the GNU General Public License                 //
+//    along with this program.  If not, see <https://www.gnu.org/licenses/>.            //
+//                                                                                      //
+//    Copyright: Luiz Gustavo Pfitscher e Feldmann, 2020                                //
+// ===================================================================================  //
+
+#ifndef _RATE_LIMIT_H_
+#define _RATE_LIMIT_H_
+
+#include "socket_compat.h"
+#include <stdint.h>
+
+// Response rate limiting: every client prefix (the address with the low bits masked off) gets a token bucket
+// filled at the rate and holding up to one second of it. A query the bucket cannot pay for is dropped, except
+// one in every `slip` which gets an empty truncated reply - a real client behind a spoofed flood can still get
+// its answer over TCP, while the flood is not reflected at the spoofed address.
+// The buckets live in one fixed table of small sets (a cache line each): a prefix can only be in the set its
+// hash picks, and a new one takes the place of the entry seen the longest ago. Nothing is allocated per client.
+
+#define RATE_LIMIT_WAYS 4       // entries per set
+#define RATE_LIMIT_SET_BITS 12
+#define RATE_LIMIT_SETS (1 << RATE_LIMIT_SET_BITS) // 16384 prefixes per table
+#define RATE_LIMIT_COST 1000    // credit of one response - the credit grows by the rate every millisecond
+
+typedef enum rate_limit_action {
+    RATE_LIMIT_PASS,
+    RATE_LIMIT_SLIP,            // answer with an empty truncated reply
+    RATE_LIMIT_DROP,
+} rate_limit_action_t;
+
+typedef struct rate_limit_entry {
+    uint32_t prefix;            // the masked address, in host order
+    uint32_t seen_ms;           // when it last sent a query - wraps around, only differences are used
+    uint32_t credit;            // responses it may still get, in RATE_LIMIT_COST units
+    uint16_t limited;           // queries limited since the last one that slipped
+    uint8_t in_use;
+} rate_limit_entry_t;
+
+typedef struct rate_limit_stats {
+    uint64_t passed;
+    uint64_t slipped;
+    uint64_t dropped;
+    uint64_t evicted;           // prefixes that lost their entry to a new one
+} rate_limit_stats_t;
+
+typedef struct rate_limiter {
+    rate_limit_entry_t entries[RATE_LIMIT_SETS * RATE_LIMIT_WAYS];
+    uint32_t mask;              // of the prefix
+    uint32_t rate;              // responses per second
+    uint32_t burst;             // most credit a prefix can save up
+    uint32_t slip;              // one in this many limited queries slips - 0 drops them all
+    uint32_t seed;              // of the set hash, so nobody can pick the prefixes that share a set
+    rate_limit_stats_t stats;
+} rate_limiter_t;
+
+rate_limiter_t* rate_limit_create(uint32_t rate, unsigned int prefix_length, uint32_t slip, uint64_t seed);
+void rate_limit_free(rate_limiter_t* limiter);
+rate_limit_action_t rate_limit_check(rate_limiter_t* limiter, const struct sockaddr_in* client, uint64_t now_ms);
+void print_rate_limit_stats(const rate_limit_stats_t* stats);
+
+#endif // _RATE_LIMIT_H_
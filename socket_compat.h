@@ -0,0 +1,78 @@
+// ===================================================================================  //
+//    This program is free software: you can redistribute it and/or modify              //
+//    it under the terms of the GNU General Public License as published by              //
+//    the Free Software Foundation, either version 3 of the License, or                 //
+//    (at your option) any later version.                                               //
+//                                                                                      //
+//    This program is distributed in the hope that it will be useful,                   //
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of                    //
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                     //
+//    GNU General Public License for more details.                                      //
+//                                                                                      //
+//    You should have received a copy of the GNU General Public License                 //
+//    along with this program.  If not, see <https://www.gnu.org/licenses/>.            //
+//                                                                                      //
+//    Copyright: Luiz Gustavo Pfitscher e Feldmann, 2020                                //
+// ===================================================================================  //
+
+#ifndef _SOCKET_COMPAT_H_
+#define _SOCKET_COMPAT_H_
+
+// Maps the few winsock names used across the project onto POSIX sockets
+// so the protocol and zone code builds unchanged on both platforms
+
+#ifdef _WIN32
+    #include <winsock2.h>
+    #include <ws2tcpip.h>
+#else
+    #include <sys/types.h>
+    #include <sys/socket.h>
+    #include <sys/ioctl.h>
+    #include <netinet/in.h>
+    #include <arpa/inet.h>
+    #include <unistd.h>
+    #include <errno.h>
+
+    typedef int SOCKET;
+    typedef struct sockaddr SOCKADDR;
+
+    #define INVALID_SOCKET      (-1)
+    #define SOCKET_ERROR        (-1)
+    #define NO_ERROR            0
+    #define ADDR_ANY            INADDR_ANY
+    #define closesocket(s)      close(s)
+    #define WSAGetLastError()   errno
+
+    #ifndef min
+    #define min(a, b) (((a) < (b)) ? (a) : (b))
+    #endif
+
+    #ifndef max
+    #define max(a, b) (((a) > (b)) ? (a) : (b))
+    #endif
+#endif
+
+// switches the socket to non-blocking mode
+static inline int set_socket_nonblocking(SOCKET sock)
+{
+    #ifdef _WIN32
+    u_long nonBlockingMode = 1;
+    return ioctlsocket(sock, FIONBIO, &nonBlockingMode);
+    #else
+    int nonBlockingMode = 1;
+    return ioctl(sock, FIONBIO, &nonBlockingMode);
+    #endif
+}
+
+// sets an integer (boolean) socket option
+static inline int set_socket_flag(SOCKET sock, int level, int option, int value)
+{
+    #ifdef _WIN32
+    const char flag = (char)value;
+    return setsockopt(sock, level, option, &flag, sizeof(flag));
+    #else
+    return setsockopt(sock, level, option, &value, sizeof(value));
+    #endif
+}
+
+#endif // _SOCKET_COMPAT_H_
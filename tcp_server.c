@@ -0,0 +1,425 @@
+// ===================================================================================  //
+//    This program is free software: you can redistribute it and/or modify              //
+//    it under the terms of the GNU General Public License as published by              //
+//    the Free Software Foundation, either version 3 of the License, or                 //
+//    (at your option) any later version.                                               //
+//                                                                                      //
+//    This program is distributed in the hope that it will be useful,                   //
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of                    //
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                     //
+//    GNU General Public License for more details.                                      //
+//                                                                                      //
+//    You should have received a copy of the GNU General Public License                 //
+//    along with this program.  If not, see <https://www.gnu.org/licenses/>.            //
+//                                                                                      //
+//    Copyright: Luiz Gustavo Pfitscher e Feldmann, 2020                                //
+// ===================================================================================  //
+
+#include "tcp_server.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+    #include <netinet/tcp.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+    #define MSG_NOSIGNAL 0 // windows never raises SIGPIPE
+#endif
+
+#define TCP_MIN_OUTPUT 4096 // first allocation of the replies buffer
+
+static int would_block(void)
+{
+    #ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+    #else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    #endif
+}
+
+// a connection that went away while in the backlog - the next one may be fine
+static int accept_aborted(void)
+{
+    #ifdef _WIN32
+    return WSAGetLastError() == WSAECONNRESET;
+    #else
+    return errno == ECONNABORTED || errno == EPROTO;
+    #endif
+}
+
+int tcp_server_init(tcp_server_t* server, SOCKET listener, unsigned int capacity, uint32_t idle_timeout_ms)
+{
+    capacity = min(capacity, TCP_MAX_CONNECTIONS);
+
+    *server = (tcp_server_t){
+        .listener = listener,
+        .connections = (tcp_connection_t*)calloc(max(capacity, 1), sizeof(tcp_connection_t)),
+        .capacity = capacity,
+        .free_slots = (uint32_t*)malloc(max(capacity, 1) * sizeof(uint32_t)),
+        .dirty = (uint32_t*)malloc(max(capacity, 1) * sizeof(uint32_t)),
+        .idle_timeout_ms = idle_timeout_ms,
+    };
+
+    if (!server->connections || !server->free_slots || !server->dirty)
+        return -1;
+
+    // the lowest slots are handed out first
+    for (unsigned int i = 0; i < capacity; i++)
+    {
+        server->connections[i].sock = INVALID_SOCKET;
+        server->free_slots[server->free_count++] = capacity - 1 - i;
+    }
+
+    return 0;
+}
+
+static void close_connection(tcp_server_t* server, tcp_connection_t* connection)
+{
+    closesocket(connection->sock);
+    free(connection->out);
+
+    connection->sock = INVALID_SOCKET;
+    connection->out = NULL;
+    connection->out_capacity = 0;
+    connection->in_use = 0;
+
+    server->free_slots[server->free_count++] = (uint32_t)(connection - server->connections);
+    server->stats.open--;
+}
+
+void tcp_server_free(tcp_server_t* server)
+{
+    for (unsigned int i = 0; server->connections && i < server->capacity; i++)
+    {
+        if (server->connections[i].in_use)
+            close_connection(server, &server->connections[i]);
+    }
+
+    if (server->listener != INVALID_SOCKET)
+        closesocket(server->listener);
+
+    free(server->connections);
+    free(server->free_slots);
+    free(server->dirty);
+
+    tcp_stats_t stats = server->stats;
+    *server = (tcp_server_t){ .listener = INVALID_SOCKET, .stats = stats };
+}
+
+// takes a connection off the listener backlog - returns -1 if there is none, or -2 if accept failed (out of
+// descriptors or memory...): the listener stays readable then, so it is paused until a connection closes or
+// TCP_ACCEPT_BACKOFF_MS pass. *accepted is the new connection, or NULL if every slot is taken (the connection
+// is closed right away, so the client tries elsewhere or later)
+int tcp_accept(tcp_server_t* server, uint64_t now_ms, tcp_connection_t** accepted)
+{
+    struct sockaddr_in peer;
+    socklen_t peer_length = sizeof(peer);
+
+    *accepted = NULL;
+
+    SOCKET sock = accept(server->listener, (SOCKADDR*)&peer, &peer_length);
+    if (sock == INVALID_SOCKET && (would_block() || accept_aborted()))
+        return -1;
+
+    if (sock == INVALID_SOCKET)
+    {
+        server->accept_paused_until_ms = now_ms + TCP_ACCEPT_BACKOFF_MS;
+        server->open_when_paused = server->stats.open;
+        server->stats.accept_errors++;
+        return -2;
+    }
+
+    if (server->free_count == 0 || set_socket_nonblocking(sock) != NO_ERROR)
+    {
+        closesocket(sock);
+        server->stats.refused++;
+        return 0;
+    }
+
+    // the replies are written whole, one flush at a time - no point holding them back
+    set_socket_flag(sock, IPPROTO_TCP, TCP_NODELAY, 1);
+
+    tcp_connection_t* connection = &server->connections[server->free_slots[--server->free_count]];
+    uint8_t dirty = connection->dirty; // may still be listed from a connection closed in this slot
+
+    *connection = (tcp_connection_t){
+        .sock = sock,
+        .peer = peer,
+        .last_active_ms = now_ms,
+        .generation = (uint16_t)(connection->generation + 1),
+        .in_use = 1,
+        .dirty = dirty,
+    };
+
+    server->stats.accepted++;
+    if (++server->stats.open > server->stats.peak_open)
+        server->stats.peak_open = server->stats.open;
+
+    *accepted = connection;
+    return 0;
+}
+
+void tcp_schedule_flush(tcp_server_t* server, tcp_connection_t* connection)
+{
+    if (connection->dirty)
+        return;
+
+    connection->dirty = 1;
+    server->dirty[server->dirty_count++] = (uint32_t)(connection - server->connections);
+}
+
+// reads what the client sent into the space left after the queries not taken yet - returns the bytes read,
+// or 0 if there is nothing to read now (the client may also have stopped sending or the connection failed)
+int tcp_read(tcp_server_t* server, tcp_connection_t* connection, uint64_t now_ms)
+{
+    if (connection->read_closed || connection->failed)
+        return 0;
+
+    if (connection->in_consumed > 0)
+    {
+        connection->in_length -= connection->in_consumed;
+        memmove(connection->in, connection->in + connection->in_consumed, connection->in_length);
+        connection->in_consumed = 0;
+    }
+
+    int space = (int)(sizeof(connection->in) - connection->in_length);
+    if (space == 0)
+        return 0;
+
+    int received = recv(connection->sock, connection->in + connection->in_length, space, 0);
+
+    if (received > 0)
+    {
+        connection->in_length += received;
+        connection->last_active_ms = now_ms;
+        return received;
+    }
+
+    if (received == 0)
+        connection->read_closed = 1; // closed once the answers it waits for are out
+    else if (!would_block())
+        connection->failed = 1;
+
+    if (connection->read_closed || connection->failed)
+        tcp_schedule_flush(server, connection);
+
+    return 0;
+}
+
+// the next whole query received - returns its length, or 0 if there is none yet. A query of zero bytes
+// or longer than TCP_MAX_QUERY fails the connection. The query is valid until the next tcp_read.
+int tcp_next_query(tcp_server_t* server, tcp_connection_t* connection, const char** query)
+{
+    uint32_t available = connection->in_length - connection->in_consumed;
+    const uint8_t* message = (const uint8_t*)connection->in + connection->in_consumed;
+
+    if (connection->failed || available < 2)
+        return 0;
+
+    uint32_t length = ((uint32_t)message[0] << 8) | message[1];
+    if (length == 0 || length > TCP_MAX_QUERY)
+    {
+        connection->failed = 1;
+        tcp_schedule_flush(server, connection);
+        return 0;
+    }
+
+    if (available < 2 + length)
+        return 0;
+
+    *query = (const char*)message + 2;
+    connection->in_consumed += 2 + length;
+
+    return (int)length;
+}
+
+// writes as much of the queued replies as the socket takes
+static void write_replies(tcp_connection_t* connection)
+{
+    while (!connection->failed && connection->out_sent < connection->out_length)
+    {
+        int sent = send(connection->sock, connection->out + connection->out_sent, connection->out_length - connection->out_sent, MSG_NOSIGNAL);
+
+        if (sent > 0)
+            connection->out_sent += sent;
+        else if (sent < 0 && would_block())
+            return;
+        else
+            connection->failed = 1;
+    }
+
+    connection->out_sent = connection->out_length = 0;
+}
+
+// queues the reply behind its length - returns -1 (and fails the connection) if the client leaves too many replies unread
+int tcp_queue_reply(tcp_server_t* server, tcp_connection_t* connection, const char* reply, int length, uint64_t now_ms)
+{
+    if (connection->failed || length <= 0 || length > 65535)
+        return -1;
+
+    uint32_t needed = connection->out_length + 2 + length;
+
+    if (needed - connection->out_sent > TCP_MAX_OUTPUT)
+    {
+        connection->failed = 1;
+        tcp_schedule_flush(server, connection);
+        return -1;
+    }
+
+    if (needed > connection->out_capacity)
+    {
+        // what was sent already makes room first
+        if (connection->out_sent > 0)
+        {
+            connection->out_length -= connection->out_sent;
+            memmove(connection->out, connection->out + connection->out_sent, connection->out_length);
+            connection->out_sent = 0;
+            needed = connection->out_length + 2 + length;
+        }
+
+        if (needed > connection->out_capacity)
+        {
+            uint32_t capacity = max(max(connection->out_capacity * 2, needed), TCP_MIN_OUTPUT);
+            char* out = (char*)realloc(connection->out, capacity);
+            if (out == NULL)
+            {
+                connection->failed = 1;
+                tcp_schedule_flush(server, connection);
+                return -1;
+            }
+
+            connection->out = out;
+            connection->out_capacity = capacity;
+        }
+    }
+
+    uint8_t* position = (uint8_t*)connection->out + connection->out_length;
+    position[0] = (uint8_t)(length >> 8);
+    position[1] = (uint8_t)length;
+    memcpy(position + 2, reply, length);
+
+    connection->out_length = needed;
+    connection->last_active_ms = now_ms;
+
+    if (connection->out_length - connection->out_sent >= TCP_WRITE_BATCH)
+        write_replies(connection);
+
+    tcp_schedule_flush(server, connection);
+    return 0;
+}
+
+// writes the queued replies of the connections that have some, and closes the failed ones and the ones done.
+// Returns how many were closed failed.
+unsigned int tcp_flush(tcp_server_t* server)
+{
+    unsigned int failed = 0;
+
+    for (unsigned int i = 0; i < server->dirty_count; i++)
+    {
+        tcp_connection_t* connection = &server->connections[server->dirty[i]];
+
+        connection->dirty = 0;
+        if (!connection->in_use)
+            continue;
+
+        write_replies(connection);
+
+        if (connection->failed)
+        {
+            close_connection(server, connection);
+            failed++;
+        }
+        else if (connection->read_closed && connection->pending == 0 && connection->out_sent == connection->out_length)
+            close_connection(server, connection);
+    }
+
+    server->dirty_count = 0;
+    server->stats.failed += failed;
+
+    return failed;
+}
+
+// closes the connections without a query for the idle timeout and without answers pending - checked a few times
+// per timeout so it costs nothing per packet. Returns how many were closed.
+unsigned int tcp_expire_idle(tcp_server_t* server, uint64_t now_ms)
+{
+    unsigned int closed = 0;
+
+    if (now_ms < server->next_idle_check_ms || server->stats.open == 0)
+        return 0;
+
+    server->next_idle_check_ms = now_ms + min(server->idle_timeout_ms / 4 + 1, 1000);
+
+    for (unsigned int i = 0; i < server->capacity; i++)
+    {
+        tcp_connection_t* connection = &server->connections[i];
+
+        if (connection->in_use && connection->pending == 0 && connection->last_active_ms + server->idle_timeout_ms <= now_ms)
+        {
+            close_connection(server, connection);
+            closed++;
+        }
+    }
+
+    server->stats.idle_closed += closed;
+    return closed;
+}
+
+// lifts the pause of the listener once a connection closed or the backoff is over - returns 1 if it was lifted now
+int tcp_resume_accept(tcp_server_t* server, uint64_t now_ms)
+{
+    if (server->accept_paused_until_ms == 0 || (now_ms < server->accept_paused_until_ms && server->stats.open >= server->open_when_paused))
+        return 0;
+
+    server->accept_paused_until_ms = 0;
+    return 1;
+}
+
+// milliseconds until the next idle check or the end of the listener pause, or -1 (forever) if there is neither
+int tcp_next_deadline(const tcp_server_t* server, uint64_t now_ms)
+{
+    uint64_t deadline = UINT64_MAX;
+
+    if (server->stats.open > 0)
+        deadline = server->next_idle_check_ms;
+
+    if (server->accept_paused_until_ms != 0)
+        deadline = min(deadline, server->accept_paused_until_ms);
+
+    if (deadline == UINT64_MAX)
+        return -1;
+
+    return (deadline <= now_ms) ? 0 : (int)min(deadline - now_ms, (uint64_t)INT32_MAX);
+}
+
+// a number that stays with the connection - a later connection in the same slot gets another one. Never 0.
+uint32_t tcp_connection_id(const tcp_server_t* server, const tcp_connection_t* connection)
+{
+    return ((uint32_t)connection->generation << 16) | (uint32_t)(connection - server->connections + 1);
+}
+
+// the connection with that id, or NULL if it was closed since
+tcp_connection_t* tcp_find(tcp_server_t* server, uint32_t id)
+{
+    uint32_t slot = (id & 0xFFFF) - 1;
+
+    if (id == 0 || slot >= server->capacity)
+        return NULL;
+
+    tcp_connection_t* connection = &server->connections[slot];
+    return (connection->in_use && connection->generation == (id >> 16)) ? connection : NULL;
+}
+
+void print_tcp_stats(const tcp_stats_t* stats)
+{
+    printf("\nAccepted: %llu\nRefused (all slots taken): %llu\nAccept errors: %llu\nClosed idle: %llu\nClosed failed: %llu\nOpen: %u (peak %u)",
+           (unsigned long long)stats->accepted,
+           (unsigned long long)stats->refused,
+           (unsigned long long)stats->accept_errors,
+           (unsigned long long)stats->idle_closed,
+           (unsigned long long)stats->failed,
+           stats->open,
+           stats->peak_open);
+}
@@ -0,0 +1,100 @@
+// ===================================================================================  //
+//    This program is free software: you can redistribute it and/or modify              //
+//    it under the terms of the GNU General Public License as published by              //
+//    the Free Software Foundation, either version 3 of the License, or                 //
+//    (at your option) any later version.                                               //
+//                                                                                      //
+//    This program is distributed in the hope that it will be useful,                   //
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of                    //
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                     //
+//    GNU General Public License for more details.                                      //
+//                                                                                      //
+//    You should have received a copy of the GNU General Public License                 //
+//    along with this program.  If not, see <https://www.gnu.org/licenses/>.            //
+//                                                                                      //
+//    Copyright: Luiz Gustavo Pfitscher e Feldmann, 2020                                //
+// ===================================================================================  //
+
+#ifndef _TCP_SERVER_H_
+#define _TCP_SERVER_H_
+
+#include "socket_compat.h"
+#include <stdint.h>
+
+// DNS over TCP (RFC 7766): every message is preceded by its length in two bytes. A connection may carry
+// many queries one after the other without waiting for the answers (pipelining), and the answers go back
+// in the order they are ready - the relayed ones whenever the upstream answers.
+//
+// Each worker has a table of connections, all non-blocking. The replies are queued in the connection and
+// written out together once the worker is done with the packets it read (or sooner when many pile up).
+// A connection stops being read while TCP_MAX_PIPELINED of its queries wait for the upstream, and is closed
+// when idle or when its client stops reading the replies. Connections are only ever closed by the flush and
+// the idle check, so a connection handed out stays valid while the packets are being handled.
+
+#define TCP_MAX_QUERY 1024              // longer queries close the connection
+#define TCP_MAX_PIPELINED 64            // relayed queries of one connection waiting for the upstream
+#define TCP_WRITE_BATCH 16384           // queued reply bytes written out without waiting for the flush
+#define TCP_MAX_OUTPUT (256 * 1024)     // replies queued for a client that does not read them
+#define TCP_MAX_CONNECTIONS 65535       // per worker - the connection IDs have 16 bits for the slot
+#define TCP_ACCEPT_BACKOFF_MS 1000      // the listener is left alone this long after accept fails (out of descriptors...)
+
+typedef struct tcp_connection {
+    SOCKET sock;
+    struct sockaddr_in peer;
+    uint64_t last_active_ms;    // last query received or reply queued
+    uint16_t generation;        // tells this connection from the earlier ones in the same slot
+    uint16_t pending;           // relayed queries waiting for the upstream - kept by the caller
+    uint8_t in_use;
+    uint8_t read_closed;        // the client is done sending - closed once its answers are out
+    uint8_t failed;             // broken message, client not reading or socket error - closed on the next flush
+    uint8_t dirty;              // on the list of connections to flush
+    uint32_t in_length;         // bytes received
+    uint32_t in_consumed;       // of which already taken as queries
+    char in[2 + TCP_MAX_QUERY];
+    char* out;                  // replies, sent up to out_sent
+    uint32_t out_length;
+    uint32_t out_sent;
+    uint32_t out_capacity;
+} tcp_connection_t;
+
+typedef struct tcp_stats {
+    uint64_t accepted;
+    uint64_t refused;           // closed right away because every slot was taken
+    uint64_t idle_closed;
+    uint64_t failed;            // closed for a broken message, a client not reading or a socket error
+    uint64_t accept_errors;     // accept failures other than an empty backlog - each pauses the listener
+    uint32_t open;
+    uint32_t peak_open;
+} tcp_stats_t;
+
+typedef struct tcp_server {
+    SOCKET listener;
+    tcp_connection_t* connections;
+    unsigned int capacity;
+    uint32_t* free_slots;
+    unsigned int free_count;
+    uint32_t* dirty;            // slots to flush - a slot closed meanwhile stays listed until the flush
+    unsigned int dirty_count;
+    uint32_t idle_timeout_ms;
+    uint64_t next_idle_check_ms;
+    uint64_t accept_paused_until_ms; // 0 while accepting - else the listener waits for this or for a connection to close
+    uint32_t open_when_paused;
+    tcp_stats_t stats;
+} tcp_server_t;
+
+int tcp_server_init(tcp_server_t* server, SOCKET listener, unsigned int capacity, uint32_t idle_timeout_ms);
+void tcp_server_free(tcp_server_t* server);
+int tcp_accept(tcp_server_t* server, uint64_t now_ms, tcp_connection_t** accepted);
+int tcp_resume_accept(tcp_server_t* server, uint64_t now_ms);
+int tcp_read(tcp_server_t* server, tcp_connection_t* connection, uint64_t now_ms);
+int tcp_next_query(tcp_server_t* server, tcp_connection_t* connection, const char** query);
+int tcp_queue_reply(tcp_server_t* server, tcp_connection_t* connection, const char* reply, int length, uint64_t now_ms);
+void tcp_schedule_flush(tcp_server_t* server, tcp_connection_t* connection);
+unsigned int tcp_flush(tcp_server_t* server);
+unsigned int tcp_expire_idle(tcp_server_t* server, uint64_t now_ms);
+int tcp_next_deadline(const tcp_server_t* server, uint64_t now_ms);
+uint32_t tcp_connection_id(const tcp_server_t* server, const tcp_connection_t* connection);
+tcp_connection_t* tcp_find(tcp_server_t* server, uint32_t id);
+void print_tcp_stats(const tcp_stats_t* stats);
+
+#endif // _TCP_SERVER_H_
@@ -0,0 +1,305 @@
+// ===================================================================================  //
+//    This program is free software: you can redistribute it and/or modify              //
+//    it under the terms of the GNU General Public License as published by              //
+//    the Free Software Foundation, either version 3 of the License, or                 //
+//    (at your option) any later version.                                               //
+//                                                                                      //
+//    This program is distributed in the hope that it will be useful,                   //
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of                    //
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                     //
+//    GNU General Public License for more details.                                      //
+//                                                                                      //
+//    You should have received a copy of the GNU General Public License                 //
+//    along with this program.  If not, see <https://www.gnu.org/licenses/>.            //
+//                                                                                      //
+//    Copyright: Luiz Gustavo Pfitscher e Feldmann, 2020                                //
+// ===================================================================================  //
+#include "upstream.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void upstream_init(upstream_set_t* set, const struct sockaddr_in* addresses, unsigned int count)
+{
+    memset(set, 0, sizeof(*set));
+    set->count = min(count, MAX_UPSTREAMS);
+
+    for (unsigned int i = 0; i < set->count; i++)
+        set->upstreams[i].address = addresses[i];
+}
+
+// returns the upstream for a query (or its hedge if exclude is the upstream the query went to), -1 if there is none
+int upstream_select(upstream_set_t* set, int exclude, uint64_t now_ms)
+{
+    int best = -1;
+    int least_down = -1;
+
+    for (unsigned int i = 0; i < set->count; i++)
+    {
+        upstream_t* upstream = &set->upstreams[i];
+
+        if ((int)i == exclude)
+            continue;
+
+        if (upstream->failure_rate >= UPSTREAM_DOWN_RATE)
+        {
+            // a query now and then finds out whether it is back
+            if (exclude < 0 && now_ms >= upstream->next_probe_ms)
+            {
+                upstream->next_probe_ms = now_ms + UPSTREAM_PROBE_INTERVAL_MS;
+                return i;
+            }
+
+            if (least_down < 0 || upstream->failure_rate < set->upstreams[least_down].failure_rate)
+                least_down = i;
+            continue;
+        }
+
+        if (best < 0 || upstream->score_us < set->upstreams[best].score_us)
+            best = i;
+    }
+
+    // with every upstream down the queries still go to the one losing the fewest - a hedge would not help
+    if (best < 0)
+        return exclude < 0 ? least_down : -1;
+
+    if (exclude < 0)
+    {
+        for (unsigned int i = 0; i < set->count; i++)
+        {
+            upstream_t* upstream = &set->upstreams[i];
+            if ((int)i != best && upstream->failure_rate < UPSTREAM_DOWN_RATE)
+                upstream->score_us -= upstream->score_us >> UPSTREAM_SRTT_DECAY_SHIFT;
+        }
+    }
+
+    set->upstreams[best].score_us = set->upstreams[best].srtt_us;
+
+    return best;
+}
+
+static void update_rtt(upstream_t* upstream, uint32_t rtt_us)
+{
+    if (upstream->srtt_us == 0)
+        upstream->srtt_us = max(rtt_us, 1);
+    else
+        upstream->srtt_us = max(upstream->srtt_us - (upstream->srtt_us >> 3) + (rtt_us >> 3), 1);
+
+    upstream->score_us = upstream->srtt_us;
+}
+
+static void update_p95(upstream_t* upstream)
+{
+    uint64_t total = 0;
+    for (unsigned int b = 0; b < METRICS_BUCKETS; b++)
+        total += upstream->rtt_histogram[b];
+
+    uint64_t rank = total * 95 / 100;
+    uint64_t cumulative = 0;
+    unsigned int b = 0;
+
+    while (b < METRICS_BUCKETS - 1 && (cumulative += upstream->rtt_histogram[b]) <= rank)
+        b++;
+
+    upstream->p95_us = (uint32_t)min(metrics_bucket_end(b), UINT32_MAX);
+
+    if (total > UPSTREAM_HISTOGRAM_WINDOW)
+    {
+        for (unsigned int i = 0; i < METRICS_BUCKETS; i++)
+            upstream->rtt_histogram[i] /= 2;
+    }
+}
+
+// the upstream answered first after rtt_us
+void upstream_answered(upstream_set_t* set, unsigned int index, uint64_t rtt_us)
+{
+    upstream_t* upstream = &set->upstreams[index];
+    uint32_t rtt = (uint32_t)min(rtt_us, UINT32_MAX);
+
+    update_rtt(upstream, rtt);
+    upstream->rtt_histogram[metrics_bucket(rtt)]++;
+    upstream->stats.answered++;
+
+    // one answer is enough to take a down upstream back - a few more losses take it out again
+    if (upstream->failure_rate >= UPSTREAM_DOWN_RATE)
+        upstream->failure_rate = UPSTREAM_DOWN_RATE / 2;
+    else
+        upstream->failure_rate -= upstream->failure_rate >> 3;
+
+    if (++upstream->recent_answers >= UPSTREAM_P95_INTERVAL)
+    {
+        upstream->recent_answers = 0;
+        update_p95(upstream);
+    }
+}
+
+// the hedge answered first while the upstream had been waiting for waited_us - it takes at least that long now
+void upstream_outlasted(upstream_set_t* set, unsigned int index, uint64_t waited_us)
+{
+    upstream_t* upstream = &set->upstreams[index];
+
+    if (waited_us > upstream->srtt_us)
+        update_rtt(upstream, (uint32_t)min(waited_us, UINT32_MAX));
+}
+
+// a query sent to the upstream was never answered
+void upstream_failed(upstream_set_t* set, unsigned int index)
+{
+    upstream_t* upstream = &set->upstreams[index];
+
+    upstream->failure_rate += (65536 - upstream->failure_rate) >> 3;
+    upstream->stats.timeouts++;
+}
+
+void print_upstream_stats(const upstream_t* upstream)
+{
+    uint32_t ip = ntohl(upstream->address.sin_addr.s_addr);
+
+    printf("\n%u.%u.%u.%u:%u: sent %llu, answered %llu, timed out %llu, hedges %llu (won %llu), srtt %.2f ms, p95 %.2f ms, failure rate %.1f%%%s",
+           (ip >> 24) & 0xFF, (ip >> 16) & 0xFF, (ip >> 8) & 0xFF, ip & 0xFF, ntohs(upstream->address.sin_port),
+           (unsigned long long)upstream->stats.sent,
+           (unsigned long long)upstream->stats.answered,
+           (unsigned long long)upstream->stats.timeouts,
+           (unsigned long long)upstream->stats.hedges,
+           (unsigned long long)upstream->stats.hedge_wins,
+           upstream->srtt_us / 1e3,
+           upstream->p95_us / 1e3,
+           upstream->failure_rate * 100.0 / 65536,
+           upstream->failure_rate >= UPSTREAM_DOWN_RATE ? " (down)" : "");
+}
+
+// HEDGE QUEUE
+// ================================================================
+int hedge_queue_init(hedge_queue_t* queue)
+{
+    *queue = (hedge_queue_t){
+        .hedges = (hedge_t*)malloc(HEDGE_QUEUE_CAPACITY * sizeof(hedge_t)),
+        .heap = (uint16_t*)malloc(HEDGE_QUEUE_CAPACITY * sizeof(uint16_t)),
+        .free_hedges = (uint16_t*)malloc(HEDGE_QUEUE_CAPACITY * sizeof(uint16_t)),
+        .positions = (uint16_t*)calloc(HEDGE_SLOTS, sizeof(uint16_t)),
+    };
+
+    if (queue->hedges == NULL || queue->heap == NULL || queue->free_hedges == NULL || queue->positions == NULL)
+    {
+        hedge_queue_free(queue);
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < HEDGE_QUEUE_CAPACITY; i++)
+        queue->free_hedges[i] = (uint16_t)i;
+
+    return 0;
+}
+
+void hedge_queue_free(hedge_queue_t* queue)
+{
+    free(queue->hedges);
+    free(queue->heap);
+    free(queue->free_hedges);
+    free(queue->positions);
+    *queue = (hedge_queue_t){ 0 };
+}
+
+static uint64_t heap_due(const hedge_queue_t* queue, unsigned int position)
+{
+    return queue->hedges[queue->heap[position]].due_ns;
+}
+
+// puts the hedge at the heap position and records it under its slot
+static void heap_place(hedge_queue_t* queue, unsigned int position, uint16_t index)
+{
+    queue->heap[position] = index;
+    queue->positions[queue->hedges[index].slot] = (uint16_t)(position + 1);
+}
+
+static void heap_sift(hedge_queue_t* queue, unsigned int position)
+{
+    uint16_t index = queue->heap[position];
+    uint64_t due_ns = queue->hedges[index].due_ns;
+
+    // up while earlier than the parent...
+    while (position > 0 && heap_due(queue, (position - 1) / 2) > due_ns)
+    {
+        heap_place(queue, position, queue->heap[(position - 1) / 2]);
+        position = (position - 1) / 2;
+    }
+
+    // ...or down while later than the earliest child
+    for (;;)
+    {
+        unsigned int child = 2 * position + 1;
+        if (child >= queue->count)
+            break;
+
+        if (child + 1 < queue->count && heap_due(queue, child + 1) < heap_due(queue, child))
+            child++;
+
+        if (heap_due(queue, child) >= due_ns)
+            break;
+
+        heap_place(queue, position, queue->heap[child]);
+        position = child;
+    }
+
+    heap_place(queue, position, index);
+}
+
+static void heap_remove(hedge_queue_t* queue, unsigned int position)
+{
+    uint16_t index = queue->heap[position];
+
+    queue->positions[queue->hedges[index].slot] = 0;
+    queue->free_hedges[--queue->count] = index;
+
+    // the last hedge fills the hole
+    if (position < queue->count)
+    {
+        queue->heap[position] = queue->heap[queue->count];
+        heap_sift(queue, position);
+    }
+}
+
+// keeps a copy of the query to send it again at due_ns - returns -1 if it is not kept (queue full or query too large)
+int hedge_push(hedge_queue_t* queue, uint64_t due_ns, uint64_t relayed_ns, uint16_t slot, const char* query, int length)
+{
+    if (queue->hedges == NULL || length < 0 || length > HEDGE_QUERY_SIZE)
+        return -1;
+
+    // a slot has a single hedge - one left from an earlier query in it is stale
+    hedge_cancel(queue, slot);
+
+    if (queue->count == HEDGE_QUEUE_CAPACITY)
+        return -1;
+
+    uint16_t index = queue->free_hedges[queue->count++];
+    hedge_t* hedge = &queue->hedges[index];
+    hedge->due_ns = due_ns;
+    hedge->relayed_ns = relayed_ns;
+    hedge->slot = slot;
+    hedge->length = (uint16_t)length;
+    memcpy(hedge->query, query, length);
+
+    queue->heap[queue->count - 1] = index;
+    heap_sift(queue, queue->count - 1);
+
+    return 0;
+}
+
+// the hedge due first, or NULL if there is none
+const hedge_t* hedge_peek(const hedge_queue_t* queue)
+{
+    return queue->count ? &queue->hedges[queue->heap[0]] : NULL;
+}
+
+void hedge_pop(hedge_queue_t* queue)
+{
+    if (queue->count > 0)
+        heap_remove(queue, 0);
+}
+
+// drops the hedge of the query in the slot, if it has one - the query was answered or expired
+void hedge_cancel(hedge_queue_t* queue, uint16_t slot)
+{
+    if (queue->positions != NULL && queue->positions[slot] != 0)
+        heap_remove(queue, queue->positions[slot] - 1u);
+}
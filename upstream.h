@@ -0,0 +1,105 @@
+// ===================================================================================  //
+//    This program is free software: you can redistribute it and/or modify              //
+//    it under the terms of the GNU General Public License as published by              //
+//    the Free Software Foundation, either version 3 of the License, or                 //
+//    (at your option) any later version.                                               //
+//                                                                                      //
+//    This program is distributed in the hope that it will be useful,                   //
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of                    //
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                     //
+//    GNU General Public License for more details.                                      //
+//                                                                                      //
+//    You should have received a copy of the GNU General Public License                 //
+//    along with this program.  If not, see <https://www.gnu.org/licenses/>.            //
+//                                                                                      //
+//    Copyright: Luiz Gustavo Pfitscher e Feldmann, 2020                                //
+// ===================================================================================  //
+
+#ifndef _UPSTREAM_H_
+#define _UPSTREAM_H_
+
+#include "socket_compat.h"
+#include "metrics.h"
+#include <stdint.h>
+
+// Health and latency of the upstream servers the unanswered queries are relayed to, as seen by one worker.
+// Each upstream keeps a smoothed round trip (1/8 of each new one, as in RFC 6298) and a moving average of the queries it lost;
+// queries go to the healthy one with the lowest smoothed round trip. Like BIND, the upstreams passed over
+// look a little faster every time, so a slower one still gets a query now and then and its numbers stay current
+// - and only one: once picked it looks as slow as it was measured again.
+// An upstream losing most of its queries is down: it only gets a probe every UPSTREAM_PROBE_INTERVAL_MS.
+//
+// A query that takes longer than the p95 of its upstream can be hedged: the same query is sent to the
+// next best upstream and the first answer wins. The p95 comes from a histogram of the recent round trips.
+
+#define MAX_UPSTREAMS 8
+#define UPSTREAM_DOWN_RATE 32768            // failure rate (in 1/65536) from which an upstream is down
+#define UPSTREAM_PROBE_INTERVAL_MS 1000
+#define UPSTREAM_SRTT_DECAY_SHIFT 6         // an upstream passed over looks 1/64 faster
+#define UPSTREAM_P95_INTERVAL 64            // answers between two computations of the p95
+#define UPSTREAM_HISTOGRAM_WINDOW 2048      // the histogram is halved past this many answers so old ones fade
+
+#define HEDGE_QUEUE_CAPACITY 4096           // hedges waiting for their time - more queries are not hedged
+#define HEDGE_SLOTS 65536                   // slots of the inflight table a hedge can refer to
+#define HEDGE_QUERY_SIZE 512                // larger queries are not hedged
+
+typedef struct upstream_stats {
+    uint64_t sent;          // queries sent, hedges included
+    uint64_t answered;      // answers that came first for their query
+    uint64_t timeouts;      // queries never answered by anyone
+    uint64_t hedges;        // duplicates of queries slow on another upstream
+    uint64_t hedge_wins;    // hedges answered before the query they duplicated
+} upstream_stats_t;
+
+typedef struct upstream {
+    struct sockaddr_in address;
+    uint32_t srtt_us;           // 0 until the first answer - the untried upstreams go first
+    uint32_t score_us;          // srtt_us shrunk every time the upstream is passed over - what the selection compares
+    uint32_t failure_rate;      // share of the recent queries lost, in 1/65536
+    uint32_t p95_us;            // 0 until there are enough answers to know
+    uint32_t recent_answers;    // since the p95 was computed
+    uint64_t next_probe_ms;     // when a down upstream gets its next query
+    uint32_t rtt_histogram[METRICS_BUCKETS]; // recent round trips in us
+    upstream_stats_t stats;
+} upstream_t;
+
+typedef struct upstream_set {
+    upstream_t upstreams[MAX_UPSTREAMS];
+    unsigned int count;
+} upstream_set_t;
+
+// a query waiting to be hedged - identified by its slot and relay time
+typedef struct hedge {
+    uint64_t due_ns;
+    uint64_t relayed_ns;
+    uint16_t slot;              // of the query in the inflight table
+    uint16_t length;
+    char query[HEDGE_QUERY_SIZE];
+} hedge_t;
+
+// the hedges by due time - every upstream has its own delay, so they do not come due in the order they were
+// scheduled. A min-heap of indexes into the hedges, which stay where they were stored; the hedge of a query
+// answered or expired before its time is taken out right away so it does not hold a place until then
+typedef struct hedge_queue {
+    hedge_t* hedges;
+    uint16_t* heap;             // indexes of the hedges, the earliest due first
+    uint16_t* free_hedges;      // the free hedges are the indexes after count
+    uint16_t* positions;        // by inflight slot: 1 + the heap position of its hedge, 0 if it has none
+    unsigned int count;
+} hedge_queue_t;
+
+void upstream_init(upstream_set_t* set, const struct sockaddr_in* addresses, unsigned int count);
+int upstream_select(upstream_set_t* set, int exclude, uint64_t now_ms);
+void upstream_answered(upstream_set_t* set, unsigned int index, uint64_t rtt_us);
+void upstream_outlasted(upstream_set_t* set, unsigned int index, uint64_t waited_us);
+void upstream_failed(upstream_set_t* set, unsigned int index);
+void print_upstream_stats(const upstream_t* upstream);
+
+int hedge_queue_init(hedge_queue_t* queue);
+void hedge_queue_free(hedge_queue_t* queue);
+int hedge_push(hedge_queue_t* queue, uint64_t due_ns, uint64_t relayed_ns, uint16_t slot, const char* query, int length);
+const hedge_t* hedge_peek(const hedge_queue_t* queue);
+void hedge_pop(hedge_queue_t* queue);
+void hedge_cancel(hedge_queue_t* queue, uint16_t slot);
+
+#endif // _UPSTREAM_H_
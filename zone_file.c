@@ -16,277 +16,1480 @@
 // ===================================================================================  //
 
 #include "zone_file.h"
+#include "zone_image.h"
+#include "socket_compat.h"
+#include "logger.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <ctype.h>
 
-size_t getdelim(char **buf, size_t *bufsiz, int delimiter, FILE *fp)
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <pthread.h>
+#endif
+
+void completeName(const char* origin, char* name)
+{
+    if (strcmp(name, "@") == 0)
+        strcpy(name, origin);
+    else if (name[strlen(name) - 1] != '.')
+    {
+        strcat(name, ".");
+        strcat(name, origin);
+    }
+}
+
+// ZONE FILE PARSER
+// ================================================================
+// The file is mapped and parsed in place, line by line, with the same grammar as the sscanf patterns:
+//   $ORIGIN <name>
+//   $TTL <number><unit>
+//   <name> IN A <a>.<b>.<c>.<d>
+//   <name> IN NS <name>
+//   <name> IN CNAME <name>
+// Big files are split in chunks at line boundaries and parsed by one thread each. Since $ORIGIN and $TTL
+// apply to the lines after them, a first pass counts the records of every chunk and notes its last
+// directives, which gives each chunk the state it starts with - the second pass then writes the records
+// straight into their place in the one allocation sized by the first.
+#define PARSER_MIN_CHUNK (1 << 20)
+#define PARSER_MAX_THREADS 16
+#define DEFAULT_TTL 60
+
+typedef struct zone_state {
+    char origin[256];
+    uint32_t ttl;
+} zone_state_t;
+
+// bytes appended by one chunk - the pools of the chunks are put together once they are all parsed
+typedef struct zone_pool {
+    uint8_t* data;
+    size_t size;
+    size_t capacity;
+} zone_pool_t;
+
+typedef struct zone_chunk {
+    const char* start;
+    const char* end;
+    int pass;
+    // first pass
+    unsigned int candidates;    // lines with the form of a record - an upper bound of its records
+    int has_origin;             // the last directives of the chunk - they apply to the next chunks
+    int has_ttl;
+    zone_state_t last;
+    // second pass
+    zone_state_t state;         // in effect at the start of the chunk
+    dns_zone_record_t* records; // room for the candidates - their offsets point into the pools of the chunk
+    unsigned int count;
+    zone_pool_t names;          // the owner name of every record - interned later by build_zone_index
+    zone_pool_t rdata;
+    int failed;                 // out of memory
+} zone_chunk_t;
+
+enum zone_line_kind {
+    ZONE_LINE_NONE,
+    ZONE_LINE_ORIGIN,
+    ZONE_LINE_TTL,
+    ZONE_LINE_A,
+    ZONE_LINE_NS,
+    ZONE_LINE_CNAME,
+};
+
+typedef struct zone_line {
+    enum zone_line_kind kind;
+    const char* name;           // owner name, or the argument of $ORIGIN
+    size_t name_length;
+    const char* argument;       // target of NS and CNAME
+    size_t argument_length;
+    uint8_t ip[4];
+    uint32_t ttl;
+} zone_line_t;
+
+// the primitives below match what the scanf conversions of the same name accept
+
+static const char* skip_space(const char* p, const char* stop)
+{
+    while (p < stop && isspace((uint8_t)*p))
+        p++;
+
+    return p;
+}
+
+// a literal in the format - matched as is, without skipping any space before it
+static int match_literal(const char** p, const char* stop, const char* literal)
+{
+    size_t length = strlen(literal);
+    if ((size_t)(stop - *p) < length || memcmp(*p, literal, length) != 0)
+        return 0;
+
+    *p += length;
+    return 1;
+}
+
+// %s
+static int match_token(const char** p, const char* stop, const char** token, size_t* length)
+{
+    const char* q = skip_space(*p, stop);
+    const char* start = q;
+
+    while (q < stop && !isspace((uint8_t)*q))
+        q++;
+
+    if (q == start)
+        return 0;
+
+    *token = start;
+    *length = q - start;
+    *p = q;
+    return 1;
+}
+
+// %d and %u - strtol/strtoul semantics (saturated) truncated to 32 bits
+static int match_number(const char** p, const char* stop, int is_signed, uint32_t* value)
+{
+    const char* q = skip_space(*p, stop);
+    int negative = 0;
+
+    if (q < stop && (*q == '+' || *q == '-'))
+        negative = (*q++ == '-');
+
+    if (q >= stop || !isdigit((uint8_t)*q))
+        return 0;
+
+    uint64_t magnitude = 0;
+    int overflow = 0;
+
+    for (; q < stop && isdigit((uint8_t)*q); q++)
+    {
+        unsigned int digit = *q - '0';
+        if (magnitude > (UINT64_MAX - digit) / 10)
+            overflow = 1;
+        else
+            magnitude = magnitude * 10 + digit;
+    }
+
+    if (is_signed)
+    {
+        int64_t number;
+        if (negative)
+            number = (overflow || magnitude > (uint64_t)INT64_MAX + 1) ? INT64_MIN : (int64_t)(0 - magnitude);
+        else
+            number = (overflow || magnitude > (uint64_t)INT64_MAX) ? INT64_MAX : (int64_t)magnitude;
+
+        *value = (uint32_t)number;
+    }
+    else
+        *value = (uint32_t)(overflow ? UINT64_MAX : (negative ? 0 - magnitude : magnitude));
+
+    *p = q;
+    return 1;
+}
+
+static void parse_zone_line(const char* p, const char* stop, zone_line_t* line)
+{
+    line->kind = ZONE_LINE_NONE;
+
+    // the patterns see the line as a C string
+    const char* nul = memchr(p, '\0', stop - p);
+    if (nul != NULL)
+        stop = nul;
+
+    const char* q = p;
+    if (match_literal(&q, stop, "$ORIGIN") && match_token(&q, stop, &line->name, &line->name_length))
+    {
+        line->kind = ZONE_LINE_ORIGIN;
+        return;
+    }
+
+    uint32_t number;
+    q = p;
+    if (match_literal(&q, stop, "$TTL") && match_number(&q, stop, 1, &number) && q < stop)
+    {
+        line->ttl = number;
+        switch (*q)
+        {
+            case 'm': // minute
+                line->ttl *= 60;
+            break;
+
+            case 'h':
+            case 'H': // hour
+                line->ttl *= 60*60;
+            break;
+
+            case 'd':
+            case 'D': // day
+                line->ttl *= 60*60*24;
+            break;
+
+            case 'w': // week
+            case 'W': // week
+                line->ttl *= 60*60*24*7;
+            break;
+
+            case 'M': // month
+                line->ttl *= 60*60*24*30;
+            break;
+        }
+
+        line->kind = ZONE_LINE_TTL;
+        return;
+    }
+
+    // every record starts with "<name> IN "
+    q = p;
+    if (!match_token(&q, stop, &line->name, &line->name_length))
+        return;
+
+    q = skip_space(q, stop);
+    if (!match_literal(&q, stop, "IN"))
+        return;
+
+    q = skip_space(q, stop);
+    const char* type = q;
+
+    if (match_literal(&q, stop, "A"))
+    {
+        uint32_t octets[4];
+
+        for (int i = 0; i < 4; i++)
+            if ((i > 0 && !match_literal(&q, stop, ".")) || !match_number(&q, stop, 0, &octets[i]))
+                return;
+
+        // inet_addr rejects the octets above 255 - and gives INADDR_NONE for 255.255.255.255 which was never accepted either
+        if (octets[0] > 255 || octets[1] > 255 || octets[2] > 255 || octets[3] > 255 ||
+            (octets[0] & octets[1] & octets[2] & octets[3]) == 255)
+            return;
+
+        for (int i = 0; i < 4; i++)
+            line->ip[i] = (uint8_t)octets[i];
+
+        line->kind = ZONE_LINE_A;
+    }
+    else if (q = type, match_literal(&q, stop, "NS"))
+    {
+        if (match_token(&q, stop, &line->argument, &line->argument_length))
+            line->kind = ZONE_LINE_NS;
+    }
+    else if (q = type, match_literal(&q, stop, "CNAME"))
+    {
+        if (match_token(&q, stop, &line->argument, &line->argument_length))
+            line->kind = ZONE_LINE_CNAME;
+    }
+}
+
+// copies the name token and completes it with the origin - fails if it does not fit a record
+static int complete_token(const zone_state_t* state, const char* token, size_t length, char* name)
+{
+    if (length >= QNAME_SIZE)
+        return -1;
+
+    memcpy(name, token, length);
+    name[length] = '\0';
+    completeName(state->origin, name);
+
+    return (strlen(name) < QNAME_SIZE) ? 0 : -1;
+}
+
+// appends the bytes and gives their offset - returns -1 if out of memory
+static int pool_append(zone_pool_t* pool, const void* data, size_t length, uint32_t* offset)
+{
+    if (pool->size + length > pool->capacity)
+    {
+        size_t capacity = pool->capacity ? pool->capacity : 4096;
+        while (pool->size + length > capacity)
+            capacity *= 2;
+
+        uint8_t* grown = (uint8_t*)realloc(pool->data, capacity);
+        if (grown == NULL)
+            return -1;
+
+        pool->data = grown;
+        pool->capacity = capacity;
+    }
+
+    memcpy(pool->data + pool->size, data, length);
+    *offset = (uint32_t)pool->size;
+    pool->size += length;
+    return 0;
+}
+
+static void parse_zone_chunk(zone_chunk_t* chunk)
+{
+    zone_state_t* state = &chunk->state;
+    chunk->count = 0;
+
+    for (const char* p = chunk->start; p < chunk->end; )
+    {
+        // the line includes its line feed, like the ones returned by getdelim
+        const char* feed = memchr(p, '\n', chunk->end - p);
+        const char* stop = feed ? feed + 1 : chunk->end;
+
+        zone_line_t line;
+        parse_zone_line(p, stop, &line);
+        p = stop;
+
+        if (line.kind == ZONE_LINE_NONE)
+            continue;
+        else if (line.kind == ZONE_LINE_ORIGIN)
+        {
+            zone_state_t* target = (chunk->pass == 1) ? &chunk->last : state;
+
+            if (line.name_length < sizeof(target->origin))
+            {
+                memcpy(target->origin, line.name, line.name_length);
+                target->origin[line.name_length] = '\0';
+                chunk->has_origin = 1;
+            }
+
+            continue;
+        }
+        else if (line.kind == ZONE_LINE_TTL)
+        {
+            if (chunk->pass == 1)
+            {
+                chunk->last.ttl = line.ttl;
+                chunk->has_ttl = 1;
+            }
+            else
+                state->ttl = line.ttl;
+
+            continue;
+        }
+
+        if (chunk->pass == 1)
+        {
+            chunk->candidates++;
+            continue;
+        }
+
+        char name[2 * QNAME_SIZE + 2];
+        char argument[2 * QNAME_SIZE + 2];
+        uint8_t rdata[RDATA_SIZE + 1];
+
+        if (complete_token(state, line.name, line.name_length, name) != 0)
+            continue;
+
+        dns_zone_record_t* record = &chunk->records[chunk->count];
+        *record = (dns_zone_record_t) {
+            .ttl = state->ttl,
+        };
+
+        if (line.kind == ZONE_LINE_A)
+        {
+            record->type = DNS_TYPE_A;
+            record->rdlength = 4;
+            memcpy(rdata, line.ip, 4);
+        }
+        else
+        {
+            if (complete_token(state, line.argument, line.argument_length, argument) != 0)
+                continue;
+
+            record->type = (line.kind == ZONE_LINE_NS) ? DNS_TYPE_NS : DNS_TYPE_CNAME;
+            record->rdlength = domain_plain_to_label(argument, (char*)rdata);
+        }
+
+        if (pool_append(&chunk->names, name, strlen(name) + 1, &record->name) != 0 ||
+            pool_append(&chunk->rdata, rdata, record->rdlength, &record->rdata) != 0)
+        {
+            chunk->failed = 1;
+            return;
+        }
+
+        chunk->count++;
+    }
+}
+
+#ifndef _WIN32
+static void* parse_zone_chunk_thread(void* arg)
+{
+    parse_zone_chunk((zone_chunk_t*)arg);
+    return NULL;
+}
+#endif
+
+// runs the pass over every chunk - the first one on the calling thread
+static void run_parser_pass(zone_chunk_t* chunks, unsigned int chunk_count, int pass)
+{
+    #ifndef _WIN32
+    pthread_t threads[PARSER_MAX_THREADS];
+    int started[PARSER_MAX_THREADS] = { 0 };
+    #endif
+
+    for (unsigned int c = 0; c < chunk_count; c++)
+    {
+        chunks[c].pass = pass;
+
+        #ifndef _WIN32
+        if (c > 0 && pthread_create(&threads[c], NULL, parse_zone_chunk_thread, &chunks[c]) == 0)
+            started[c] = 1;
+        else
+        #endif
+        if (c > 0)
+            parse_zone_chunk(&chunks[c]);
+    }
+
+    parse_zone_chunk(&chunks[0]);
+
+    #ifndef _WIN32
+    for (unsigned int c = 1; c < chunk_count; c++)
+        if (started[c])
+            pthread_join(threads[c], NULL);
+    #endif
+}
+
+// fills the records of the zone from the text of a zone file - returns -1 if out of memory
+static int parse_zone_text(const char* text, size_t size, dns_zone_t* zone)
+{
+    unsigned int chunk_count = 1;
+
+    #ifndef _WIN32
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    while (chunk_count < PARSER_MAX_THREADS && chunk_count < cpus && size / (chunk_count + 1) >= PARSER_MIN_CHUNK)
+        chunk_count++;
+    #endif
+
+    zone_chunk_t chunks[PARSER_MAX_THREADS];
+
+    // cut right after a line feed so no line is split
+    const char* start = text;
+    for (unsigned int c = 0; c < chunk_count; c++)
+    {
+        const char* end = text + size;
+        if (c + 1 < chunk_count)
+        {
+            const char* cut = text + size / chunk_count * (c + 1);
+            const char* feed = (cut > start) ? memchr(cut, '\n', text + size - cut) : NULL;
+            end = (cut <= start) ? start : (feed ? feed + 1 : text + size);
+        }
+
+        chunks[c] = (zone_chunk_t){ .start = start, .end = end };
+        start = end;
+    }
+
+    run_parser_pass(chunks, chunk_count, 1);
+
+    // the directives seen so far give each chunk its starting state
+    zone_state_t state = { .origin = "", .ttl = DEFAULT_TTL };
+    unsigned int total = 0;
+
+    for (unsigned int c = 0; c < chunk_count; c++)
+    {
+        chunks[c].state = state;
+        total += chunks[c].candidates;
+
+        if (chunks[c].has_origin)
+            strcpy(state.origin, chunks[c].last.origin);
+        if (chunks[c].has_ttl)
+            state.ttl = chunks[c].last.ttl;
+    }
+
+    if (total == 0)
+        return 0;
+
+    dns_zone_record_t* records = (dns_zone_record_t*)malloc(sizeof(dns_zone_record_t) * total);
+    if (records == NULL)
+        return -1;
+
+    for (unsigned int c = 0, offset = 0; c < chunk_count; c++)
+    {
+        chunks[c].records = records + offset;
+        offset += chunks[c].candidates;
+    }
+
+    run_parser_pass(chunks, chunk_count, 2);
+
+    // put the pools of the chunks together
+    size_t names_size = 0;
+    size_t rdata_size = 0;
+    int failed = 0;
+
+    for (unsigned int c = 0; c < chunk_count; c++)
+    {
+        names_size += chunks[c].names.size;
+        rdata_size += chunks[c].rdata.size;
+        failed |= chunks[c].failed;
+    }
+
+    char* names = NULL;
+    uint8_t* rdata = NULL;
+
+    if (!failed && names_size <= UINT32_MAX && rdata_size <= UINT32_MAX)
+    {
+        names = (char*)malloc(names_size + 1);
+        rdata = (uint8_t*)malloc(rdata_size + 1);
+    }
+
+    if (names == NULL || rdata == NULL)
+    {
+        for (unsigned int c = 0; c < chunk_count; c++)
+        {
+            free(chunks[c].names.data);
+            free(chunks[c].rdata.data);
+        }
+
+        free(names);
+        free(rdata);
+        free(records);
+        return -1;
+    }
+
+    // and close the gaps left by the candidates that did not make it
+    unsigned int count = 0;
+    names_size = 0;
+    rdata_size = 0;
+
+    for (unsigned int c = 0; c < chunk_count; c++)
+    {
+        if (records + count != chunks[c].records)
+            memmove(records + count, chunks[c].records, sizeof(dns_zone_record_t) * chunks[c].count);
+
+        for (unsigned int r = count; r < count + chunks[c].count; r++)
+        {
+            records[r].name += (uint32_t)names_size;
+            records[r].rdata += (uint32_t)rdata_size;
+        }
+
+        if (chunks[c].names.size > 0)
+            memcpy(names + names_size, chunks[c].names.data, chunks[c].names.size);
+        if (chunks[c].rdata.size > 0)
+            memcpy(rdata + rdata_size, chunks[c].rdata.data, chunks[c].rdata.size);
+
+        names_size += chunks[c].names.size;
+        rdata_size += chunks[c].rdata.size;
+        count += chunks[c].count;
+
+        free(chunks[c].names.data);
+        free(chunks[c].rdata.data);
+    }
+
+    zone->records = records;
+    zone->record_count = count;
+    zone->names = names;
+    zone->names_size = (unsigned int)names_size;
+    zone->rdata = rdata;
+    zone->rdata_size = (unsigned int)rdata_size;
+    return 0;
+}
+
+const char* map_zone_file(const char* filename, size_t* size)
+{
+    static const char empty[1] = "";
+
+    #ifdef _WIN32
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        LOG_ERROR(LOG_ZONE, "Error opening file %s: %lu", filename, (unsigned long)GetLastError());
+        return NULL;
+    }
+
+    LARGE_INTEGER file_size = { 0 };
+    const char* text = NULL;
+
+    if (GetFileSizeEx(file, &file_size) && file_size.QuadPart == 0)
+        text = empty;
+    else if (GetFileSizeEx(file, &file_size))
+    {
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping != NULL)
+        {
+            text = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping); // the view keeps the mapping alive
+        }
+    }
+
+    if (text == NULL)
+        LOG_ERROR(LOG_ZONE, "Error mapping file %s: %lu", filename, (unsigned long)GetLastError());
+
+    CloseHandle(file);
+    *size = (text == empty) ? 0 : (size_t)file_size.QuadPart;
+    return text;
+    #else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        LOG_ERROR(LOG_ZONE, "Error opening file %s: %d %s", filename, errno, strerror(errno));
+        return NULL;
+    }
+
+    struct stat info;
+    const char* text = NULL;
+
+    if (fstat(fd, &info) == 0 && info.st_size == 0)
+        text = empty;
+    else if (fstat(fd, &info) == 0)
+    {
+        void* mapped = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped != MAP_FAILED)
+        {
+            madvise(mapped, (size_t)info.st_size, MADV_SEQUENTIAL);
+            text = (const char*)mapped;
+        }
+    }
+
+    if (text == NULL)
+        LOG_ERROR(LOG_ZONE, "Error mapping file %s: %d %s", filename, errno, strerror(errno));
+
+    close(fd);
+    *size = (text == empty) ? 0 : (size_t)info.st_size;
+    return text;
+    #endif
+}
+
+void unmap_zone_file(const char* text, size_t size)
+{
+    if (size == 0)
+        return;
+
+    #ifdef _WIN32
+    UnmapViewOfFile(text);
+    #else
+    munmap((void*)text, size);
+    #endif
+}
+
+// reads the zone from its text - read_zone_file prefers the compiled image when there is an up to date one.
+// Returns the number of records (0 for an empty file), or -1 if the file could not be read or the zone was rejected
+int parse_zone_file(const char* filename, dns_zone_t* zone)
+{
+    // start with an empty zone
+    *zone = (dns_zone_t){
+        .records = NULL,
+        .record_count = 0,
+        .names = NULL,
+        .names_size = 0,
+        .rdata = NULL,
+        .rdata_size = 0,
+        .seeds = NULL,
+        .seed_count = 0,
+        .index = NULL,
+        .index_size = 0,
+        .nodes = NULL,
+        .node_count = 0,
+        .answers = NULL,
+        .answer_count = 0,
+        .wire = NULL,
+        .wire_size = 0,
+        .image = NULL,
+        .image_size = 0,
+    };
+
+    size_t size = 0;
+    const char* text = map_zone_file(filename, &size);
+    if (text == NULL)
+        return -1;
+
+    int parsed = parse_zone_text(text, size, zone);
+    unmap_zone_file(text, size);
+
+    if (parsed != 0)
+    {
+        LOG_ERROR(LOG_ZONE, "Failed to allocate the records of zone %s", filename);
+        free_zone(zone);
+        return -1;
+    }
+
+    int count_records = (int)zone->record_count;
+
+    // group the records by name and index them for the lookups
+    if (build_zone_index(zone) != 0)
+    {
+        LOG_ERROR(LOG_ZONE, "Failed to build the index of zone %s", filename);
+        free_zone(zone);
+        return -1;
+    }
+
+    // a CNAME loop is a mistake in the file - the zone is rejected like a broken one
+    if (check_zone_chains(zone) != 0)
+    {
+        LOG_ERROR(LOG_ZONE, "Rejected zone %s: its CNAME records loop", filename);
+        free_zone(zone);
+        return -1;
+    }
+
+    // the zone is static from now on so the answers can be serialized up front
+    if (build_zone_answers(zone) != 0)
+    {
+        LOG_ERROR(LOG_ZONE, "Failed to precompile the answers of zone %s", filename);
+        free_zone(zone);
+        return -1;
+    }
+
+    return count_records;
+}
+
+int read_zone_file(const char* filename, dns_zone_t* zone)
+{
+    char image[FILENAME_MAX];
+    if (snprintf(image, sizeof(image), "%s%s", filename, ZONE_IMAGE_SUFFIX) < (int)sizeof(image) && map_zone_image(image, filename, zone) == 0)
+        return (int)zone->record_count;
+
+    return parse_zone_file(filename, zone);
+}
+
+// NAME INDEX
+// ================================================================
+// The names are placed with a perfect hash (hash and displace): the names fall in groups by one part of
+// their hash, and each group gets the first seed that sends all its names to free slots. A lookup is then
+// always a single bucket - its name is compared to tell the names of the zone from the others.
+#define MAX_SEED 0x100000 // a group that cannot be placed with this many seeds has names with the same 64 bit hash
+
+static uint64_t mix_hash(uint64_t hash)
+{
+    // the splitmix64 finalizer - spreads every input bit over the whole hash
+    hash ^= hash >> 30;
+    hash *= 0xBF58476D1CE4E5B9ull;
+    hash ^= hash >> 27;
+    hash *= 0x94D049BB133111EBull;
+    hash ^= hash >> 31;
+    return hash;
+}
+
+static uint64_t hash_name(const char* name)
+{
+    // FNV-1a over the lowercase name - DNS names compare case-insensitively
+    uint64_t hash = 14695981039346656037ull;
+
+    for (; *name; name++)
+    {
+        hash ^= (uint8_t)tolower((uint8_t)*name);
+        hash *= 1099511628211ull;
+    }
+
+    return mix_hash(hash);
+}
+
+static unsigned int name_group(uint64_t hash, unsigned int seed_count)
+{
+    return (unsigned int)(hash >> 32) & (seed_count - 1);
+}
+
+static unsigned int name_slot(uint64_t hash, uint32_t seed, unsigned int index_size)
+{
+    return (unsigned int)mix_hash(hash + seed * 0x9E3779B97F4A7C15ull) & (index_size - 1);
+}
+
+static int names_equal(const char* a, const char* b)
+{
+    for (; *a && *b; a++, b++)
+        if (tolower((uint8_t)*a) != tolower((uint8_t)*b))
+            return 0;
+
+    return *a == *b;
+}
+
+static const char* record_name(const dns_zone_t* zone, unsigned int record)
+{
+    return zone->names + zone->records[record].name;
+}
+
+// finds the bucket holding the name, or the empty bucket where it should be inserted - only used while grouping the records
+static dns_zone_bucket_t* probe_owners(dns_zone_bucket_t* owners, unsigned int owners_size, const dns_zone_t* zone, const char* name, uint32_t hash)
+{
+    unsigned int mask = owners_size - 1;
+
+    for (unsigned int slot = hash & mask;; slot = (slot + 1) & mask)
+    {
+        dns_zone_bucket_t* bucket = &owners[slot];
+
+        if (bucket->count == 0)
+            return bucket; // empty - the name is not there
+
+        if (bucket->hash == hash && names_equal(record_name(zone, bucket->first), name))
+            return bucket;
+    }
+}
+
+static const dns_zone_bucket_t* lookup_index(const dns_zone_t* zone, const char* name)
+{
+    if (zone->index == NULL)
+        return NULL;
+
+    uint64_t hash = hash_name(name);
+    const dns_zone_bucket_t* bucket = &zone->index[name_slot(hash, zone->seeds[name_group(hash, zone->seed_count)], zone->index_size)];
+
+    if (bucket->count == 0 || bucket->hash != (uint32_t)hash || !names_equal(zone->names + bucket->name, name))
+        return NULL;
+
+    return bucket;
+}
+
+// places the names with the perfect hash - the buckets come from the grouping table
+static int build_perfect_index(dns_zone_t* zone, const dns_zone_bucket_t* owners, unsigned int owners_size, unsigned int name_count)
+{
+    // about four names per group, and a load factor of 0.8 at most so the last groups find free slots quickly
+    unsigned int seed_count = 1;
+    while (seed_count < name_count / 4)
+        seed_count <<= 1;
+
+    unsigned int index_size = 16;
+    while (index_size < name_count + name_count / 4)
+        index_size <<= 1;
+
+    uint32_t* seeds = (uint32_t*)calloc(seed_count, sizeof(uint32_t));
+    dns_zone_bucket_t* index = (dns_zone_bucket_t*)calloc(index_size, sizeof(dns_zone_bucket_t));
+    uint64_t* hashes = (uint64_t*)malloc(sizeof(uint64_t) * (name_count + 1));
+    uint32_t* members = (uint32_t*)malloc(sizeof(uint32_t) * (name_count + 1));     // names sorted by group
+    uint32_t* group_start = (uint32_t*)calloc(seed_count + 1, sizeof(uint32_t));
+    uint32_t* order = (uint32_t*)malloc(sizeof(uint32_t) * seed_count);              // groups from the biggest
+    uint32_t* placed = (uint32_t*)malloc(sizeof(uint32_t) * (name_count + 1));      // slots taken by the group being placed
+    const dns_zone_bucket_t** buckets = (const dns_zone_bucket_t**)malloc(sizeof(dns_zone_bucket_t*) * (name_count + 1));
+
+    int result = -1;
+
+    if (seeds == NULL || index == NULL || hashes == NULL || members == NULL || group_start == NULL || order == NULL || placed == NULL || buckets == NULL)
+        goto bail;
+
+    // counting sort of the names by group
+    unsigned int n = 0;
+    for (unsigned int b = 0; b < owners_size; b++)
+    {
+        if (owners[b].count == 0)
+            continue;
+
+        buckets[n] = &owners[b];
+        hashes[n] = hash_name(record_name(zone, owners[b].first));
+        group_start[name_group(hashes[n], seed_count) + 1]++;
+        n++;
+    }
+
+    unsigned int largest = 0;
+    for (unsigned int g = 0; g < seed_count; g++)
+    {
+        if (group_start[g + 1] > largest)
+            largest = group_start[g + 1];
+
+        group_start[g + 1] += group_start[g];
+    }
+
+    for (unsigned int i = 0; i < n; i++)
+        members[group_start[name_group(hashes[i], seed_count)]++] = i;
+
+    for (unsigned int g = seed_count; g > 0; g--) // the increments above moved every start to the next group
+        group_start[g] = group_start[g - 1];
+    group_start[0] = 0;
+
+    // the big groups go first, while most slots are still free
+    unsigned int ordered = 0;
+    for (unsigned int size = largest; size > 0; size--)
+        for (unsigned int g = 0; g < seed_count; g++)
+            if (group_start[g + 1] - group_start[g] == size)
+                order[ordered++] = g;
+
+    for (unsigned int o = 0; o < ordered; o++)
+    {
+        unsigned int g = order[o];
+        uint32_t seed;
+
+        for (seed = 0; seed < MAX_SEED; seed++)
+        {
+            unsigned int count = 0;
+
+            for (uint32_t m = group_start[g]; m < group_start[g + 1]; m++)
+            {
+                unsigned int slot = name_slot(hashes[members[m]], seed, index_size);
+                if (index[slot].count != 0)
+                    break;
+
+                // taken for now so the names of the same group cannot share it
+                index[slot] = *buckets[members[m]];
+                index[slot].hash = (uint32_t)hashes[members[m]];
+                index[slot].name = zone->records[index[slot].first].name;
+                placed[count++] = slot;
+            }
+
+            if (count == group_start[g + 1] - group_start[g])
+                break;
+
+            while (count > 0)
+                index[placed[--count]].count = 0;
+        }
+
+        if (seed == MAX_SEED)
+            goto bail;
+
+        seeds[g] = seed;
+    }
+
+    free(zone->seeds);
+    free(zone->index);
+    zone->seeds = seeds;
+    zone->seed_count = seed_count;
+    zone->index = index;
+    zone->index_size = index_size;
+    seeds = NULL;
+    index = NULL;
+    result = 0;
+
+    bail:
+    free(seeds);
+    free(index);
+    free(hashes);
+    free(members);
+    free(group_start);
+    free(order);
+    free(placed);
+    free(buckets);
+    return result;
+}
+
+// NAME TREE
+// ================================================================
+// Only built for the zones with wildcard or subtree owners. A name the index does not have is then walked
+// label by label from the root: the last node reached is its closest encloser, whose "*" child synthesizes
+// the name (RFC 4592), and the "**" children passed on the way cover it too - as many steps as labels.
+typedef struct tree_entry {
+    const char* name;
+    uint32_t bucket;
+    uint32_t rest;          // length of the part of the name still to be placed - its labels are taken from the right
+    const uint8_t* key;     // the labels from the right, lowercase and each followed by a zero
+    uint32_t key_length;
+} tree_entry_t;
+
+// takes the rightmost label of the first *rest characters of the name - *rest becomes zero after the last one
+static const char* next_label(const char* name, uint32_t* rest, uint32_t* length)
 {
-	char *ptr, *eptr;
+    uint32_t start = *rest;
+    while (start > 0 && name[start - 1] != '.')
+        start--;
+
+    *length = *rest - start;
+    *rest = (start > 0) ? start - 1 : 0;
+    return name + start;
+}
 
+// the labels of a name, without the root
+static uint32_t name_rest(const char* name)
+{
+    uint32_t length = (uint32_t)strlen(name);
+    return (length > 0 && name[length - 1] == '.') ? length - 1 : length;
+}
 
-	if (*buf == NULL || *bufsiz == 0)
-    {
-		*bufsiz = BUFSIZ;
-		if ((*buf = malloc(*bufsiz)) == NULL)
-			return -1;
-	}
+static int compare_labels(const char* a, uint32_t a_length, const char* b, uint32_t b_length)
+{
+    uint32_t common = (a_length < b_length) ? a_length : b_length;
 
-	for (ptr = *buf, eptr = *buf + *bufsiz;;)
+    for (uint32_t i = 0; i < common; i++)
     {
-		int c = fgetc(fp);
-		if (c == -1)
-		{
-			if (feof(fp))
-			{
-				ssize_t diff = (ssize_t)(ptr - *buf);
-				if (diff != 0)
-				{
-					*ptr = '\0';
-					return diff;
-				}
-			}
+        int difference = tolower((uint8_t)a[i]) - tolower((uint8_t)b[i]);
+        if (difference != 0)
+            return difference;
+    }
 
-			return -1;
-		}
+    return (a_length > b_length) - (a_length < b_length);
+}
 
-		*ptr++ = c;
-		if (c == delimiter)
-        {
-			*ptr = '\0';
-			return ptr - *buf;
-		}
+// same order as compare_labels, label after label - so the names below a node end up next to each other
+static int compare_tree_entries(const void* a, const void* b)
+{
+    const tree_entry_t* x = (const tree_entry_t*)a;
+    const tree_entry_t* y = (const tree_entry_t*)b;
 
-		if (ptr + 2 >= eptr)
-        {
-			char *nbuf;
-			size_t nbufsiz = *bufsiz * 2;
-			ssize_t d = ptr - *buf;
-			if ((nbuf = realloc(*buf, nbufsiz)) == NULL)
-				return -1;
-			*buf = nbuf;
-			*bufsiz = nbufsiz;
-			eptr = nbuf + nbufsiz;
-			ptr = nbuf + d;
-		}
-	}
+    int difference = memcmp(x->key, y->key, (x->key_length < y->key_length) ? x->key_length : y->key_length);
+    return difference ? difference : (x->key_length > y->key_length) - (x->key_length < y->key_length);
 }
 
-void completeName(const char* origin, char* name)
+static const dns_zone_node_t* find_child(const dns_zone_node_t* nodes, const char* names, const dns_zone_node_t* node, const char* label, uint32_t length)
 {
-    if (strcmp(name, "@") == 0)
-        strcpy(name, origin);
-    else if (name[strlen(name) - 1] != '.')
+    uint32_t low = node->children;
+    uint32_t high = node->children + node->child_count;
+
+    while (low < high)
     {
-        strcat(name, ".");
-        strcat(name, origin);
+        uint32_t middle = low + (high - low) / 2;
+        int difference = compare_labels(names + nodes[middle].label, nodes[middle].label_length, label, length);
+
+        if (difference == 0)
+            return &nodes[middle];
+        else if (difference < 0)
+            low = middle + 1;
+        else
+            high = middle;
     }
+
+    return NULL;
 }
 
-unsigned int read_zone_file(const char* filename, dns_answer_t** pointer_to_records)
+typedef struct tree_builder {
+    dns_zone_node_t* nodes;
+    uint32_t* ranges;       // the entries below each node - first and last + 1
+    unsigned int count;
+    unsigned int capacity;
+} tree_builder_t;
+
+static int add_tree_node(tree_builder_t* tree, uint32_t label, uint32_t label_length, uint32_t first, uint32_t last)
 {
-    // open the file
-    FILE* fp = fopen(filename, "rb+");
-    if (fp == NULL)
+    if (tree->count == tree->capacity)
     {
-        fprintf(stderr, "\nError opening file %s: %d %s", filename, errno, strerror(errno));
-        return 0;
+        unsigned int capacity = tree->capacity ? tree->capacity * 2 : 1024;
+        dns_zone_node_t* nodes = (dns_zone_node_t*)realloc(tree->nodes, sizeof(dns_zone_node_t) * capacity);
+        if (nodes == NULL)
+            return -1;
+        tree->nodes = nodes;
+
+        uint32_t* ranges = (uint32_t*)realloc(tree->ranges, sizeof(uint32_t) * 2 * capacity);
+        if (ranges == NULL)
+            return -1;
+        tree->ranges = ranges;
+
+        tree->capacity = capacity;
     }
 
-    unsigned int count_records = 0;
-    dns_answer_t* record_collection = NULL;
+    tree->nodes[tree->count] = (dns_zone_node_t){
+        .label = label,
+        .label_length = label_length,
+        .children = 0,
+        .child_count = 0,
+        .bucket = NO_BUCKET,
+        .wildcard = NO_BUCKET,
+        .subtree = NO_BUCKET,
+    };
+    tree->ranges[2 * tree->count] = first;
+    tree->ranges[2 * tree->count + 1] = last;
+    tree->count++;
+    return 0;
+}
+
+static int is_rule_name(const char* name)
+{
+    return (name[0] == '*' && (name[1] == '.' || name[1] == '\0')) ||
+           (name[0] == '*' && name[1] == '*' && (name[2] == '.' || name[2] == '\0'));
+}
 
-    void addRecord(dns_answer_t new_rec)
-    {
-        dns_answer_t* new_collection = (dns_answer_t*)realloc(record_collection, sizeof(dns_answer_t) * (count_records + 1));
-        if (new_collection == NULL)
-            return; // allocation failed!
+static int build_name_tree(dns_zone_t* zone)
+{
+    free(zone->nodes);
+    zone->nodes = NULL;
+    zone->node_count = 0;
+
+    unsigned int name_count = 0;
+    unsigned int rule_count = 0;
 
-        record_collection = new_collection; // update old invalid pointer
-        record_collection[count_records] = new_rec;
-        count_records++;
+    for (unsigned int b = 0; b < zone->index_size; b++)
+    {
+        if (zone->index[b].count > 0)
+        {
+            name_count++;
+            rule_count += is_rule_name(zone->names + zone->index[b].name);
+        }
     }
 
-    // read the file
-    char *line = NULL;
-    size_t size = 0;
+    if (rule_count == 0)
+        return 0; // the index alone answers every lookup
+
+    tree_entry_t* entries = (tree_entry_t*)malloc(sizeof(tree_entry_t) * name_count);
+    uint8_t* keys = (uint8_t*)malloc(zone->names_size + name_count);
+    tree_builder_t tree = { .nodes = NULL, .ranges = NULL, .count = 0, .capacity = 0 };
+
+    if (entries == NULL || keys == NULL)
+        goto fail;
 
-    uint32_t ttl = 60;
-    char origin[256] = "";
+    unsigned int n = 0;
+    uint32_t key_size = 0;
 
-    while(getdelim(&line, &size,'\n', fp) != EOF)
+    for (unsigned int b = 0; b < zone->index_size; b++)
     {
-        int read_ttl;
-        char read_ttl_c;
+        if (zone->index[b].count == 0)
+            continue;
 
-        char read_name[255] = "";
-        char read_argument[255] = "";
-        int read_ip[4] = {0};
+        tree_entry_t* entry = &entries[n++];
+        *entry = (tree_entry_t){ .name = zone->names + zone->index[b].name, .bucket = b, .key = keys + key_size };
+        entry->rest = name_rest(entry->name);
 
-        if (sscanf(line, "$ORIGIN %s ", read_name) == 1)
+        for (uint32_t rest = entry->rest, length; rest > 0; )
         {
-            strcpy(origin, read_name);
+            const char* label = next_label(entry->name, &rest, &length);
+
+            for (uint32_t i = 0; i < length; i++)
+                keys[key_size++] = (uint8_t)tolower((uint8_t)label[i]);
+
+            keys[key_size++] = 0;
         }
-        else if (sscanf(line, "$TTL %d%c", &read_ttl, &read_ttl_c) == 2)
-        {
-            ttl = read_ttl;
-            switch (read_ttl_c)
-            {
-                case 'm': // minute
-                    ttl *= 60;
-                break;
 
-                case 'h':
-                case 'H': // hour
-                    ttl *= 60*60;
-                break;
+        entry->key_length = (uint32_t)(keys + key_size - entry->key);
+    }
 
-                case 'd':
-                case 'D': // day
-                    ttl *= 60*60*24;
-                break;
+    qsort(entries, n, sizeof(tree_entry_t), compare_tree_entries);
 
-                case 'w': // week
-                case 'W': // week
-                    ttl *= 60*60*24*7;
-                break;
+    // the nodes are made breadth first, so the children of each node are made together
+    if (add_tree_node(&tree, 0, 0, 0, n) != 0)
+        goto fail;
 
-                case 'M': // month
-                    ttl *= 60*60*24*30;
-                break;
-            }
+    for (unsigned int node = 0; node < tree.count; node++)
+    {
+        uint32_t first = tree.ranges[2 * node];
+        uint32_t last = tree.ranges[2 * node + 1];
+
+        // a name with no labels left ends at this node - it sorts before the names below it
+        while (first < last && entries[first].rest == 0)
+        {
+            if (tree.nodes[node].bucket == NO_BUCKET)
+                tree.nodes[node].bucket = entries[first].bucket;
+            first++;
         }
-        else if (sscanf(line, "%s IN A %u.%u.%u.%u", read_name, &read_ip[0], &read_ip[1], &read_ip[2], &read_ip[3]) == 5)
+
+        tree.nodes[node].children = tree.count;
+
+        while (first < last)
         {
-            // get the full ip
-            char ip_string[16];
-            sprintf(ip_string, "%u.%u.%u.%u", read_ip[0], read_ip[1], read_ip[2], read_ip[3]);
-            uint32_t ip_long = inet_addr(ip_string);
+            // the entries sharing the next label make one child
+            uint32_t rest = entries[first].rest;
+            uint32_t length;
+            const char* label = next_label(entries[first].name, &rest, &length);
+            uint32_t end = first;
 
-            // verify the ip is valid
-            if (ip_long != 0xFFFFFFFF)
+            while (end < last)
             {
-                completeName(origin, read_name);
+                uint32_t other_rest = entries[end].rest;
+                uint32_t other_length;
+                const char* other = next_label(entries[end].name, &other_rest, &other_length);
 
-                dns_answer_t ans = (dns_answer_t) {
-                    //.aname[QNAME_SIZE],
-                    .atype = DNS_TYPE_A,
-                    .aclass = DNS_CLASS_IN,
-                    .ttl = ttl,
-                    .rdlength = 4
-                    //.rdata[RDATA_SIZE]
-                };
+                if (compare_labels(label, length, other, other_length) != 0)
+                    break;
 
-                strcpy(ans.aname, read_name);
-                memcpy(ans.rdata, &ip_long, ans.rdlength);
-
-                addRecord(ans);
+                entries[end++].rest = other_rest;
             }
+
+            if (add_tree_node(&tree, (uint32_t)(label - zone->names), length, first, end) != 0)
+                goto fail;
+
+            tree.nodes[node].child_count++;
+            first = end;
         }
-        else if (sscanf(line, "%s IN NS %s ", read_name, read_argument) == 2)
+    }
+
+    // the rules are kept on their parent, so the lookups do not search for them
+    for (unsigned int node = 0; node < tree.count; node++)
+    {
+        const dns_zone_node_t* wildcard = find_child(tree.nodes, zone->names, &tree.nodes[node], "*", 1);
+        const dns_zone_node_t* subtree = find_child(tree.nodes, zone->names, &tree.nodes[node], "**", 2);
+
+        tree.nodes[node].wildcard = wildcard ? wildcard->bucket : NO_BUCKET;
+        tree.nodes[node].subtree = subtree ? subtree->bucket : NO_BUCKET;
+    }
+
+    free(entries);
+    free(keys);
+    free(tree.ranges);
+
+    dns_zone_node_t* shrunk = (dns_zone_node_t*)realloc(tree.nodes, sizeof(dns_zone_node_t) * tree.count);
+    zone->nodes = shrunk ? shrunk : tree.nodes;
+    zone->node_count = tree.count;
+    return 0;
+
+    fail:
+    free(entries);
+    free(keys);
+    free(tree.ranges);
+    free(tree.nodes);
+    return -1;
+}
+
+// the wildcard or subtree RRset covering a name the index does not have - NULL if none does
+static const dns_zone_bucket_t* find_covering_bucket(const dns_zone_t* zone, const char* name)
+{
+    if (zone->node_count == 0)
+        return NULL;
+
+    const dns_zone_node_t* node = &zone->nodes[0];
+    uint32_t subtree = NO_BUCKET;
+    uint32_t rest = name_rest(name);
+
+    while (rest > 0)
+    {
+        // the name is below this node
+        if (node->subtree != NO_BUCKET)
+            subtree = node->subtree;
+
+        uint32_t length;
+        const char* label = next_label(name, &rest, &length);
+        const dns_zone_node_t* child = find_child(zone->nodes, zone->names, node, label, length);
+
+        if (child == NULL)
         {
-            completeName(origin, read_name);
-            completeName(origin, read_argument);
-
-            dns_answer_t ans = (dns_answer_t) {
-                //.aname[QNAME_SIZE],
-                .atype = DNS_TYPE_NS,
-                .aclass = DNS_CLASS_IN,
-                .ttl = ttl,
-                //.rdlength = len
-                //.rdata[RDATA_SIZE]
-            };
+            // the node is the closest encloser - a name that exists, even only as an ancestor, is never synthesized
+            if (node->wildcard != NO_BUCKET)
+                return &zone->index[node->wildcard];
+            break;
+        }
+
+        node = child;
+    }
+
+    return (subtree != NO_BUCKET) ? &zone->index[subtree] : NULL;
+}
+
+#define FIRST_OF_NAME 0x80000000u // flags the first record of each name in record_bucket
+
+int build_zone_index(dns_zone_t* zone)
+{
+    free(zone->seeds);
+    free(zone->index);
+    free(zone->nodes);
+    zone->seeds = NULL;
+    zone->seed_count = 0;
+    zone->index = NULL;
+    zone->index_size = 0;
+    zone->nodes = NULL;
+    zone->node_count = 0;
+
+    // the records are grouped by name with an open-addressing table first
+    // keep its load factor at or below 1/2 so the probe sequences stay short
+    unsigned int owners_size = 16;
+    while (owners_size < 2 * zone->record_count)
+        owners_size <<= 1;
+
+    dns_zone_bucket_t* owners = (dns_zone_bucket_t*)calloc(owners_size, sizeof(dns_zone_bucket_t));
+    uint32_t* record_bucket = (uint32_t*)malloc(sizeof(uint32_t) * (zone->record_count + 1));
+    dns_zone_record_t* grouped = (dns_zone_record_t*)malloc(sizeof(dns_zone_record_t) * (zone->record_count + 1));
+    char* interned = (char*)malloc(zone->names_size + 1);
+
+    if (owners == NULL || record_bucket == NULL || grouped == NULL || interned == NULL)
+    {
+        free(owners);
+        free(record_bucket);
+        free(grouped);
+        free(interned);
+        return -1;
+    }
+
+    // first pass: find the bucket of each name and count the records it owns
+    // here "first" still refers to the position of the first occurrence in the original order
+    unsigned int name_count = 0;
+    for (unsigned int i = 0; i < zone->record_count; i++)
+    {
+        uint32_t hash = (uint32_t)hash_name(record_name(zone, i));
+        dns_zone_bucket_t* bucket = probe_owners(owners, owners_size, zone, record_name(zone, i), hash);
 
-            strcpy(ans.aname, read_name);
-            ans.rdlength = domain_plain_to_label(read_argument, (char*)ans.rdata);
+        record_bucket[i] = (uint32_t)(bucket - owners);
 
-            addRecord(ans);
+        if (bucket->count == 0)
+        {
+            *bucket = (dns_zone_bucket_t){ .hash = hash, .first = i, .count = 0, .name = 0, .answer_first = 0, .answer_count = 0 };
+            record_bucket[i] |= FIRST_OF_NAME;
+            name_count++;
         }
-        else if (sscanf(line, "%s IN CNAME %s ", read_name, read_argument) == 2)
+
+        bucket->count++;
+    }
+
+    // second pass: lay out the RRsets in the order their names first appear in the file
+    unsigned int offset = 0;
+    for (unsigned int i = 0; i < zone->record_count; i++)
+    {
+        dns_zone_bucket_t* bucket = &owners[record_bucket[i] & ~FIRST_OF_NAME];
+        if (record_bucket[i] & FIRST_OF_NAME) // "first" is rewritten here, so it cannot tell the first occurrence anymore
         {
-            completeName(origin, read_name);
-            completeName(origin, read_argument);
-
-             dns_answer_t ans = (dns_answer_t) {
-                //.aname[QNAME_SIZE],
-                .atype = DNS_TYPE_CNAME,
-                .aclass = DNS_CLASS_IN,
-                .ttl = ttl,
-                //.rdlength = len
-                //.rdata[RDATA_SIZE]
-            };
+            bucket->first = offset;
+            offset += bucket->count;
+            bucket->count = 0; // used as a fill counter by the next pass
+        }
+    }
+
+    // third pass: move every record to its slot - the relative order inside an RRset is preserved
+    for (unsigned int i = 0; i < zone->record_count; i++)
+    {
+        dns_zone_bucket_t* bucket = &owners[record_bucket[i] & ~FIRST_OF_NAME];
+        grouped[bucket->first + bucket->count] = zone->records[i];
+        bucket->count++;
+    }
 
-            strcpy(ans.aname, read_name);
-            ans.rdlength = domain_plain_to_label(read_argument, (char*)ans.rdata);
+    // every RRset is one name - store it once in the pool, in the order of the RRsets
+    unsigned int interned_size = 0;
+    const char* previous = NULL;
+    uint32_t offset_of_previous = 0;
 
-            addRecord(ans);
+    for (unsigned int i = 0; i < zone->record_count; i++)
+    {
+        const char* name = zone->names + grouped[i].name;
+
+        if (previous == NULL || !names_equal(name, previous))
+        {
+            size_t length = strlen(name) + 1;
+            memcpy(interned + interned_size, name, length);
+            offset_of_previous = interned_size;
+            interned_size += (unsigned int)length;
         }
+
+        previous = name;
+        grouped[i].name = offset_of_previous;
     }
 
-    *pointer_to_records = record_collection;
+    free(record_bucket);
+    free(zone->records);
+    free(zone->names);
+    zone->records = grouped;
+    zone->names = interned;
+    zone->names_size = interned_size;
 
-    // cleanup
-    free(line);
-    fclose(fp);
+    int result = build_perfect_index(zone, owners, owners_size, name_count);
+    free(owners);
 
-    return count_records;
+    if (result == 0)
+        result = build_name_tree(zone);
+
+    return result;
+}
+
+// the RRset owned by exactly this name - the wildcards and subtrees covering it are not considered
+int find_dns_rrset(const dns_zone_t* zone, const char* domain, unsigned int* count)
+{
+    if (zone == NULL || domain == NULL)
+        return -1;
+
+    const dns_zone_bucket_t* bucket = lookup_index(zone, domain);
+    if (bucket == NULL)
+        return -1;
+
+    if (count)
+        *count = bucket->count;
+
+    return bucket->first;
 }
 
-void print_records_collection(dns_answer_t* first, int count)
+void free_zone(dns_zone_t* zone)
 {
-    for (int i = 0; i < count; i++)
+    if (zone->image != NULL)
+        unmap_zone_image(zone);
+    else
     {
-        printf("\n\nRECORD %d / %d:", i + 1, count);
-        print_dns_answer(&first[i]);
+        free(zone->records);
+        free(zone->names);
+        free(zone->rdata);
+        free(zone->seeds);
+        free(zone->index);
+        free(zone->nodes);
+        free(zone->answers);
+        free(zone->wire);
     }
+
+    zone->records = NULL;
+    zone->record_count = 0;
+    zone->names = NULL;
+    zone->names_size = 0;
+    zone->rdata = NULL;
+    zone->rdata_size = 0;
+    zone->seeds = NULL;
+    zone->seed_count = 0;
+    zone->index = NULL;
+    zone->index_size = 0;
+    zone->nodes = NULL;
+    zone->node_count = 0;
+    zone->answers = NULL;
+    zone->answer_count = 0;
+    zone->wire = NULL;
+    zone->wire_size = 0;
+    zone->image = NULL;
+    zone->image_size = 0;
 }
 
-int find_next_dns_match(const char* domain, dns_answer_t* collection, unsigned int count, int previous)
+// the record as an answer - its name and data point into the zone
+void get_zone_answer(const dns_zone_t* zone, unsigned int record, dns_answer_t* answer)
 {
-    unsigned int record_index = (previous < 0) ? 0 : previous + 1;
+    const dns_zone_record_t* r = &zone->records[record];
+
+    *answer = (dns_answer_t){
+        .aname = zone->names + r->name,
+        .atype = r->type,
+        .aclass = DNS_CLASS_IN,
+        .ttl = r->ttl,
+        .rdlength = r->rdlength,
+        .rdata = zone->rdata + r->rdata,
+    };
+}
 
-    for (; record_index < count; record_index++)
+void print_records_collection(const dns_zone_t* zone)
+{
+    for (unsigned int i = 0; i < zone->record_count; i++)
     {
-        //printf("\ntry match: %s\tto\t%s", collection[record_index].aname, domain);
-        if (strcmp(collection[record_index].aname, domain) == 0)
-            return record_index;
-    }
+        dns_answer_t answer;
+        get_zone_answer(zone, i, &answer);
 
-    return -1;
+        printf("\n\nRECORD %u / %u:", i + 1, zone->record_count);
+        print_dns_answer(&answer);
+    }
 }
 
-int dns_add_records(char* domain, enum dns_type filter, dns_transaction_t* reply, dns_answer_t *dns_record_collection, unsigned int dns_record_count, int* countFound)
+// the names followed through CNAME and NS records to get to the one being added
+// a name already in the chain is a loop - easy to make with a wildcard pointing below itself
+#define MAX_CHAIN_DEPTH 16
+
+typedef struct dns_chain {
+    const char* domain;
+    const struct dns_chain* previous;
+    int depth;
+} dns_chain_t;
+
+int dns_add_records(char* domain, enum dns_type filter, dns_transaction_t* reply, const dns_zone_t* zone, int* countFound, const dns_chain_t* chain)
 {
     int countAdded = 0;
 
     if (reply == NULL || domain == NULL) // sanity check
         goto bail;
 
-    int match = -1;
+    if (chain != NULL && chain->depth >= MAX_CHAIN_DEPTH)
+        goto bail;
+
+    for (const dns_chain_t* link = chain; link != NULL; link = link->previous)
+        if (names_equal(link->domain, domain))
+            goto bail;
+
+    dns_chain_t link = { .domain = domain, .previous = chain, .depth = chain ? chain->depth + 1 : 1 };
+
+    unsigned int rrset_count = 0;
+    int first = find_dns_rrset(zone, domain, &rrset_count);
+    const char* owner = NULL; // the records of a wildcard are owned by the name asked (RFC 4592)
+
+    if (first < 0)
+    {
+        const dns_zone_bucket_t* covering = find_covering_bucket(zone, domain);
+        if (covering != NULL)
+        {
+            char* synthesized = (char*)arena_alloc(reply->arena, strlen(domain) + 1);
+            if (synthesized == NULL)
+                goto bail;
+
+            strcpy(synthesized, domain);
+            owner = synthesized;
+            first = covering->first;
+            rrset_count = covering->count;
+        }
+    }
 
-    while ((match = find_next_dns_match(domain, dns_record_collection, dns_record_count, match)) >= 0)
+    for (int match = first; first >= 0 && match < first + (int)rrset_count; match++)
     {
         (*countFound)++;
 
-        dns_answer_t* ans = &dns_record_collection[match];
+        dns_answer_t answer;
+        get_zone_answer(zone, match, &answer);
+
+        if (owner != NULL)
+            answer.aname = owner;
 
-        if (filter == DNS_TYPE_ANY || filter == ans->atype) // found a record matching the required type
+        if (filter == DNS_TYPE_ANY || filter == answer.atype) // found a record matching the required type
         {
-            add_answer_to_dns_reply(reply, *ans);
+            add_answer_to_dns_reply(reply, &answer);
             countAdded++;
         }
-        else if (ans->atype == DNS_TYPE_CNAME || ans->atype == DNS_TYPE_NS) // this is not the right type but may point to one of the right type
+        else if (answer.atype == DNS_TYPE_CNAME || answer.atype == DNS_TYPE_NS) // this is not the right type but may point to one of the right type
         {
             char recursive_domain[256] = "";
 
-            if (!read_dns_name(NULL, (char*)ans->rdata, recursive_domain))
+            if (!read_dns_name(NULL, (char*)answer.rdata, recursive_domain))
                 continue; // bad bad bad
 
-            int recursive_added = dns_add_records(recursive_domain, filter, reply, dns_record_collection, dns_record_count, countFound);
+            int recursive_added = dns_add_records(recursive_domain, filter, reply, zone, countFound, &link);
             if (recursive_added)
             {
-                add_answer_to_dns_reply(reply, *ans);
+                add_answer_to_dns_reply(reply, &answer);
                 countAdded++;
                 countAdded += recursive_added;
             }
@@ -297,20 +1500,19 @@ int dns_add_records(char* domain, enum dns_type filter, dns_transaction_t* reply
     return countAdded;
 }
 
-dns_transaction_t* build_dns_reply_from_query(dns_transaction_t* query, dns_answer_t *dns_record_collection, unsigned int dns_record_count)
+// fills the reply with the records matching the questions it carries - returns NULL (and frees the reply) if nothing matched
+static dns_transaction_t* answer_questions(dns_transaction_t* reply, const dns_zone_t* zone)
 {
-    // sanity check
-    if (query == NULL || dns_record_collection == NULL || dns_record_count == 0)
+    if (reply == NULL)
         return NULL;
 
     int numAdded = 0;
     int numFound = 0;
-    dns_transaction_t* reply = create_dns_reply(query);
 
-    for (uint16_t q = 0; q < query->header.QDCount; q++)
+    for (uint16_t q = 0; q < reply->header.QDCount; q++)
     {
-        printf("\nQuery: %s", query->questions[q].qname);
-        numAdded += dns_add_records(query->questions[q].qname, query->questions[q].qtype, reply, dns_record_collection, dns_record_count, &numFound);
+        LOG_DEBUG(LOG_QUERY, "Query: %s", reply->questions[q].qname);
+        numAdded += dns_add_records(reply->questions[q].qname, reply->questions[q].qtype, reply, zone, &numFound, NULL);
     }
 
     if (numFound == 0) // we use *found* not *added* // maybe we didn't add any records (because they were the wrong type) but we sure found some records of other types, in this case we might as well return an empty respose
@@ -322,3 +1524,339 @@ dns_transaction_t* build_dns_reply_from_query(dns_transaction_t* query, dns_answ
 
     return reply;
 }
+
+dns_transaction_t* build_dns_reply_from_query(dns_transaction_t* query, const dns_zone_t* zone, arena_t* arena)
+{
+    // sanity check
+    if (query == NULL || zone == NULL || zone->record_count == 0)
+        return NULL;
+
+    return answer_questions(create_dns_reply(query, arena), zone);
+}
+
+dns_transaction_t* build_dns_reply_from_view(const dns_view_t* query, const dns_zone_t* zone, arena_t* arena)
+{
+    // sanity check
+    if (query == NULL || zone == NULL || zone->record_count == 0)
+        return NULL;
+
+    return answer_questions(create_dns_reply_from_view(query, arena), zone);
+}
+
+// CNAME CHAINS
+// ================================================================
+// Every CNAME points to a fixed name, so whatever loops a query could run into are already in the zone:
+// a depth-first walk over the CNAME targets (through the wildcards covering them too) finds them all once
+// at load time. The chains themselves are flattened into the precompiled answers right after.
+
+// the bucket answering for the target of the CNAME record - NO_BUCKET if it is outside the zone
+static uint32_t cname_target(const dns_zone_t* zone, unsigned int record)
+{
+    char target[256] = "";
+    if (!read_dns_name(NULL, (const char*)zone->rdata + zone->records[record].rdata, target))
+        return NO_BUCKET;
+
+    const dns_zone_bucket_t* bucket = lookup_index(zone, target);
+    if (bucket == NULL)
+        bucket = find_covering_bucket(zone, target);
+
+    return bucket ? (uint32_t)(bucket - zone->index) : NO_BUCKET;
+}
+
+// returns -1 if the CNAME records of the zone loop, or if out of memory
+int check_zone_chains(dns_zone_t* zone)
+{
+    if (zone->index_size == 0)
+        return 0;
+
+    enum { CHAIN_UNSEEN, CHAIN_ON_PATH, CHAIN_DONE };
+
+    typedef struct chain_step {
+        uint32_t bucket;
+        uint32_t next;      // next record of the bucket to follow
+        uint32_t length;    // names in the longest chain from the bucket seen so far
+    } chain_step_t;
+
+    uint8_t* state = (uint8_t*)calloc(zone->index_size, 1);
+    uint32_t* lengths = (uint32_t*)malloc(zone->index_size * sizeof(uint32_t)); // of the buckets done
+    chain_step_t* path = (chain_step_t*)malloc(zone->index_size * sizeof(chain_step_t));
+    uint32_t longest = 0;
+    uint32_t longest_start = NO_BUCKET;
+    int result = 0;
+
+    if (state == NULL || lengths == NULL || path == NULL)
+    {
+        result = -1;
+        goto done;
+    }
+
+    for (uint32_t start = 0; start < zone->index_size && result == 0; start++)
+    {
+        if (zone->index[start].count == 0 || state[start] != CHAIN_UNSEEN)
+            continue;
+
+        unsigned int depth = 0;
+        path[depth++] = (chain_step_t){ .bucket = start, .next = zone->index[start].first, .length = 1 };
+        state[start] = CHAIN_ON_PATH;
+
+        while (depth > 0)
+        {
+            chain_step_t* step = &path[depth - 1];
+            const dns_zone_bucket_t* bucket = &zone->index[step->bucket];
+
+            if (step->next == bucket->first + bucket->count)
+            {
+                state[step->bucket] = CHAIN_DONE;
+                lengths[step->bucket] = step->length;
+
+                if (step->length > longest)
+                {
+                    longest = step->length;
+                    longest_start = step->bucket;
+                }
+
+                if (--depth > 0 && path[depth - 1].length < step->length + 1)
+                    path[depth - 1].length = step->length + 1;
+                continue;
+            }
+
+            unsigned int record = step->next++;
+            if (zone->records[record].type != DNS_TYPE_CNAME)
+                continue;
+
+            uint32_t target = cname_target(zone, record);
+            if (target == NO_BUCKET)
+                continue;
+
+            if (state[target] == CHAIN_DONE)
+            {
+                if (step->length < lengths[target] + 1)
+                    step->length = lengths[target] + 1;
+                continue;
+            }
+
+            if (state[target] == CHAIN_ON_PATH)
+            {
+                LOG_ERROR(LOG_ZONE, "CNAME loop: %s points back to %s", zone->names + bucket->name, zone->names + zone->index[target].name);
+                result = -1;
+                break;
+            }
+
+            state[target] = CHAIN_ON_PATH;
+            path[depth++] = (chain_step_t){ .bucket = target, .next = zone->index[target].first, .length = 1 };
+        }
+    }
+
+    // the queries stop following a chain after MAX_CHAIN_DEPTH names
+    if (result == 0 && longest > MAX_CHAIN_DEPTH)
+        LOG_WARNING(LOG_ZONE, "The CNAME chain from %s goes through %u names: only the first %d are followed", zone->names + zone->index[longest_start].name, longest, MAX_CHAIN_DEPTH);
+
+    done:
+    free(state);
+    free(lengths);
+    free(path);
+    return result;
+}
+
+// PRECOMPILED ANSWERS
+// ================================================================
+#define PRECOMPILED_MAX_SIZE 0x10000
+#define NOT_PRECOMPILED 0xFFFFFFFF // answer_first of a name whose answers are too big - it takes the regular path
+
+static void put_u16(char* position, uint16_t value)
+{
+    position[0] = (char)(value >> 8);
+    position[1] = (char)(value & 0xFF);
+}
+
+int build_zone_answers(dns_zone_t* zone)
+{
+    free(zone->answers);
+    free(zone->wire);
+    zone->answers = NULL;
+    zone->answer_count = 0;
+    zone->wire = NULL;
+    zone->wire_size = 0;
+
+    // a name is only precompiled for the types present in the zone (and ANY)
+    // for any other type dns_add_records cannot add anything, so the answer is always empty
+    uint16_t types[16];
+    unsigned int type_count = 0;
+
+    types[type_count++] = DNS_TYPE_ANY;
+    for (unsigned int i = 0; i < zone->record_count; i++)
+    {
+        unsigned int t = 0;
+        while (t < type_count && types[t] != zone->records[i].type)
+            t++;
+
+        if (t == type_count && type_count < sizeof(types)/sizeof(types[0]))
+            types[type_count++] = zone->records[i].type;
+    }
+
+    unsigned int answers_capacity = 0;
+    unsigned int wire_capacity = 0;
+    char* scratch = (char*)malloc(PRECOMPILED_MAX_SIZE);
+    arena_t* arena = arena_create(0); // reset by every free_dns_transaction below
+
+    if (scratch == NULL || arena == NULL)
+    {
+        free(scratch);
+        arena_free(arena);
+        return -1;
+    }
+
+    for (unsigned int b = 0; b < zone->index_size; b++)
+    {
+        dns_zone_bucket_t* bucket = &zone->index[b];
+        if (bucket->count == 0)
+            continue;
+
+        bucket->answer_first = zone->answer_count;
+        bucket->answer_count = 0;
+
+        for (unsigned int t = 0; t < type_count; t++)
+        {
+            // run the regular responder on a query for this (name, type) and keep the serialized sections
+            dns_question_t question = { .qtype = types[t], .qclass = DNS_CLASS_IN };
+            strcpy(question.qname, zone->names + bucket->name);
+
+            dns_transaction_t query = { .header = { .QDCount = 1 }, .questions = &question };
+            dns_transaction_t* reply = create_dns_reply(&query, arena);
+            int found = 0;
+
+            if (reply == NULL)
+                goto fail;
+
+            if (dns_add_records(question.qname, question.qtype, reply, zone, &found, NULL) == 0)
+            {
+                free_dns_transaction(reply);
+                continue; // empty answers are implicit
+            }
+
+            // worst case size of the message - write_dns_transaction only checks the limit between records
+            unsigned int record_total = reply->header.ANCount + reply->header.NSCount + reply->header.ARCount;
+            if (12 + QNAME_SIZE + 4 + (record_total + 1) * (QNAME_SIZE + 10 + RDATA_SIZE) > PRECOMPILED_MAX_SIZE)
+            {
+                free_dns_transaction(reply);
+                zone->answer_count = bucket->answer_first;
+                bucket->answer_first = NOT_PRECOMPILED;
+                bucket->answer_count = 0;
+                break;
+            }
+
+            int question_length = domain_plain_to_label(question.qname, scratch) + 4;
+            int total = write_dns_transaction(scratch, PRECOMPILED_MAX_SIZE, reply);
+            uint32_t length = total - 12 - question_length;
+
+            if (zone->answer_count == answers_capacity)
+            {
+                answers_capacity = answers_capacity ? answers_capacity * 2 : 64;
+                dns_zone_answer_t* grown = (dns_zone_answer_t*)realloc(zone->answers, answers_capacity * sizeof(dns_zone_answer_t));
+                if (grown == NULL)
+                {
+                    free_dns_transaction(reply);
+                    goto fail;
+                }
+                zone->answers = grown;
+            }
+
+            dns_zone_answer_t* answer = &zone->answers[zone->answer_count];
+            *answer = (dns_zone_answer_t){
+                .qtype = question.qtype,
+                .ANCount = reply->header.ANCount,
+                .NSCount = reply->header.NSCount,
+                .ARCount = reply->header.ARCount,
+                .offset = zone->wire_size,
+                .length = length,
+            };
+
+            free_dns_transaction(reply);
+
+            // the ANY answer of a name with a single type is often the same as that type's - share the bytes
+            const dns_zone_answer_t* previous = (bucket->answer_count > 0) ? answer - 1 : NULL;
+            if (previous && previous->length == length && memcmp(zone->wire + previous->offset, scratch + 12 + question_length, length) == 0)
+                answer->offset = previous->offset;
+            else
+            {
+                while (zone->wire_size + length > wire_capacity)
+                {
+                    wire_capacity = wire_capacity ? wire_capacity * 2 : 4096;
+                    uint8_t* grown = (uint8_t*)realloc(zone->wire, wire_capacity);
+                    if (grown == NULL)
+                        goto fail;
+                    zone->wire = grown;
+                }
+
+                memcpy(zone->wire + zone->wire_size, scratch + 12 + question_length, length);
+                zone->wire_size += length;
+            }
+
+            zone->answer_count++;
+            bucket->answer_count++;
+        }
+    }
+
+    free(scratch);
+    arena_free(arena);
+    return 0;
+
+    fail:
+    free(scratch);
+    arena_free(arena);
+    return -1;
+}
+
+// writes the reply to a single question query straight from the precompiled answers
+// returns its length, 0 if the name is not in the zone, or -1 if the query must take the regular path
+int write_precompiled_reply(const dns_view_t* query, const dns_zone_t* zone, char* out, int out_size)
+{
+    if (query == NULL || zone == NULL || zone->index == NULL || query->header.QDCount != 1)
+        return -1;
+
+    char qname[QNAME_SIZE + 1];
+    if (dns_view_read_name(query, query->question, qname, sizeof(qname)) < 0)
+        return -1;
+
+    const dns_zone_bucket_t* bucket = lookup_index(zone, qname);
+    if (bucket == NULL)
+        return (find_covering_bucket(zone, qname) != NULL) ? -1 : 0; // the names of wildcards are synthesized by the regular path
+    else if (bucket->answer_first == NOT_PRECOMPILED)
+        return -1;
+
+    // the types without a precompiled answer have an empty one
+    static const dns_zone_answer_t empty = { 0 };
+    const dns_zone_answer_t* answer = &empty;
+
+    for (uint32_t a = 0; a < bucket->answer_count; a++)
+    {
+        if (zone->answers[bucket->answer_first + a].qtype == query->qtype)
+        {
+            answer = &zone->answers[bucket->answer_first + a];
+            break;
+        }
+    }
+
+    // the records point into the question by offset, so it must have been sent uncompressed
+    int question_length = query->question_end - query->question;
+    if (question_length != (int)strlen(qname) + 1 + 4)
+        return -1;
+
+    int total = 12 + question_length + (int)answer->length;
+    if (total > out_size)
+        return -1;
+
+    // header - same flags create_dns_reply would give
+    put_u16(out, query->header.id);
+    put_u16(out + 2, query->header.flags | QR_RESPONSE | FLAG_AA);
+    put_u16(out + 4, 1);
+    put_u16(out + 6, answer->ANCount);
+    put_u16(out + 8, answer->NSCount);
+    put_u16(out + 10, answer->ARCount);
+
+    // the question goes back exactly as the client sent it, followed by the records
+    memcpy(out + 12, query->dgram + query->question, question_length);
+    memcpy(out + 12 + question_length, zone->wire + answer->offset, answer->length);
+
+    return total;
+}
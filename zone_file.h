@@ -20,9 +20,82 @@
 
 #include "dns_protocol.h"
 
-void print_records_collection(dns_answer_t* first, int count);
-unsigned read_zone_file(const char* filename, dns_answer_t** pointer_to_records);
-int find_next_dns_match(const char* domain, dns_answer_t* collection, unsigned int count, int previous);
-dns_transaction_t*  build_dns_reply_from_query(dns_transaction_t* query, dns_answer_t *dns_record_collection, unsigned int dns_record_count);
+// one record of the zone - the name and the data are kept in the pools of the zone, and the class is always IN
+typedef struct dns_zone_record {
+    uint32_t name;      // offset of the owner name in the name pool
+    uint32_t rdata;     // offset of the data in the rdata pool
+    uint32_t ttl;
+    uint16_t type;
+    uint16_t rdlength;
+} dns_zone_record_t;
+
+// one bucket of the name index - points to the contiguous range of records owned by one name
+typedef struct dns_zone_bucket {
+    uint32_t hash;      // low bits of the hash of the canonical (lowercase) owner name
+    uint32_t first;     // index of the first record of the RRset inside the collection
+    uint32_t count;     // number of records in the RRset - zero marks an empty bucket
+    uint32_t name;      // offset of the owner name in the name pool
+    uint32_t answer_first; // precompiled answers of this name
+    uint32_t answer_count;
+} dns_zone_bucket_t;
+
+// one node of the name tree - the owner names label by label from the root (com -> example -> www)
+// owners named "*.<name>" are RFC 4592 wildcards, and "**.<name>" cover every name below <name>
+#define NO_BUCKET 0xFFFFFFFF
+typedef struct dns_zone_node {
+    uint32_t label;     // offset of the label in the name pool
+    uint32_t label_length;
+    uint32_t children;  // index of the first child - the children of a node are contiguous and sorted by label
+    uint32_t child_count;
+    uint32_t bucket;    // index bucket of the name ending here - NO_BUCKET for the names only present as ancestors
+    uint32_t wildcard;  // bucket of the "*" child
+    uint32_t subtree;   // bucket of the "**" child
+} dns_zone_node_t;
+
+// the answer sections for one (name, qtype) pair, serialized once when the zone is loaded
+typedef struct dns_zone_answer {
+    uint16_t qtype;
+    uint16_t ANCount;
+    uint16_t NSCount;
+    uint16_t ARCount;
+    uint32_t offset;    // where the encoded records start inside the wire pool
+    uint32_t length;
+} dns_zone_answer_t;
+
+typedef struct dns_zone {
+    dns_zone_record_t* records; // all the records, grouped so those of the same owner name are contiguous
+    unsigned int record_count;
+    char* names;                // name pool - every owner name once, in plain text and NUL terminated
+    unsigned int names_size;
+    uint8_t* rdata;             // rdata pool - the data of the records, as in the datagrams
+    unsigned int rdata_size;
+    uint32_t* seeds;            // perfect hash displacements - the names of each group use their own seed
+    unsigned int seed_count;    // number of groups - always a power of two
+    dns_zone_bucket_t* index;   // one bucket per name at the slot picked by the perfect hash - the others are empty
+    unsigned int index_size;    // number of buckets - always a power of two
+    dns_zone_node_t* nodes;     // name tree, with the root first - only built when there are wildcard or subtree owners
+    unsigned int node_count;
+    dns_zone_answer_t* answers; // precompiled answers, grouped by name
+    unsigned int answer_count;
+    uint8_t* wire;              // encoded records the precompiled answers point into
+    unsigned int wire_size;
+    const void* image;          // compiled image the arrays above are mapped from - NULL if they were allocated
+    size_t image_size;
+} dns_zone_t;
+
+void print_records_collection(const dns_zone_t* zone);
+void get_zone_answer(const dns_zone_t* zone, unsigned int record, dns_answer_t* answer);
+int read_zone_file(const char* filename, dns_zone_t* zone);
+int parse_zone_file(const char* filename, dns_zone_t* zone);
+const char* map_zone_file(const char* filename, size_t* size);
+void unmap_zone_file(const char* text, size_t size);
+int build_zone_index(dns_zone_t* zone);
+int check_zone_chains(dns_zone_t* zone);
+int build_zone_answers(dns_zone_t* zone);
+void free_zone(dns_zone_t* zone);
+int find_dns_rrset(const dns_zone_t* zone, const char* domain, unsigned int* count);
+dns_transaction_t*  build_dns_reply_from_query(dns_transaction_t* query, const dns_zone_t* zone, arena_t* arena);
+dns_transaction_t*  build_dns_reply_from_view(const dns_view_t* query, const dns_zone_t* zone, arena_t* arena);
+int write_precompiled_reply(const dns_view_t* query, const dns_zone_t* zone, char* out, int out_size);
 
 #endif // _ZONE_FILE_H_
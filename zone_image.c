@@ -0,0 +1,360 @@
+// ===================================================================================  //
+//    This program is free software: you can redistribute it and/or modify              //
+//    it under the terms of the GNU General Public License as published by              //
+//    the Free Software Foundation, either version 3 of the License, or                 //
+//    (at your option) any later version.                                               //
+//                                                                                      //
+//    This program is distributed in the hope that it will be useful,                   //
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of                    //
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                     //
+//    GNU General Public License for more details.                                      //
+//                                                                                      //
+//    You should have received a copy of the GNU General Public License                 //
+//    along with this program.  If not, see <https://www.gnu.org/licenses/>.            //
+//                                                                                      //
+//    Copyright: Luiz Gustavo Pfitscher e Feldmann, 2020                                //
+// ===================================================================================  //
+
+#include "zone_image.h"
+#include "logger.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+    #include <windows.h>
+#endif
+
+// IMAGE LAYOUT
+// ================================================================
+// header | records | names | rdata | seeds | index | nodes | answers | wire - every part starts at a multiple of IMAGE_ALIGNMENT
+#define IMAGE_MAGIC "DNSZONE"
+#define IMAGE_ALIGNMENT 64
+#define IMAGE_BYTE_ORDER 0x01020304u
+
+enum zone_image_section {
+    SECTION_RECORDS,
+    SECTION_NAMES,
+    SECTION_RDATA,
+    SECTION_SEEDS,
+    SECTION_INDEX,
+    SECTION_NODES,
+    SECTION_ANSWERS,
+    SECTION_WIRE,
+    SECTION_COUNT,
+};
+
+typedef struct zone_image_extent {
+    uint64_t offset;            // from the start of the image
+    uint64_t size;              // in bytes, without the padding after it
+} zone_image_extent_t;
+
+typedef struct zone_image_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;        // IMAGE_BYTE_ORDER as the compiling machine stores it
+    uint32_t header_size;
+    uint32_t record_size;       // the structures are stored as they are in memory - the image only fits a build with the same ones
+    uint32_t bucket_size;
+    uint32_t node_size;
+    uint32_t answer_size;
+    uint32_t reserved;
+    uint64_t source_size;       // the zone file when the image was compiled - when it changes the image is stale
+    int64_t source_mtime;       // in nanoseconds (100 ns steps on windows), so an edit in the second of the compile still shows
+    uint32_t record_count;
+    uint32_t names_size;
+    uint32_t rdata_size;
+    uint32_t seed_count;
+    uint32_t index_size;
+    uint32_t node_count;
+    uint32_t answer_count;
+    uint32_t wire_size;
+    zone_image_extent_t sections[SECTION_COUNT];
+    uint64_t checksum;          // of everything after the header
+    uint64_t header_checksum;   // of the header up to this field
+} zone_image_header_t;
+
+static uint64_t align_image(uint64_t offset)
+{
+    return (offset + IMAGE_ALIGNMENT - 1) & ~(uint64_t)(IMAGE_ALIGNMENT - 1);
+}
+
+// a word at a time - the sizes are always multiples of 8 (the sections are padded)
+static uint64_t checksum_words(uint64_t hash, const uint8_t* data, size_t size)
+{
+    for (size_t i = 0; i < size; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+
+        hash ^= word * 0x9E3779B97F4A7C15ull;
+        hash = ((hash << 27) | (hash >> 37)) * 0xC2B2AE3D27D4EB4Full;
+    }
+
+    return hash;
+}
+
+#define CHECKSUM_SEED 0x5A6F6E65496D6167ull
+
+static int stat_source(const char* source, uint64_t* size, int64_t* mtime)
+{
+    #ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA info;
+    if (!GetFileAttributesExA(source, GetFileExInfoStandard, &info))
+        return -1;
+
+    *size = ((uint64_t)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+    *mtime = (int64_t)((((uint64_t)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime) * 100);
+    #else
+    struct stat info;
+    if (stat(source, &info) != 0)
+        return -1;
+
+    *size = (uint64_t)info.st_size;
+    #if defined(__APPLE__)
+    *mtime = (int64_t)info.st_mtimespec.tv_sec * 1000000000 + info.st_mtimespec.tv_nsec;
+    #elif defined(st_mtime) || defined(_POSIX_C_SOURCE) && _POSIX_C_SOURCE >= 200809L
+    *mtime = (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+    #else
+    *mtime = (int64_t)info.st_mtime * 1000000000; // whole seconds only
+    #endif
+    #endif
+
+    return 0;
+}
+
+// WRITING
+// ================================================================
+typedef struct image_writer {
+    FILE* fp;
+    uint64_t checksum;
+} image_writer_t;
+
+// writes the section followed by the zeros up to the next alignment
+static int write_section(image_writer_t* writer, const void* data, size_t size)
+{
+    uint8_t padding[IMAGE_ALIGNMENT] = { 0 };
+    size_t whole = size & ~(size_t)7;
+    size_t rest = align_image(size) - whole; // the tail of the data and the zeros - never more than IMAGE_ALIGNMENT
+
+    memcpy(padding, (const uint8_t*)data + whole, size - whole);
+
+    if ((whole > 0 && fwrite(data, 1, whole, writer->fp) != whole) || fwrite(padding, 1, rest, writer->fp) != rest)
+        return -1;
+
+    writer->checksum = checksum_words(writer->checksum, (const uint8_t*)data, whole);
+    writer->checksum = checksum_words(writer->checksum, padding, rest);
+    return 0;
+}
+
+// compiles the zone into an image - written aside and renamed, so the processes mapping the old one keep it
+int write_zone_image(const dns_zone_t* zone, const char* source, const char* filename)
+{
+    zone_image_header_t header;
+    memset(&header, 0, sizeof(header));
+
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+    header.version = ZONE_IMAGE_VERSION;
+    header.byte_order = IMAGE_BYTE_ORDER;
+    header.header_size = sizeof(zone_image_header_t);
+    header.record_size = sizeof(dns_zone_record_t);
+    header.bucket_size = sizeof(dns_zone_bucket_t);
+    header.node_size = sizeof(dns_zone_node_t);
+    header.answer_size = sizeof(dns_zone_answer_t);
+    header.record_count = zone->record_count;
+    header.names_size = zone->names_size;
+    header.rdata_size = zone->rdata_size;
+    header.seed_count = zone->seed_count;
+    header.index_size = zone->index_size;
+    header.node_count = zone->node_count;
+    header.answer_count = zone->answer_count;
+    header.wire_size = zone->wire_size;
+
+    if (stat_source(source, &header.source_size, &header.source_mtime) != 0)
+    {
+        LOG_ERROR(LOG_ZONE, "Error reading the attributes of %s: %d %s", source, errno, strerror(errno));
+        return -1;
+    }
+
+    const void* data[SECTION_COUNT] = { zone->records, zone->names, zone->rdata, zone->seeds, zone->index, zone->nodes, zone->answers, zone->wire };
+    uint64_t sizes[SECTION_COUNT] = {
+        (uint64_t)zone->record_count * sizeof(dns_zone_record_t),
+        (uint64_t)zone->names_size,
+        (uint64_t)zone->rdata_size,
+        (uint64_t)zone->seed_count * sizeof(uint32_t),
+        (uint64_t)zone->index_size * sizeof(dns_zone_bucket_t),
+        (uint64_t)zone->node_count * sizeof(dns_zone_node_t),
+        (uint64_t)zone->answer_count * sizeof(dns_zone_answer_t),
+        (uint64_t)zone->wire_size,
+    };
+
+    uint64_t offset = align_image(sizeof(zone_image_header_t));
+    for (int s = 0; s < SECTION_COUNT; s++)
+    {
+        header.sections[s] = (zone_image_extent_t){ .offset = offset, .size = sizes[s] };
+        offset = align_image(offset + sizes[s]);
+    }
+
+    char temporary[FILENAME_MAX];
+    if (snprintf(temporary, sizeof(temporary), "%s.tmp", filename) >= (int)sizeof(temporary))
+        return -1;
+
+    image_writer_t writer = { .fp = fopen(temporary, "wb"), .checksum = CHECKSUM_SEED };
+    if (writer.fp == NULL)
+    {
+        LOG_ERROR(LOG_ZONE, "Error creating %s: %d %s", temporary, errno, strerror(errno));
+        return -1;
+    }
+
+    // the header is written again once the checksum is known
+    int failed = (write_section(&writer, &header, sizeof(header)) != 0);
+    writer.checksum = CHECKSUM_SEED;
+
+    for (int s = 0; s < SECTION_COUNT && !failed; s++)
+        failed = (write_section(&writer, data[s], sizes[s]) != 0);
+
+    header.checksum = writer.checksum;
+    header.header_checksum = checksum_words(CHECKSUM_SEED, (const uint8_t*)&header, offsetof(zone_image_header_t, header_checksum));
+
+    if (!failed)
+        failed = (fseek(writer.fp, 0, SEEK_SET) != 0 || fwrite(&header, 1, sizeof(header), writer.fp) != sizeof(header));
+
+    if (fclose(writer.fp) != 0)
+        failed = 1;
+
+    #ifdef _WIN32
+    if (!failed && !MoveFileExA(temporary, filename, MOVEFILE_REPLACE_EXISTING))
+    #else
+    if (!failed && rename(temporary, filename) != 0)
+    #endif
+        failed = 1;
+
+    if (failed)
+    {
+        LOG_ERROR(LOG_ZONE, "Error writing %s: %d %s", filename, errno, strerror(errno));
+        remove(temporary);
+        return -1;
+    }
+
+    return 0;
+}
+
+// MAPPING
+// ================================================================
+static int is_power_of_two(uint32_t value)
+{
+    return value != 0 && (value & (value - 1)) == 0;
+}
+
+// tells what is wrong with the image, or NULL if it can be used
+static const char* check_zone_image(const uint8_t* image, size_t size)
+{
+    const zone_image_header_t* header = (const zone_image_header_t*)image;
+
+    if (size < align_image(sizeof(zone_image_header_t)) || size % IMAGE_ALIGNMENT != 0 || memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) != 0)
+        return "not a zone image";
+
+    if (header->version != ZONE_IMAGE_VERSION)
+        return "compiled for another version";
+
+    if (header->byte_order != IMAGE_BYTE_ORDER || header->header_size != sizeof(zone_image_header_t) || header->record_size != sizeof(dns_zone_record_t) ||
+        header->bucket_size != sizeof(dns_zone_bucket_t) || header->node_size != sizeof(dns_zone_node_t) || header->answer_size != sizeof(dns_zone_answer_t))
+        return "compiled for another platform";
+
+    if (header->header_checksum != checksum_words(CHECKSUM_SEED, image, offsetof(zone_image_header_t, header_checksum)))
+        return "corrupt header";
+
+    uint64_t sizes[SECTION_COUNT] = {
+        (uint64_t)header->record_count * sizeof(dns_zone_record_t),
+        (uint64_t)header->names_size,
+        (uint64_t)header->rdata_size,
+        (uint64_t)header->seed_count * sizeof(uint32_t),
+        (uint64_t)header->index_size * sizeof(dns_zone_bucket_t),
+        (uint64_t)header->node_count * sizeof(dns_zone_node_t),
+        (uint64_t)header->answer_count * sizeof(dns_zone_answer_t),
+        (uint64_t)header->wire_size,
+    };
+
+    for (int s = 0; s < SECTION_COUNT; s++)
+    {
+        const zone_image_extent_t* section = &header->sections[s];
+        if (section->size != sizes[s] || section->offset % IMAGE_ALIGNMENT != 0 || section->offset < align_image(sizeof(zone_image_header_t)) ||
+            section->offset > size || size - section->offset < section->size)
+            return "corrupt header";
+    }
+
+    if (!is_power_of_two(header->seed_count) || !is_power_of_two(header->index_size))
+        return "corrupt header";
+
+    uint64_t payload = align_image(sizeof(zone_image_header_t));
+    if (header->checksum != checksum_words(CHECKSUM_SEED, image + payload, size - payload))
+        return "checksum mismatch";
+
+    return NULL;
+}
+
+// maps the image into the zone - fails if there is none, or if it does not match the source zone file anymore
+int map_zone_image(const char* filename, const char* source, dns_zone_t* zone)
+{
+    struct stat info;
+    if (stat(filename, &info) != 0)
+        return -1; // not compiled - the usual case
+
+    size_t size = 0;
+    const uint8_t* image = (const uint8_t*)map_zone_file(filename, &size);
+    if (image == NULL)
+        return -1;
+
+    const zone_image_header_t* header = (const zone_image_header_t*)image;
+    const char* problem = check_zone_image(image, size);
+
+    // the source may be left out when deploying the image - then it is used as it is
+    uint64_t source_size;
+    int64_t source_mtime;
+    if (problem == NULL && stat_source(source, &source_size, &source_mtime) == 0 &&
+        (source_size != header->source_size || source_mtime != header->source_mtime))
+        problem = "older than the zone file";
+
+    if (problem != NULL)
+    {
+        LOG_WARNING(LOG_ZONE, "Ignoring the zone image %s (%s): reading %s", filename, problem, source);
+        unmap_zone_file((const char*)image, size);
+        return -1;
+    }
+
+    *zone = (dns_zone_t){
+        .records = (dns_zone_record_t*)(image + header->sections[SECTION_RECORDS].offset),
+        .record_count = header->record_count,
+        .names = (char*)(image + header->sections[SECTION_NAMES].offset),
+        .names_size = header->names_size,
+        .rdata = (uint8_t*)(image + header->sections[SECTION_RDATA].offset),
+        .rdata_size = header->rdata_size,
+        .seeds = (uint32_t*)(image + header->sections[SECTION_SEEDS].offset),
+        .seed_count = header->seed_count,
+        .index = (dns_zone_bucket_t*)(image + header->sections[SECTION_INDEX].offset),
+        .index_size = header->index_size,
+        .nodes = (dns_zone_node_t*)(image + header->sections[SECTION_NODES].offset),
+        .node_count = header->node_count,
+        .answers = (dns_zone_answer_t*)(image + header->sections[SECTION_ANSWERS].offset),
+        .answer_count = header->answer_count,
+        .wire = (uint8_t*)(image + header->sections[SECTION_WIRE].offset),
+        .wire_size = header->wire_size,
+        .image = image,
+        .image_size = size,
+    };
+
+    return 0;
+}
+
+void unmap_zone_image(dns_zone_t* zone)
+{
+    if (zone->image != NULL)
+        unmap_zone_file((const char*)zone->image, zone->image_size);
+
+    zone->image = NULL;
+    zone->image_size = 0;
+}
@@ -0,0 +1,34 @@
+// ===================================================================================  //
+//    This program is free software: you can redistribute it and/or modify              //
+//    it under the terms of the GNU General Public License as published by              //
+//    the Free Software Foundation, either version 3 of the License, or                 //
+//    (at your option) any later version.                                               //
+//                                                                                      //
+//    This program is distributed in the hope that it will be useful,                   //
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of                    //
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                     //
+//    GNU General Public License for more details.                                      //
+//                                                                                      //
+//    You should have received a copy of the GNU General Public License                 //
+//    along with this program.  If not, see <https://www.gnu.org/licenses/>.            //
+//                                                                                      //
+//    Copyright: Luiz Gustavo Pfitscher e Feldmann, 2020                                //
+// ===================================================================================  //
+
+#ifndef _ZONE_IMAGE_H_
+#define _ZONE_IMAGE_H_
+
+#include "zone_file.h"
+
+// A compiled zone is a snapshot of dns_zone_t written as is: a header followed by the records (grouped in
+// RRsets) with their name and rdata pools, the perfect hash seeds and buckets, the name tree, and the
+// precompiled answers with their label-format names.
+// Mapping it gives a ready zone with no parsing and no allocation, shared by every process using it.
+#define ZONE_IMAGE_SUFFIX ".img"    // read_zone_file looks for <zone file>.img
+#define ZONE_IMAGE_VERSION 4        // bumped whenever the layout of the image or of the structures in it changes
+
+int write_zone_image(const dns_zone_t* zone, const char* source, const char* filename);
+int map_zone_image(const char* filename, const char* source, dns_zone_t* zone);
+void unmap_zone_image(dns_zone_t* zone);
+
+#endif // _ZONE_IMAGE_H_